@@ -0,0 +1,357 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Runs a queue, workers echoing their requests back and clients
+ * keeping a window of requests in flight in one process, and reports
+ * the throughput, round-trip latencies and allocations per request
+ * for each payload size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpp.h"
+
+/* Allocation counting */
+
+static volatile gint n_allocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n_members, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+/* zeromq threads allocate too, what they do on behalf of the requests
+ * is part of their cost.
+ */
+void *
+malloc (size_t size)
+{
+  g_atomic_int_inc (&n_allocs);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+  g_atomic_int_inc (&n_allocs);
+  return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  g_atomic_int_inc (&n_allocs);
+  return __libc_realloc (ptr, size);
+}
+
+#define COUNTS_ALLOCATIONS TRUE
+#else
+#define COUNTS_ALLOCATIONS FALSE
+#endif
+
+/* Echoing worker */
+
+#define GPP_TYPE_ECHO_WORKER (gpp_echo_worker_get_type ())
+
+G_DECLARE_FINAL_TYPE (GPPEchoWorker, gpp_echo_worker, GPP, ECHO_WORKER,
+    GPPWorker);
+
+struct _GPPEchoWorker
+{
+  GPPWorker parent;
+};
+
+G_DEFINE_TYPE (GPPEchoWorker, gpp_echo_worker, GPP_TYPE_WORKER);
+
+static gboolean
+handle_bytes (GPPWorker *worker, guint task_id, GBytes *request)
+{
+  gpp_worker_set_task_done_bytes (worker, task_id, request, TRUE);
+  return TRUE;
+}
+
+static void
+gpp_echo_worker_class_init (GPPEchoWorkerClass *klass)
+{
+  GPPWorkerClass *gpp_worker_class = GPP_WORKER_CLASS (klass);
+
+  gpp_worker_class->handle_bytes = handle_bytes;
+}
+
+static void
+gpp_echo_worker_init (GPPEchoWorker *self)
+{
+}
+
+/* Benchmark */
+
+typedef struct _Bench Bench;
+
+typedef struct {
+  Bench *bench;
+  GPPClient *client;
+  gint64 sent_at;
+} Slot;
+
+struct _Bench {
+  GMainLoop *loop;
+  GBytes *payload;
+  Slot *slots;
+  guint n_slots;
+
+  guint n_requests;
+  guint n_sent;
+  guint n_completed;
+  guint n_failed;
+  /* Round-trip times of the completed requests, NULL while warming up */
+  gint64 *latencies;
+};
+
+static gchar *transport = NULL;
+static gint n_workers = 4;
+static gint n_clients = 4;
+static gint concurrency = 4;
+static gint window = 16;
+static gint n_requests = 20000;
+static gint n_warmup_requests = 2000;
+static gchar *sizes = NULL;
+static gint port = 25555;
+
+static GOptionEntry entries[] =
+{
+  { "transport", 't', 0, G_OPTION_ARG_STRING, &transport,
+    "inproc or tcp, defaults to inproc", "TRANSPORT" },
+  { "workers", 'w', 0, G_OPTION_ARG_INT, &n_workers,
+    "Number of workers", "N" },
+  { "clients", 'c', 0, G_OPTION_ARG_INT, &n_clients,
+    "Number of clients", "M" },
+  { "concurrency", 0, 0, G_OPTION_ARG_INT, &concurrency,
+    "Number of tasks each worker handles at a time", "N" },
+  { "window", 0, 0, G_OPTION_ARG_INT, &window,
+    "Number of requests each client keeps in flight", "N" },
+  { "requests", 'n', 0, G_OPTION_ARG_INT, &n_requests,
+    "Number of requests measured for each payload size", "N" },
+  { "warmup", 0, 0, G_OPTION_ARG_INT, &n_warmup_requests,
+    "Number of requests made before measuring", "N" },
+  { "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+    "Comma-separated payload sizes, defaults to 16,1024,65536", "SIZES" },
+  { "port", 'p', 0, G_OPTION_ARG_INT, &port,
+    "First of the two TCP ports the queue binds", "PORT" },
+  { NULL }
+};
+
+static void send_request (Slot *slot);
+
+static void
+request_handled_cb (GPPClient *client, gboolean success, GBytes *reply,
+    Slot *slot)
+{
+  Bench *bench = slot->bench;
+
+  if (!success)
+    bench->n_failed++;
+  else if (bench->latencies)
+    bench->latencies[bench->n_completed - bench->n_failed] =
+        g_get_monotonic_time () - slot->sent_at;
+
+  if (++bench->n_completed == bench->n_requests)
+    g_main_loop_quit (bench->loop);
+  else if (bench->n_sent < bench->n_requests)
+    send_request (slot);
+}
+
+static void
+send_request (Slot *slot)
+{
+  Bench *bench = slot->bench;
+
+  bench->n_sent++;
+  slot->sent_at = g_get_monotonic_time ();
+  gpp_client_send_bytes (slot->client, bench->payload, 0,
+      (GPPBytesRequestHandledFunc) request_handled_cb, slot, NULL);
+}
+
+static void
+run_requests (Bench *bench, guint requests)
+{
+  guint i;
+
+  if (!requests)
+    return;
+
+  bench->n_requests = requests;
+  bench->n_sent = 0;
+  bench->n_completed = 0;
+  bench->n_failed = 0;
+
+  for (i = 0; i < bench->n_slots && bench->n_sent < requests; i++)
+    send_request (&bench->slots[i]);
+
+  g_main_loop_run (bench->loop);
+}
+
+static gint
+compare_latencies (gconstpointer a, gconstpointer b)
+{
+  gint64 la = *(const gint64 *) a, lb = *(const gint64 *) b;
+
+  return la < lb ? -1 : la > lb;
+}
+
+static gint64
+percentile (gint64 *sorted, guint n, gdouble pct)
+{
+  guint rank = (guint) (n * pct / 100.0 + 0.5);
+
+  if (!n)
+    return 0;
+
+  return sorted[CLAMP (rank, 1, n) - 1];
+}
+
+static void
+run_size (Bench *bench, gsize size)
+{
+  gpointer data = g_malloc0 (size);
+  gint64 start, elapsed;
+  gint allocs;
+  guint n_ok;
+
+  bench->payload = g_bytes_new_take (data, size);
+  bench->latencies = g_new (gint64, n_requests);
+
+  allocs = g_atomic_int_get (&n_allocs);
+  start = g_get_monotonic_time ();
+  run_requests (bench, n_requests);
+  elapsed = MAX (1, g_get_monotonic_time () - start);
+  allocs = g_atomic_int_get (&n_allocs) - allocs;
+
+  n_ok = bench->n_completed - bench->n_failed;
+  qsort (bench->latencies, n_ok, sizeof (gint64), compare_latencies);
+
+  g_print ("%-6s %8" G_GSIZE_FORMAT " bytes %10.0f req/s"
+      "  p50 %6" G_GINT64_FORMAT " us  p99 %6" G_GINT64_FORMAT " us"
+      "  p999 %6" G_GINT64_FORMAT " us",
+      transport, size, (gdouble) bench->n_completed * G_USEC_PER_SEC / elapsed,
+      percentile (bench->latencies, n_ok, 50),
+      percentile (bench->latencies, n_ok, 99),
+      percentile (bench->latencies, n_ok, 99.9));
+  if (COUNTS_ALLOCATIONS)
+    g_print ("  %6.1f allocs/req", (gdouble) allocs / MAX (1, bench->n_completed));
+  if (bench->n_failed)
+    g_print ("  %u failed", bench->n_failed);
+  g_print ("\n");
+
+  g_clear_pointer (&bench->latencies, g_free);
+  g_clear_pointer (&bench->payload, g_bytes_unref);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gchar *frontend, *backend;
+  gchar **size_strings, **size;
+  GPPQueue *queue;
+  GPPWorker **workers;
+  GPPClient **clients;
+  Bench bench = { NULL, };
+  gint i, j;
+
+  context = g_option_context_new ("- benchmark a queue with its workers "
+      "and clients");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free (context);
+
+  if (!transport)
+    transport = g_strdup ("inproc");
+  if (!sizes)
+    sizes = g_strdup ("16,1024,65536");
+
+  if (g_strcmp0 (transport, "inproc") == 0) {
+    frontend = g_strdup ("inproc://gpp-bench-frontend");
+    backend = g_strdup ("inproc://gpp-bench-backend");
+  } else if (g_strcmp0 (transport, "tcp") == 0) {
+    frontend = g_strdup_printf ("tcp://127.0.0.1:%d", port);
+    backend = g_strdup_printf ("tcp://127.0.0.1:%d", port + 1);
+  } else {
+    g_printerr ("Unknown transport %s\n", transport);
+    return 1;
+  }
+
+  bench.loop = g_main_loop_new (NULL, FALSE);
+
+  /* inproc endpoints have to be bound before anything connects */
+  queue = g_object_new (GPP_TYPE_QUEUE, "frontend-endpoint", frontend,
+      "backend-endpoint", backend, "max-pending-requests", 0, NULL);
+  gpp_queue_start (queue);
+
+  workers = g_new (GPPWorker *, n_workers);
+  for (i = 0; i < n_workers; i++) {
+    workers[i] = g_object_new (GPP_TYPE_ECHO_WORKER, "queue-endpoint", backend,
+        "concurrency", concurrency, NULL);
+    gpp_worker_start (workers[i]);
+  }
+
+  clients = g_new (GPPClient *, n_clients);
+  bench.n_slots = n_clients * window;
+  bench.slots = g_new0 (Slot, bench.n_slots);
+  for (i = 0; i < n_clients; i++) {
+    clients[i] = g_object_new (GPP_TYPE_CLIENT, "queue-endpoint", frontend,
+        NULL);
+    for (j = 0; j < window; j++) {
+      bench.slots[i * window + j].bench = &bench;
+      bench.slots[i * window + j].client = clients[i];
+    }
+  }
+
+  g_print ("%d workers handling %d tasks each, %d clients with %d requests "
+      "in flight each, %d requests per size\n", n_workers, concurrency,
+      n_clients, window, n_requests);
+
+  /* Lets the workers connect, and the allocators warm up */
+  bench.payload = g_bytes_new_static ("warmup", 6);
+  run_requests (&bench, n_warmup_requests);
+  g_clear_pointer (&bench.payload, g_bytes_unref);
+
+  size_strings = g_strsplit (sizes, ",", -1);
+  for (size = size_strings; *size; size++)
+    run_size (&bench, g_ascii_strtoull (*size, NULL, 10));
+  g_strfreev (size_strings);
+
+  for (i = 0; i < n_clients; i++)
+    g_object_unref (clients[i]);
+  for (i = 0; i < n_workers; i++)
+    g_object_unref (workers[i]);
+  g_object_unref (queue);
+  g_free (clients);
+  g_free (workers);
+  g_free (bench.slots);
+  g_main_loop_unref (bench.loop);
+  g_free (frontend);
+  g_free (backend);
+
+  return 0;
+}
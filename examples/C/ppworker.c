@@ -3,6 +3,7 @@
 #include "gpp.h"
 
 #define FAILURE_ODDS 4
+#define CONCURRENCY 4
 
 #define GPP_TYPE_MULTIPLYING_WORKER (gpp_multiplying_worker_get_type ())
 
@@ -13,29 +14,43 @@ struct _GPPMultiplyingWorker
 {
   GPPWorker parent;
   GRand *rand_source;
-  gchar *reply;
 };
 
 G_DEFINE_TYPE (GPPMultiplyingWorker, gpp_multiplying_worker, GPP_TYPE_WORKER);
 
+typedef struct
+{
+  GPPMultiplyingWorker *self;
+  guint task_id;
+  gchar *reply;
+} Task;
+
 static gboolean
-set_task_done (GPPMultiplyingWorker * self)
+set_task_done (Task * task)
 {
+  GPPMultiplyingWorker *self = task->self;
+
   g_print ("one task done\n");
   if (g_rand_int (self->rand_source) % FAILURE_ODDS == 0) {
     g_print ("Actually it didn't work sorry\n");
-    gpp_worker_set_task_done (GPP_WORKER (self), NULL, FALSE);
+    gpp_worker_set_task_done (GPP_WORKER (self), task->task_id, NULL, FALSE);
   } else {
     g_print ("no problem !!\n");
-    gpp_worker_set_task_done (GPP_WORKER (self), self->reply, TRUE);
+    gpp_worker_set_task_done (GPP_WORKER (self), task->task_id, task->reply,
+        TRUE);
   }
+
+  g_free (task->reply);
+  g_free (task);
   return FALSE;
 }
 
 static gboolean
-handle_request (GPPWorker * worker, const gchar * request)
+handle_request (GPPWorker * worker, guint task_id, const gchar * request)
 {
   GPPMultiplyingWorker *self = GPP_MULTIPLYING_WORKER (worker);
+  Task *task;
+
   g_print ("doing one task, request is %s\n", request);
 
   if (g_rand_int (self->rand_source) % FAILURE_ODDS == 0) {
@@ -43,8 +58,11 @@ handle_request (GPPWorker * worker, const gchar * request)
     return FALSE;
   }
 
-  self->reply = g_strdup_printf ("Result : %d", atoi (request) * 2);
-  g_timeout_add (1000, (GSourceFunc) set_task_done, self);
+  task = g_new (Task, 1);
+  task->self = self;
+  task->task_id = task_id;
+  task->reply = g_strdup_printf ("Result : %d", atoi (request) * 2);
+  g_timeout_add (1000, (GSourceFunc) set_task_done, task);
   return TRUE;
 }
 
@@ -74,7 +92,8 @@ main (void)
 {
   GMainLoop *loop = g_main_loop_new (NULL, FALSE);
   GPPMultiplyingWorker *worker =
-      g_object_new (GPP_TYPE_MULTIPLYING_WORKER, NULL);
+      g_object_new (GPP_TYPE_MULTIPLYING_WORKER, "concurrency", CONCURRENCY,
+      NULL);
 
   g_unix_signal_add_full (G_PRIORITY_HIGH, SIGINT, (GSourceFunc) interrupted_cb,
       loop, NULL);
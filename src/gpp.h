@@ -3,6 +3,8 @@
 
 #include "gppqueue.h"
 #include "gppworker.h"
+#include "gppthreadedworker.h"
 #include "gppclient.h"
+#include "gppcontext.h"
 
 #endif
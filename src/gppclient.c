@@ -21,26 +21,106 @@
 #include <czmq.h>
 
 #include "gpputils.h"
+#include "gppstats.h"
+#include "gpptrace.h"
+#include "gpptimerwheel.h"
+#include "gppzmqsource.h"
 #include "gppclient.h"
 
 #define REQUEST_RETRIES     3
-#define SERVER_ENDPOINT     "tcp://localhost:5555"
+#define DEFAULT_QUEUE_ENDPOINT "tcp://localhost:5555"
+#define DEFAULT_DISPATCH_BUDGET 64
+#define DEFAULT_FAILOVER_TIMEOUT 5000
+#define DEFAULT_MAX_DECOMPRESSED_SIZE (64 * 1024 * 1024)
+/* Longest time a queue that stopped answering is left alone, in ms */
+#define MAX_FAILOVER_BACKOFF 60000
+#define LATENCY_EWMA_WEIGHT 0.2
+/* How late requests may be failed past their deadline, in ms */
+#define DEADLINE_RESOLUTION 10
 
 enum
 {
   REQUEST_HANDLED,
+  REQUEST_PROGRESS,
   LAST_SIGNAL
 };
 
 static guint gpp_client_signals[LAST_SIGNAL] = { 0 };
 
+enum
+{
+  PROP_0,
+  PROP_CONTEXT,
+  PROP_QUEUE_ENDPOINT,
+  PROP_QUEUE_ENDPOINTS,
+  PROP_FAILOVER_TIMEOUT,
+  PROP_TIMEOUT,
+  PROP_PRIORITY,
+  PROP_DISPATCH_BUDGET,
+  PROP_STATS_ENDPOINT,
+  PROP_TRACE_RATIO,
+  PROP_COMPRESSION_THRESHOLD,
+  PROP_MAX_DECOMPRESSED_SIZE,
+  PROP_IN_FLIGHT_REQUESTS,
+  PROP_COMPLETED_REQUESTS,
+  PROP_FAILED_REQUESTS,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 /**
  * SECTION: gppclient
  *
  * #GPPClient sends requests to a #GPPQueue, and emits a signal
  * with the possible reply and the status of the task once it has been executed.
  *
- * A per-request retry limit can be set when calling gpp_client_send_request()
+ * Any number of requests can be in flight at the same time, each of them
+ * is tagged with an identifier that the #GPPQueue and the #GPPWorker send
+ * back with the reply.
+ *
+ * Requests rejected by an overloaded #GPPQueue fail right away, without
+ * being retried. Requests can also be given a time budget, with
+ * #GPPClient:timeout or per request with
+ * gpp_client_send_request_with_timeout() and gpp_client_send_bytes_full().
+ * The #GPPQueue won't hand them to a worker once it is exhausted, and
+ * the client fails them as soon as it is, whether or not a reply came.
+ *
+ * Urgent requests can be sent with a lower #GPPClient:priority, the
+ * #GPPQueue hands them to workers before the requests of higher
+ * priorities waiting alongside them.
+ *
+ * A per-request retry limit can be set when calling gpp_client_send_request(),
+ * gpp_client_send_request_full() additionally lets one pass a per-request
+ * callback. Binary requests and replies can be exchanged without copies
+ * with gpp_client_send_bytes(), gpp_client_send_bytes_with_key() makes
+ * the #GPPQueue send requests with the same key to the same worker,
+ * as long as it isn't overloaded. Many small requests can be sent
+ * as a single message with gpp_client_send_batch(), saving most of
+ * the cost of a round trip per request.
+ *
+ * Workers can stream their replies in chunks, the client emits
+ * #GPPClient::request-progress for each of them as they arrive, before
+ * the request is handled.
+ *
+ * A client can spread its requests across several queues, see
+ * #GPPClient:queue-endpoints. Requests go to the queue that answers
+ * the fastest given how many requests it has in flight, and the
+ * requests of a queue that stops answering are sent again to the
+ * other ones, see #GPPClient:failover-timeout.
+ *
+ * The outcome of the requests and their round-trip times are kept
+ * track of, see gpp_client_get_stats() and #GPPClient:stats-endpoint.
+ * To find out where the time of a request goes, a share of them can
+ * be traced through the queue and the worker with
+ * #GPPClient:trace-ratio.
+ *
+ * Large requests can be compressed with #GPPClient:compression-threshold,
+ * the #GPPQueue forwards them as they are and the #GPPWorker
+ * decompresses them before handling them. Compressed replies are
+ * decompressed before being handed to the callbacks, requests whose
+ * reply is larger than #GPPClient:max-decompressed-size once
+ * decompressed fail.
  *
  * {{ ppclient.markdown }}
  */
@@ -48,72 +128,681 @@ static guint gpp_client_signals[LAST_SIGNAL] = { 0 };
 struct _GPPClient
 {
   GObject parent;
+  GPPContext *gpp_context;
   zctx_t *ctx;
 
-  void *backend;
-  guint backend_source;
+  gchar *queue_endpoint;
+  gchar **queue_endpoints;
+  GPtrArray *brokers;
+  guint failover_timeout;
+  guint failover_source;
+  guint dispatch_budget;
 
-  const gchar *current_request;
-  gint retries_left;
+  /* Kept by all our sockets, so that a queue started again after a
+   * crash can still reply to the requests it had from us.
+   */
+  gchar *identity;
+  GHashTable *requests;
+  guint32 next_request_id;
+  guint timeout;
+  /* Fails the requests that ran out of time */
+  GPPTimerWheel *deadlines;
+  guint deadline_source;
+  guint n_deadlines;
+  guint priority;
+  gdouble trace_ratio;
+  guint compression_threshold;
+  guint64 max_decompressed_size;
+
+  /* Statistics */
+  guint64 n_sent;
+  guint64 n_succeeded;
+  guint64 n_failed;
+  guint64 n_retries;
+  guint64 n_overloaded;
+  guint64 n_timed_out;
+  guint64 n_failovers;
+  /* From a request being made to it being handled, retries included */
+  GPPHistogram round_trip;
+  gchar *stats_endpoint;
+  GPPStatsServer *stats_server;
 };
 
 G_DEFINE_TYPE (GPPClient, gpp_client, G_TYPE_OBJECT);
 
+/* Brokers */
+
+/* One per queue the client sends requests to */
+typedef struct {
+  GPPClient *client;
+  gchar *endpoint;
+  void *socket;
+  guint source;
+
+  guint n_in_flight;
+  /* Moving average of the round-trip time of its replies */
+  gdouble latency_ewma;
+  /* Last time it answered, or was sent a request while it had none in
+   * flight.
+   */
+  gint64 last_reply_at;
+  /* Time until which it isn't sent requests, 0 if it is up */
+  gint64 down_until;
+  /* How many times in a row it stopped answering */
+  guint n_failures;
+} Broker;
+
+static void
+broker_free (Broker *broker)
+{
+  g_free (broker->endpoint);
+  g_slice_free (Broker, broker);
+}
+
+static gboolean s_handle_backend (Broker *broker);
+
+static void
+connect_broker (GPPClient *self, Broker *broker)
+{
+  broker->socket = zsocket_new (self->ctx, ZMQ_DEALER);
+  gpp_context_configure_socket (self->gpp_context, broker->socket);
+  zsocket_set_identity (broker->socket, self->identity);
+  zsocket_connect (broker->socket, "%s", broker->endpoint);
+  broker->source = gpp_zmq_source_attach (broker->socket,
+      self->dispatch_budget, (GPPZmqSourceFunc) s_handle_backend, broker,
+      NULL);
+}
+
+static void
+update_latency_ewma (Broker *broker, gint64 latency)
+{
+  if (broker->latency_ewma == 0)
+    broker->latency_ewma = latency;
+  else
+    broker->latency_ewma += LATENCY_EWMA_WEIGHT *
+        (latency - broker->latency_ewma);
+}
+
+/* Picks the queue expected to answer the soonest, among those that
+ * aren't down, or the one that comes back up first if they all are.
+ */
+static Broker *
+select_broker (GPPClient *self)
+{
+  gint64 now = g_get_monotonic_time ();
+  Broker *best = NULL, *first_up = NULL;
+  gdouble best_score = 0;
+  guint i;
+
+  if (self->brokers->len == 1)
+    return g_ptr_array_index (self->brokers, 0);
+
+  for (i = 0; i < self->brokers->len; i++) {
+    Broker *broker = g_ptr_array_index (self->brokers, i);
+    gdouble score;
+
+    if (broker->down_until > now) {
+      if (!first_up || broker->down_until < first_up->down_until)
+        first_up = broker;
+      continue;
+    }
+
+    score = (broker->latency_ewma + 1) * (broker->n_in_flight + 1);
+    if (!best || score < best_score) {
+      best = broker;
+      best_score = score;
+    }
+  }
+
+  return best ? best : first_up;
+}
+
+/* Request management */
+
+typedef struct {
+  guint32 id;
+  GBytes *payload;
+  gint retries_left;
+  /* Monotonic time past which we give up, 0 if never */
+  gint64 deadline;
+  GPPTimer deadline_timer;
+  gint64 created_at;
+  guint8 priority;
+  /* Hash of the routing key, 0 if none */
+  guint32 key_hash;
+  guint8 flags;
+  /* Trace context, if the request is traced */
+  zframe_t *trace;
+  /* The queue the last attempt went to, and when */
+  Broker *broker;
+  gint64 sent_at;
+  GPPRequestHandledFunc callback;
+  GPPBytesRequestHandledFunc bytes_callback;
+  GPPBatchHandledFunc batch_callback;
+  gpointer user_data;
+  GDestroyNotify notify;
+} Request;
+
+static Request *
+request_new (GPPClient *self, GBytes *payload, gint retries, guint timeout)
+{
+  Request *request = g_slice_new0 (Request);
+  gboolean compressed;
+
+  request->id = self->next_request_id++;
+  /* 0 is our error value */
+  if (self->next_request_id == 0)
+    self->next_request_id = 1;
+  request->payload = gpp_bytes_compress (payload, self->compression_threshold,
+      &compressed);
+  g_bytes_unref (payload);
+  request->flags = GPP_HEADER_FLAG_ACCEPTS_COMPRESSED;
+  if (compressed)
+    request->flags |= GPP_HEADER_FLAG_COMPRESSED;
+  request->retries_left = retries;
+  request->priority = self->priority;
+  request->created_at = g_get_monotonic_time ();
+  if (self->trace_ratio > 0 && g_random_double () < self->trace_ratio)
+    request->trace = gpp_trace_frame_new ();
+  if (timeout)
+    request->deadline = request->created_at
+        + timeout * G_TIME_SPAN_MILLISECOND;
+  request->deadline_timer.link.data = request;
+
+  return request;
+}
+
 static void
-s_handle_backend (GPPClient *self)
+request_destroy (Request *request)
+{
+  if (request->notify)
+    request->notify (request->user_data);
+  g_bytes_unref (request->payload);
+  if (request->trace)
+    zframe_destroy (&request->trace);
+  g_slice_free (Request, request);
+}
+
+/* Returns %FALSE if the request ran out of time */
+static gboolean
+send_request (GPPClient *self, Request *request)
+{
+  GPPHeader header = { request->id, GPP_STATUS_REQUEST, 0,
+      request->priority, request->key_hash, request->flags };
+  gint64 now = g_get_monotonic_time ();
+  zframe_t *empty_frame;
+  zframe_t *header_frame;
+  Broker *broker;
+
+  if (request->deadline) {
+    if (now >= request->deadline)
+      return FALSE;
+    header.timeout = MAX (1, (request->deadline - now) / 1000);
+  }
+
+  broker = select_broker (self);
+  if (request->broker)
+    request->broker->n_in_flight--;
+  if (broker->n_in_flight++ == 0)
+    broker->last_reply_at = now;
+  request->broker = broker;
+  request->sent_at = now;
+
+  empty_frame = zframe_new_empty ();
+  header_frame = gpp_header_to_frame (&header);
+  zframe_send (&empty_frame, broker->socket, ZFRAME_MORE);
+  zframe_send (&header_frame, broker->socket, ZFRAME_MORE);
+  if (request->trace) {
+    gpp_trace_frame_reset (request->trace);
+    gpp_trace_frame_stamp (request->trace, GPP_HOP_CLIENT_SEND);
+    zframe_send (&request->trace, broker->socket, ZFRAME_MORE | ZFRAME_REUSE);
+  }
+  gpp_send_bytes (broker->socket, request->payload);
+
+  return TRUE;
+}
+
+static gboolean check_deadlines (GPPClient *self);
+
+static guint
+queue_request (GPPClient *self, Request *request)
+{
+  g_hash_table_insert (self->requests, GUINT_TO_POINTER (request->id), request);
+  if (request->deadline) {
+    gpp_timer_wheel_schedule (self->deadlines, &request->deadline_timer,
+        request->deadline);
+    if (self->n_deadlines++ == 0 && !self->deadline_source)
+      self->deadline_source = g_timeout_add (DEADLINE_RESOLUTION,
+          (GSourceFunc) check_deadlines, self);
+  }
+  send_request (self, request);
+  self->n_sent++;
+
+  return request->id;
+}
+
+static void
+complete_request (GPPClient *self, Request *request, gboolean success,
+    GBytes *reply)
+{
+  g_hash_table_steal (self->requests, GUINT_TO_POINTER (request->id));
+  if (request->broker)
+    request->broker->n_in_flight--;
+  if (request->deadline) {
+    gpp_timer_wheel_cancel (self->deadlines, &request->deadline_timer);
+    self->n_deadlines--;
+  }
+
+  gpp_histogram_record (&self->round_trip,
+      g_get_monotonic_time () - request->created_at);
+  if (success)
+    self->n_succeeded++;
+  else
+    self->n_failed++;
+
+  if (request->batch_callback) {
+    GPtrArray *replies = NULL;
+
+    if (success && reply)
+      replies = gpp_batch_decode (reply);
+    if (success && !replies) {
+      g_warning ("Got an invalid batch of replies");
+      success = FALSE;
+    }
+
+    request->batch_callback (self, success, replies, request->user_data);
+    if (replies)
+      g_ptr_array_unref (replies);
+  } else if (request->bytes_callback) {
+    request->bytes_callback (self, success, reply, request->user_data);
+  } else {
+    gchar *reply_string = NULL;
+
+    if (reply)
+      reply_string = g_strndup (g_bytes_get_data (reply, NULL),
+          g_bytes_get_size (reply));
+
+    if (request->callback)
+      request->callback (self, success, reply_string, request->user_data);
+    g_signal_emit (self, gpp_client_signals[REQUEST_HANDLED], 0, success,
+        reply_string);
+    g_free (reply_string);
+  }
+
+  request_destroy (request);
+}
+
+/* Messaging */
+
+static gboolean
+s_handle_backend (Broker *broker)
 {
-  zmsg_t *msg = zmsg_recv (self->backend);
-  const gchar *last_request;
+  GPPClient *self = broker->client;
+  zmsg_t *msg = zmsg_recv (broker->socket);
+  zframe_t *header_frame, *trace;
+  GPPHeader header;
+  Request *request;
+  gint64 now;
+
   if (!msg) {
-    return;
-  }
-
-  last_request = self->current_request;
-  self->current_request = NULL;
-
-  if (zmsg_size (msg) == 1) {
-    zframe_t *frame = zmsg_first (msg);
-    if (!memcmp (zframe_data (frame), PPP_KO, 1)) {
-      g_debug ("Job failed");
-      if (self->retries_left == 0) {
-        g_info ("Failed, not retrying anymore");
-        g_signal_emit (self, gpp_client_signals[REQUEST_HANDLED], 0, FALSE, NULL);
-      } else {
-        if (self->retries_left != -1)
-          self->retries_left--;
-        g_debug ("Retrying, retries left : %d", self->retries_left);
-        gpp_client_send_request (self, last_request, self->retries_left);
+    return G_SOURCE_CONTINUE;
+  }
+
+  header_frame = gpp_msg_find_header (msg);
+  if (!gpp_header_from_frame (header_frame, &header)) {
+    g_warning ("E: invalid reply\n");
+    zmsg_dump (msg);
+    goto done;
+  }
+
+  request = g_hash_table_lookup (self->requests,
+      GUINT_TO_POINTER (header.request_id));
+
+  if (!request) {
+    g_debug ("Got a reply for unknown request %u", header.request_id);
+    goto done;
+  }
+
+  /* It was sent again to another queue in the meantime */
+  if (request->broker != broker) {
+    g_debug ("Got a late reply for request %u from %s", header.request_id,
+        broker->endpoint);
+    goto done;
+  }
+
+  now = g_get_monotonic_time ();
+  broker->last_reply_at = now;
+  broker->down_until = 0;
+  broker->n_failures = 0;
+  if (header.status != GPP_STATUS_PARTIAL)
+    update_latency_ewma (broker, now - request->sent_at);
+
+  trace = gpp_msg_find_trace (msg);
+  if (trace) {
+    gpp_trace_frame_stamp (trace, GPP_HOP_CLIENT_RECEIVE);
+    gpp_trace_record_span (trace, "worker-to-client", GPP_HOP_WORKER_DONE,
+        GPP_HOP_CLIENT_RECEIVE);
+    gpp_trace_record_span (trace, "request", GPP_HOP_CLIENT_SEND,
+        GPP_HOP_CLIENT_RECEIVE);
+  }
+
+  if (header.status == GPP_STATUS_PARTIAL) {
+    zframe_t *chunk_frame = zmsg_last (msg);
+    GBytes *chunk;
+
+    if (chunk_frame == header_frame)
+      goto done;
+
+    zmsg_remove (msg, chunk_frame);
+    chunk = gpp_bytes_new_from_frame (chunk_frame);
+
+    if (header.flags & GPP_HEADER_FLAG_COMPRESSED) {
+      GBytes *compressed = chunk;
+      GError *error = NULL;
+
+      chunk = gpp_bytes_decompress (compressed,
+          self->max_decompressed_size, &error);
+      g_bytes_unref (compressed);
+      if (!chunk) {
+        g_warning ("Could not decompress partial reply: %s", error->message);
+        g_error_free (error);
+        complete_request (self, request, FALSE, NULL);
+        goto done;
       }
+    }
+
+    g_signal_emit (self, gpp_client_signals[REQUEST_PROGRESS], 0,
+        header.request_id, chunk);
+    g_bytes_unref (chunk);
+  } else if (header.status == GPP_STATUS_OVERLOADED) {
+    g_info ("Queue is overloaded, not retrying");
+    self->n_overloaded++;
+    complete_request (self, request, FALSE, NULL);
+  } else if (header.status == GPP_STATUS_TIMEOUT) {
+    g_info ("Request timed out, not retrying");
+    self->n_timed_out++;
+    complete_request (self, request, FALSE, NULL);
+  } else if (header.status == GPP_STATUS_KO) {
+    g_debug ("Job failed");
+    if (request->retries_left == 0) {
+      g_info ("Failed, not retrying anymore");
+      complete_request (self, request, FALSE, NULL);
     } else {
-      zframe_t *reply_frame = zmsg_last (msg);
-      char *reply = zframe_strdup (reply_frame);
-      g_signal_emit (self, gpp_client_signals[REQUEST_HANDLED], 0, TRUE, reply);
-      free (reply);
+      if (request->retries_left != -1)
+        request->retries_left--;
+      g_debug ("Retrying, retries left : %d", request->retries_left);
+      self->n_retries++;
+      if (!send_request (self, request)) {
+        g_info ("Request timed out, not retrying");
+        self->n_timed_out++;
+        complete_request (self, request, FALSE, NULL);
+      }
     }
-  }
+  } else {
+    zframe_t *reply_frame = zmsg_last (msg);
+    GBytes *reply = NULL;
+
+    gboolean success = TRUE;
+
+    if (reply_frame != header_frame) {
+      zmsg_remove (msg, reply_frame);
+      reply = gpp_bytes_new_from_frame (reply_frame);
+    }
+
+    if (reply && (header.flags & GPP_HEADER_FLAG_COMPRESSED)) {
+      GBytes *compressed = reply;
+      GError *error = NULL;
 
+      reply = gpp_bytes_decompress (compressed,
+          self->max_decompressed_size, &error);
+      g_bytes_unref (compressed);
+      if (!reply) {
+        g_warning ("Could not decompress reply: %s", error->message);
+        g_error_free (error);
+        success = FALSE;
+      }
+    }
 
+    complete_request (self, request, success, reply);
+    if (reply)
+      g_bytes_unref (reply);
+  }
+
+done:
   zmsg_destroy (&msg);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Failover */
+
+/* Sends the requests of @broker again to the other queues, and leaves
+ * it alone for a while, longer every time it happens in a row.
+ */
+static void
+fail_over (GPPClient *self, Broker *broker, gint64 now)
+{
+  GHashTableIter iter;
+  GList *moved = NULL, *tmp;
+  Request *request;
+  guint backoff;
+
+  g_warning ("Queue %s stopped answering, sending its %u requests to the "
+      "other queues", broker->endpoint, broker->n_in_flight);
+
+  broker->n_failures++;
+  backoff = self->failover_timeout << MIN (broker->n_failures - 1, 16);
+  broker->down_until = now + MIN (backoff, MAX_FAILOVER_BACKOFF)
+      * G_TIME_SPAN_MILLISECOND;
+  self->n_failovers++;
+
+  /* Drops what is still waiting to be sent to it */
+  g_source_remove (broker->source);
+  zsocket_destroy (self->ctx, broker->socket);
+  connect_broker (self, broker);
+
+  g_hash_table_iter_init (&iter, self->requests);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+    if (request->broker == broker)
+      moved = g_list_prepend (moved, request);
+
+  for (tmp = moved; tmp; tmp = tmp->next) {
+    request = tmp->data;
+
+    if (!send_request (self, request)) {
+      g_info ("Request timed out, not retrying");
+      self->n_timed_out++;
+      complete_request (self, request, FALSE, NULL);
+    }
+  }
+
+  g_list_free (moved);
 }
 
 static gboolean
-socket_activity(GIOChannel *channel, GIOCondition condition, GPPClient *self)
+check_brokers (GPPClient *self)
 {
-  uint32_t status;
-  size_t sizeof_status = sizeof(status);
+  gint64 now = g_get_monotonic_time ();
+  guint i;
 
-  /* FIXME : error handling here, not sure what to do */
+  for (i = 0; i < self->brokers->len; i++) {
+    Broker *broker = g_ptr_array_index (self->brokers, i);
 
-  if (zmq_getsockopt(self->backend, ZMQ_EVENTS, &status, &sizeof_status)) {
-    perror("retrieving event status");
-    return 0;
+    if (broker->n_in_flight && now - broker->last_reply_at >
+        self->failover_timeout * G_TIME_SPAN_MILLISECOND)
+      fail_over (self, broker, now);
   }
 
-  if ((status & ZMQ_POLLIN) != 0) {
-    s_handle_backend (self);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Deadlines */
+
+/* The queue only stops a request from reaching a worker, we don't wait
+ * for its reply, which may never come, once the request ran out of time.
+ */
+static void
+deadline_timer_cb (GPPTimer *timer, GPPClient *self)
+{
+  Request *request = timer->link.data;
+
+  g_info ("Request %u timed out", request->id);
+  self->n_timed_out++;
+  complete_request (self, request, FALSE, NULL);
+}
+
+static gboolean
+check_deadlines (GPPClient *self)
+{
+  gpp_timer_wheel_advance (self->deadlines, g_get_monotonic_time ());
+
+  if (self->n_deadlines == 0) {
+    self->deadline_source = 0;
+    return G_SOURCE_REMOVE;
   }
 
-  return 1;
+  return G_SOURCE_CONTINUE;
+}
+
+/* GObject */
+
+static void
+gpp_client_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GPPClient *self = GPP_CLIENT (object);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      self->gpp_context = g_value_dup_object (value);
+      if (!self->gpp_context)
+        self->gpp_context = g_object_ref (gpp_context_get_default ());
+      break;
+    case PROP_QUEUE_ENDPOINT:
+      g_free (self->queue_endpoint);
+      self->queue_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_QUEUE_ENDPOINTS:
+      g_strfreev (self->queue_endpoints);
+      self->queue_endpoints = g_value_dup_boxed (value);
+      break;
+    case PROP_FAILOVER_TIMEOUT:
+      self->failover_timeout = g_value_get_uint (value);
+      break;
+    case PROP_TIMEOUT:
+      self->timeout = g_value_get_uint (value);
+      break;
+    case PROP_PRIORITY:
+      self->priority = g_value_get_uint (value);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      self->dispatch_budget = g_value_get_uint (value);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_free (self->stats_endpoint);
+      self->stats_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_TRACE_RATIO:
+      self->trace_ratio = g_value_get_double (value);
+      break;
+    case PROP_COMPRESSION_THRESHOLD:
+      self->compression_threshold = g_value_get_uint (value);
+      break;
+    case PROP_MAX_DECOMPRESSED_SIZE:
+      self->max_decompressed_size = g_value_get_uint64 (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gpp_client_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GPPClient *self = GPP_CLIENT (object);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      g_value_set_object (value, self->gpp_context);
+      break;
+    case PROP_QUEUE_ENDPOINT:
+      g_value_set_string (value, self->queue_endpoint);
+      break;
+    case PROP_QUEUE_ENDPOINTS:
+      g_value_set_boxed (value, self->queue_endpoints);
+      break;
+    case PROP_FAILOVER_TIMEOUT:
+      g_value_set_uint (value, self->failover_timeout);
+      break;
+    case PROP_TIMEOUT:
+      g_value_set_uint (value, self->timeout);
+      break;
+    case PROP_PRIORITY:
+      g_value_set_uint (value, self->priority);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      g_value_set_uint (value, self->dispatch_budget);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_value_set_string (value, self->stats_endpoint);
+      break;
+    case PROP_TRACE_RATIO:
+      g_value_set_double (value, self->trace_ratio);
+      break;
+    case PROP_COMPRESSION_THRESHOLD:
+      g_value_set_uint (value, self->compression_threshold);
+      break;
+    case PROP_MAX_DECOMPRESSED_SIZE:
+      g_value_set_uint64 (value, self->max_decompressed_size);
+      break;
+    case PROP_IN_FLIGHT_REQUESTS:
+      g_value_set_uint (value, g_hash_table_size (self->requests));
+      break;
+    case PROP_COMPLETED_REQUESTS:
+      g_value_set_uint64 (value, self->n_succeeded);
+      break;
+    case PROP_FAILED_REQUESTS:
+      g_value_set_uint64 (value, self->n_failed);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+constructed (GObject *object)
+{
+  GPPClient *self = GPP_CLIENT (object);
+  gchar *single_endpoint[] = { self->queue_endpoint, NULL };
+  gchar **endpoint;
+
+  self->ctx = gpp_context_new_zctx (self->gpp_context);
+
+  self->brokers = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) broker_free);
+  for (endpoint = self->queue_endpoints && *self->queue_endpoints ?
+      self->queue_endpoints : single_endpoint; *endpoint; endpoint++) {
+    Broker *broker = g_slice_new0 (Broker);
+
+    broker->client = self;
+    broker->endpoint = g_strdup (*endpoint);
+    connect_broker (self, broker);
+    g_ptr_array_add (self->brokers, broker);
+  }
+
+  if (self->brokers->len > 1 && self->failover_timeout)
+    self->failover_source = g_timeout_add (
+        MAX (self->failover_timeout / 4, 1), (GSourceFunc) check_brokers,
+        self);
+
+  if (self->stats_endpoint)
+    self->stats_server = gpp_stats_server_new (self->ctx,
+        self->stats_endpoint, (GPPStatsFunc) gpp_client_get_stats, self,
+        NULL);
+
+  G_OBJECT_CLASS (gpp_client_parent_class)->constructed (object);
 }
 
 static void
@@ -121,7 +810,48 @@ dispose (GObject *object)
 {
   GPPClient *self = GPP_CLIENT (object);
 
+  if (self->failover_source) {
+    g_source_remove (self->failover_source);
+    self->failover_source = 0;
+  }
+
+  if (self->deadline_source) {
+    g_source_remove (self->deadline_source);
+    self->deadline_source = 0;
+  }
+
+  if (self->brokers) {
+    guint i;
+
+    for (i = 0; i < self->brokers->len; i++) {
+      Broker *broker = g_ptr_array_index (self->brokers, i);
+
+      if (broker->source)
+        g_source_remove (broker->source);
+      broker->source = 0;
+    }
+  }
+
+  g_clear_pointer (&self->stats_server, gpp_stats_server_free);
+  /* Before the requests, whose timers it unlinks */
+  g_clear_pointer (&self->deadlines, gpp_timer_wheel_free);
+  g_clear_pointer (&self->requests, g_hash_table_unref);
+  g_clear_pointer (&self->brokers, g_ptr_array_unref);
   zctx_destroy (&self->ctx);
+  g_clear_object (&self->gpp_context);
+}
+
+static void
+finalize (GObject *object)
+{
+  GPPClient *self = GPP_CLIENT (object);
+
+  g_free (self->queue_endpoint);
+  g_strfreev (self->queue_endpoints);
+  g_free (self->stats_endpoint);
+  g_free (self->identity);
+
+  G_OBJECT_CLASS (gpp_client_parent_class)->finalize (object);
 }
 
 static void
@@ -129,7 +859,194 @@ gpp_client_class_init (GPPClientClass *klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+  gobject_class->constructed = constructed;
   gobject_class->dispose = dispose;
+  gobject_class->finalize = finalize;
+  gobject_class->set_property = gpp_client_set_property;
+  gobject_class->get_property = gpp_client_get_property;
+
+  /**
+   * GPPClient:context:
+   *
+   * The #GPPContext the client creates its socket in, if %NULL
+   * the default context is used.
+   */
+  properties[PROP_CONTEXT] =
+      g_param_spec_object ("context", "Context",
+      "The context sockets are created in", GPP_TYPE_CONTEXT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:queue-endpoint:
+   *
+   * Where to reach the #GPPQueue:frontend-endpoint of the queue,
+   * inproc:// and ipc:// endpoints avoid going through TCP when the
+   * queue runs in the same process or on the same host.
+   */
+  properties[PROP_QUEUE_ENDPOINT] =
+      g_param_spec_string ("queue-endpoint", "Queue endpoint",
+      "Endpoint of the queue", DEFAULT_QUEUE_ENDPOINT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:queue-endpoints:
+   *
+   * The frontend endpoints of several queues to spread the requests
+   * across, used instead of #GPPClient:queue-endpoint when set. Each
+   * request goes to the queue with the lowest average round-trip time
+   * weighted by its number of requests in flight.
+   */
+  properties[PROP_QUEUE_ENDPOINTS] =
+      g_param_spec_boxed ("queue-endpoints", "Queue endpoints",
+      "Endpoints of the queues", G_TYPE_STRV,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:failover-timeout:
+   *
+   * When the client talks to several queues, the time in milliseconds
+   * after which a queue that has requests in flight but didn't send
+   * any reply is considered down. Its requests are sent again to the
+   * other queues, and it isn't sent new ones for a while, for longer
+   * each time it happens in a row. It should be longer than the
+   * longest task. 0 disables failover.
+   *
+   * The requests moved to another queue may have been handled by the
+   * first one too, they should be safe to run twice.
+   */
+  properties[PROP_FAILOVER_TIMEOUT] =
+      g_param_spec_uint ("failover-timeout", "Failover timeout",
+      "Time after which a silent queue is considered down, in ms",
+      0, G_MAXUINT, DEFAULT_FAILOVER_TIMEOUT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:timeout:
+   *
+   * The time budget, in milliseconds, of the requests sent from
+   * now on without one of their own, see
+   * gpp_client_send_request_with_timeout(). The #GPPQueue answers with
+   * a failure the requests that exhausted it while waiting for a worker,
+   * workers can check what is left of it with
+   * gpp_worker_get_task_remaining_time(), and the client fails the
+   * requests still in flight once it is exhausted. 0 means no limit.
+   */
+  properties[PROP_TIMEOUT] =
+      g_param_spec_uint ("timeout", "Timeout",
+      "Time budget of the requests, in milliseconds", 0, G_MAXUINT32, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:priority:
+   *
+   * The priority of the requests sent from now on, from 0, the most
+   * urgent, to 3.
+   */
+  properties[PROP_PRIORITY] =
+      g_param_spec_uint ("priority", "Priority",
+      "Priority of the requests, 0 being the most urgent", 0,
+      GPP_N_PRIORITIES - 1, GPP_DEFAULT_PRIORITY,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:dispatch-budget:
+   *
+   * The maximum number of replies handled in a row before the main
+   * loop gets to run other sources, 0 means no maximum. Only taken
+   * into account when connecting to a queue.
+   */
+  properties[PROP_DISPATCH_BUDGET] =
+      g_param_spec_uint ("dispatch-budget", "Dispatch budget",
+      "Maximum number of replies handled in a row", 0, G_MAXUINT,
+      DEFAULT_DISPATCH_BUDGET,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:stats-endpoint:
+   *
+   * If set, the client binds a REP socket to this endpoint, and
+   * answers any message sent to it with the snapshot returned by
+   * gpp_client_get_stats(), in the #GVariant text format.
+   */
+  properties[PROP_STATS_ENDPOINT] =
+      g_param_spec_string ("stats-endpoint", "Stats endpoint",
+      "Endpoint serving statistics snapshots", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:trace-ratio:
+   *
+   * The share, from 0 to 1, of the requests sent from now on that
+   * carry a trace context. The client, the queue and the worker
+   * record the time at which they see a traced request, and each
+   * process writes the spans between these hops to the file named by
+   * the GPP_TRACE_FILE environment variable, as Chrome trace events,
+   * one JSON object per line. A %p in that name is replaced with the
+   * process id.
+   * Spans use the wall clock of the hosts, which should be kept in
+   * sync when the processes run on different hosts.
+   */
+  properties[PROP_TRACE_RATIO] =
+      g_param_spec_double ("trace-ratio", "Trace ratio",
+      "Share of the requests that are traced", 0, 1, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:compression-threshold:
+   *
+   * The size in bytes from which the payloads of the requests sent
+   * from now on are compressed with zlib, 0 to never compress them.
+   * Payloads that don't shrink are sent as they are.
+   */
+  properties[PROP_COMPRESSION_THRESHOLD] =
+      g_param_spec_uint ("compression-threshold", "Compression threshold",
+      "Size from which requests are compressed", 0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:max-decompressed-size:
+   *
+   * The size in bytes past which a compressed reply isn't decompressed,
+   * its request fails instead, 0 for no limit.
+   */
+  properties[PROP_MAX_DECOMPRESSED_SIZE] =
+      g_param_spec_uint64 ("max-decompressed-size", "Max decompressed size",
+      "Size past which compressed replies are rejected", 0, G_MAXUINT64,
+      DEFAULT_MAX_DECOMPRESSED_SIZE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:in-flight-requests:
+   *
+   * The number of requests waiting to be handled.
+   */
+  properties[PROP_IN_FLIGHT_REQUESTS] =
+      g_param_spec_uint ("in-flight-requests", "In-flight requests",
+      "Number of requests waiting to be handled", 0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:completed-requests:
+   *
+   * The number of requests successfully handled so far.
+   */
+  properties[PROP_COMPLETED_REQUESTS] =
+      g_param_spec_uint64 ("completed-requests", "Completed requests",
+      "Number of requests successfully handled", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPClient:failed-requests:
+   *
+   * The number of requests that failed, ran out of time or were
+   * rejected by an overloaded queue.
+   */
+  properties[PROP_FAILED_REQUESTS] =
+      g_param_spec_uint64 ("failed-requests", "Failed requests",
+      "Number of requests that failed", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPERTIES, properties);
 
   /**
    * GPPClient::request-handled:
@@ -137,23 +1054,46 @@ gpp_client_class_init (GPPClientClass *klass)
    * @success: Whether the request was successfully executed
    * @reply: The reply provided by the #GPPWorker , as a simple string
    *
-   * Connect to this signal to be notified when the current request
-   * has been handled.
+   * Connect to this signal to be notified when a request
+   * has been handled. It is emitted for every request made with
+   * gpp_client_send_request() or gpp_client_send_request_full(),
+   * after the per-request callback if one was provided.
    */
   gpp_client_signals[REQUEST_HANDLED] =
       g_signal_new ("request-handled", G_TYPE_FROM_CLASS (klass),
       G_SIGNAL_RUN_FIRST, 0, NULL, NULL, g_cclosure_marshal_generic,
       G_TYPE_NONE, 2, G_TYPE_BOOLEAN, G_TYPE_STRING);
+
+  /**
+   * GPPClient::request-progress:
+   * @object: The #GPPClient
+   * @request_id: The identifier of the request, as returned when
+   * sending it
+   * @chunk: A chunk of the reply, sent by the #GPPWorker with
+   * gpp_worker_send_partial()
+   *
+   * Emitted for each chunk of a reply streamed by the worker handling
+   * the request, in the order they were sent, before the request is
+   * handled. Chunks are sent again when a failed request is retried.
+   */
+  gpp_client_signals[REQUEST_PROGRESS] =
+      g_signal_new ("request-progress", G_TYPE_FROM_CLASS (klass),
+      G_SIGNAL_RUN_FIRST, 0, NULL, NULL, g_cclosure_marshal_generic,
+      G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_BYTES);
 }
 
 static void
 gpp_client_init (GPPClient *self)
 {
-  self->ctx = zctx_new ();
-  self->backend = zsocket_new (self->ctx, ZMQ_REQ);
-  zsocket_connect (self->backend, SERVER_ENDPOINT);
-  self->backend_source = g_io_add_watch (g_io_channel_from_zmq_socket (self->backend),
-      G_IO_IN, (GIOFunc) socket_activity, self);
+  self->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) request_destroy);
+  self->deadlines = gpp_timer_wheel_new (
+      DEADLINE_RESOLUTION * G_TIME_SPAN_MILLISECOND,
+      (GPPTimerFunc) deadline_timer_cb, self);
+  self->next_request_id = 1;
+  self->identity = g_strdup_printf ("gpp-client-%08x%08x", g_random_int (),
+      g_random_int ());
+  gpp_histogram_reset (&self->round_trip);
 }
 
 /* API */
@@ -179,21 +1119,269 @@ gpp_client_new (void)
  * @retries: The number of times to retry before signaling that
  * the request was handled, -1 means retry forever.
  *
- * This will make @self send @request to a #GPPQueue.
+ * This will make @self send @request to a #GPPQueue, the
+ * #GPPClient::request-handled signal will be emitted once it
+ * has been handled.
  *
- * Returns: %TRUE if @request was made, %FALSE if one is already being made.
+ * Returns: %TRUE if @request was made.
  */
 gboolean
 gpp_client_send_request (GPPClient *self,
                          const gchar *request,
                          gint retries)
 {
-  if (self->current_request)
-    return FALSE;
+  return gpp_client_send_request_full (self, request, retries,
+      NULL, NULL, NULL) != 0;
+}
 
-  self->current_request = request;
-  self->retries_left = retries;
+/**
+ * gpp_client_send_request_full:
+ * @self: A #GPPClient that will send the request.
+ * @request: A simple string that will be passed to the #GPPWorker.
+ * @retries: The number of times to retry before signaling that
+ * the request was handled, -1 means retry forever.
+ * @callback: (scope notified) (allow-none): The function to call once
+ * @request has been handled.
+ * @user_data: (closure callback): Data to pass to @callback.
+ * @notify: (destroy user_data): Function to free @user_data with.
+ *
+ * This will make @self send @request to a #GPPQueue, without waiting for
+ * previous requests to be handled.
+ *
+ * Returns: The identifier of the request, or 0 if it could not be made.
+ */
+guint
+gpp_client_send_request_full (GPPClient *self,
+                              const gchar *request,
+                              gint retries,
+                              GPPRequestHandledFunc callback,
+                              gpointer user_data,
+                              GDestroyNotify notify)
+{
+  return gpp_client_send_request_with_timeout (self, request, retries,
+      self->timeout, callback, user_data, notify);
+}
 
-  zstr_send (self->backend, request);
-  return TRUE;
+/**
+ * gpp_client_send_request_with_timeout:
+ * @self: A #GPPClient that will send the request.
+ * @request: A simple string that will be passed to the #GPPWorker.
+ * @retries: The number of times to retry before signaling that
+ * the request was handled, -1 means retry forever.
+ * @timeout: The time budget of @request in milliseconds, 0 for none.
+ * @callback: (scope notified) (allow-none): The function to call once
+ * @request has been handled.
+ * @user_data: (closure callback): Data to pass to @callback.
+ * @notify: (destroy user_data): Function to free @user_data with.
+ *
+ * Like gpp_client_send_request_full(), but @request is given a time
+ * budget of its own rather than #GPPClient:timeout. Once it is
+ * exhausted, @request is handled as a failure, retries included.
+ *
+ * Returns: The identifier of the request, or 0 if it could not be made.
+ */
+guint
+gpp_client_send_request_with_timeout (GPPClient *self,
+                                      const gchar *request,
+                                      gint retries,
+                                      guint timeout,
+                                      GPPRequestHandledFunc callback,
+                                      gpointer user_data,
+                                      GDestroyNotify notify)
+{
+  Request *req;
+
+  g_return_val_if_fail (request != NULL, 0);
+
+  req = request_new (self, g_bytes_new (request, strlen (request)), retries,
+      timeout);
+  req->callback = callback;
+  req->user_data = user_data;
+  req->notify = notify;
+
+  return queue_request (self, req);
+}
+
+/**
+ * gpp_client_send_bytes:
+ * @self: A #GPPClient that will send the request.
+ * @request: The data that will be passed to the #GPPWorker.
+ * @retries: The number of times to retry before signaling that
+ * the request was handled, -1 means retry forever.
+ * @callback: (scope notified) (allow-none): The function to call once
+ * @request has been handled.
+ * @user_data: (closure callback): Data to pass to @callback.
+ * @notify: (destroy user_data): Function to free @user_data with.
+ *
+ * Like gpp_client_send_request_full(), but @request can hold arbitrary
+ * binary data. Neither @request nor the reply are copied on their way
+ * through @self, unless they are compressed or decompressed, see
+ * #GPPClient:compression-threshold. @request must not be modified until
+ * it has been handled.
+ *
+ * Returns: The identifier of the request, or 0 if it could not be made.
+ */
+guint
+gpp_client_send_bytes (GPPClient *self,
+                       GBytes *request,
+                       gint retries,
+                       GPPBytesRequestHandledFunc callback,
+                       gpointer user_data,
+                       GDestroyNotify notify)
+{
+  return gpp_client_send_bytes_with_key (self, NULL, request, retries,
+      callback, user_data, notify);
+}
+
+/**
+ * gpp_client_send_bytes_with_key:
+ * @self: A #GPPClient that will send the request.
+ * @key: (allow-none): The routing key of the request.
+ * @request: The data that will be passed to the #GPPWorker.
+ * @retries: The number of times to retry before signaling that
+ * the request was handled, -1 means retry forever.
+ * @callback: (scope notified) (allow-none): The function to call once
+ * @request has been handled.
+ * @user_data: (closure callback): Data to pass to @callback.
+ * @notify: (destroy user_data): Function to free @user_data with.
+ *
+ * Like gpp_client_send_bytes(), but the #GPPQueue hands the requests
+ * made with the same @key to the same worker while it is alive and
+ * not much busier than the others, which lets workers cache what
+ * they know about a key.
+ *
+ * Returns: The identifier of the request, or 0 if it could not be made.
+ */
+guint
+gpp_client_send_bytes_with_key (GPPClient *self,
+                                const gchar *key,
+                                GBytes *request,
+                                gint retries,
+                                GPPBytesRequestHandledFunc callback,
+                                gpointer user_data,
+                                GDestroyNotify notify)
+{
+  return gpp_client_send_bytes_full (self, key, request, retries,
+      self->timeout, callback, user_data, notify);
+}
+
+/**
+ * gpp_client_send_bytes_full:
+ * @self: A #GPPClient that will send the request.
+ * @key: (allow-none): The routing key of the request.
+ * @request: The data that will be passed to the #GPPWorker.
+ * @retries: The number of times to retry before signaling that
+ * the request was handled, -1 means retry forever.
+ * @timeout: The time budget of @request in milliseconds, 0 for none.
+ * @callback: (scope notified) (allow-none): The function to call once
+ * @request has been handled.
+ * @user_data: (closure callback): Data to pass to @callback.
+ * @notify: (destroy user_data): Function to free @user_data with.
+ *
+ * Like gpp_client_send_bytes_with_key(), but @request is given a time
+ * budget of its own, see gpp_client_send_request_with_timeout().
+ *
+ * Returns: The identifier of the request, or 0 if it could not be made.
+ */
+guint
+gpp_client_send_bytes_full (GPPClient *self,
+                            const gchar *key,
+                            GBytes *request,
+                            gint retries,
+                            guint timeout,
+                            GPPBytesRequestHandledFunc callback,
+                            gpointer user_data,
+                            GDestroyNotify notify)
+{
+  Request *req;
+
+  g_return_val_if_fail (request != NULL, 0);
+
+  req = request_new (self, g_bytes_ref (request), retries, timeout);
+  /* 0 means no key */
+  if (key)
+    req->key_hash = MAX (1, gpp_hash_data ((const byte *) key,
+        strlen (key)));
+  req->bytes_callback = callback;
+  req->user_data = user_data;
+  req->notify = notify;
+
+  return queue_request (self, req);
+}
+
+/**
+ * gpp_client_send_batch:
+ * @self: A #GPPClient
+ * @requests: (element-type GBytes): The requests to send
+ * @retries: The number of times the batch will be retried, -1 for infinite
+ * @callback: (scope notified) (allow-none): The function to call once
+ * the batch has been handled
+ * @user_data: (allow-none): The data to pass to @callback
+ * @notify: (allow-none): The function to call to free @user_data
+ *
+ * Sends @requests as a single message, that a #GPPWorker handles at
+ * once. The batch succeeds or fails as a whole, but the worker can
+ * fail some of its requests, see #GPPBatchHandledFunc.
+ *
+ * Returns: The identifier of the batch.
+ */
+guint
+gpp_client_send_batch (GPPClient *self,
+                       GPtrArray *requests,
+                       gint retries,
+                       GPPBatchHandledFunc callback,
+                       gpointer user_data,
+                       GDestroyNotify notify)
+{
+  Request *req;
+
+  g_return_val_if_fail (requests != NULL, 0);
+
+  req = request_new (self, gpp_batch_encode (requests), retries,
+      self->timeout);
+  req->flags |= GPP_HEADER_FLAG_BATCH;
+  req->batch_callback = callback;
+  req->user_data = user_data;
+  req->notify = notify;
+
+  return queue_request (self, req);
+}
+
+/**
+ * gpp_client_get_stats:
+ * @self: A #GPPClient
+ *
+ * Takes a snapshot of the statistics of @self, as a dictionary
+ * mapping names to values: the request counters, and the histogram
+ * of the time it took requests to be handled ("round-trip-time"),
+ * in microseconds.
+ *
+ * Returns: (transfer full): A #GVariant of type a{sv}
+ */
+GVariant *
+gpp_client_get_stats (GPPClient *self)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "sent-requests",
+      g_variant_new_uint64 (self->n_sent));
+  g_variant_builder_add (&builder, "{sv}", "in-flight-requests",
+      g_variant_new_uint32 (g_hash_table_size (self->requests)));
+  g_variant_builder_add (&builder, "{sv}", "completed-requests",
+      g_variant_new_uint64 (self->n_succeeded));
+  g_variant_builder_add (&builder, "{sv}", "failed-requests",
+      g_variant_new_uint64 (self->n_failed));
+  g_variant_builder_add (&builder, "{sv}", "retries",
+      g_variant_new_uint64 (self->n_retries));
+  g_variant_builder_add (&builder, "{sv}", "overloaded-replies",
+      g_variant_new_uint64 (self->n_overloaded));
+  g_variant_builder_add (&builder, "{sv}", "timed-out-requests",
+      g_variant_new_uint64 (self->n_timed_out));
+  g_variant_builder_add (&builder, "{sv}", "failovers",
+      g_variant_new_uint64 (self->n_failovers));
+  g_variant_builder_add (&builder, "{sv}", "round-trip-time",
+      gpp_histogram_to_variant (&self->round_trip));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
@@ -9,9 +9,96 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE(GPPClient, gpp_client, GPP, CLIENT, GObject)
 
+/**
+ * GPPRequestHandledFunc:
+ * @client: The #GPPClient that made the request
+ * @success: Whether the request was successfully executed
+ * @reply: (allow-none): The reply provided by the #GPPWorker, as a simple string
+ * @user_data: The data passed to gpp_client_send_request_full()
+ *
+ * Called once a request made with gpp_client_send_request_full() has been handled.
+ */
+typedef void (*GPPRequestHandledFunc) (GPPClient *client,
+                                       gboolean success,
+                                       const gchar *reply,
+                                       gpointer user_data);
+
+/**
+ * GPPBytesRequestHandledFunc:
+ * @client: The #GPPClient that made the request
+ * @success: Whether the request was successfully executed
+ * @reply: (allow-none): The reply provided by the #GPPWorker
+ * @user_data: The data passed to gpp_client_send_bytes()
+ *
+ * Called once a request made with gpp_client_send_bytes() has been handled,
+ * take a reference on @reply to keep it around.
+ */
+typedef void (*GPPBytesRequestHandledFunc) (GPPClient *client,
+                                            gboolean success,
+                                            GBytes *reply,
+                                            gpointer user_data);
+
+/**
+ * GPPBatchHandledFunc:
+ * @client: The #GPPClient that made the requests
+ * @success: Whether the batch was handled
+ * @replies: (element-type GBytes) (allow-none): The replies provided by
+ * the #GPPWorker, in the order of the requests, %NULL for the requests
+ * that failed, or %NULL if the whole batch failed
+ * @user_data: The data passed to gpp_client_send_batch()
+ *
+ * Called once a batch sent with gpp_client_send_batch() has been handled,
+ * take a reference on @replies to keep them around.
+ */
+typedef void (*GPPBatchHandledFunc) (GPPClient *client,
+                                     gboolean success,
+                                     GPtrArray *replies,
+                                     gpointer user_data);
+
 GPPClient * gpp_client_new (void);
 gboolean gpp_client_send_request (GPPClient *self,
                                   const gchar *request,
                                   gint retries);
+guint gpp_client_send_request_full (GPPClient *self,
+                                    const gchar *request,
+                                    gint retries,
+                                    GPPRequestHandledFunc callback,
+                                    gpointer user_data,
+                                    GDestroyNotify notify);
+guint gpp_client_send_request_with_timeout (GPPClient *self,
+                                            const gchar *request,
+                                            gint retries,
+                                            guint timeout,
+                                            GPPRequestHandledFunc callback,
+                                            gpointer user_data,
+                                            GDestroyNotify notify);
+guint gpp_client_send_bytes (GPPClient *self,
+                             GBytes *request,
+                             gint retries,
+                             GPPBytesRequestHandledFunc callback,
+                             gpointer user_data,
+                             GDestroyNotify notify);
+guint gpp_client_send_bytes_with_key (GPPClient *self,
+                                      const gchar *key,
+                                      GBytes *request,
+                                      gint retries,
+                                      GPPBytesRequestHandledFunc callback,
+                                      gpointer user_data,
+                                      GDestroyNotify notify);
+guint gpp_client_send_bytes_full (GPPClient *self,
+                                  const gchar *key,
+                                  GBytes *request,
+                                  gint retries,
+                                  guint timeout,
+                                  GPPBytesRequestHandledFunc callback,
+                                  gpointer user_data,
+                                  GDestroyNotify notify);
+guint gpp_client_send_batch (GPPClient *self,
+                             GPtrArray *requests,
+                             gint retries,
+                             GPPBatchHandledFunc callback,
+                             gpointer user_data,
+                             GDestroyNotify notify);
+GVariant * gpp_client_get_stats (GPPClient *self);
 
 #endif
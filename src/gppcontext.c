@@ -0,0 +1,326 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <czmq.h>
+
+#include "gpputils.h"
+#include "gppcontext.h"
+
+/**
+ * SECTION: gppcontext
+ *
+ * #GPPContext holds the zeromq context #GPPQueue (s), #GPPWorker (s)
+ * and #GPPClient (s) create their sockets in, along with the settings
+ * of these sockets.
+ *
+ * Each zeromq context runs its own I/O threads, objects constructed
+ * without a context all share the one returned by
+ * gpp_context_get_default(). Create a #GPPContext to pick how many I/O
+ * threads a group of objects uses, and which CPUs these threads run
+ * on, then pass it as the "context" property of these objects.
+ *
+ * Only objects sharing a context can talk over inproc:// endpoints.
+ */
+
+struct _GPPContext
+{
+  GObject parent;
+
+  void *zmq_ctx;
+
+  guint io_threads;
+  guint64 io_thread_affinity;
+  guint sndhwm;
+  guint rcvhwm;
+  guint sndbuf;
+  guint rcvbuf;
+};
+
+#define DEFAULT_IO_THREADS 1
+#define DEFAULT_HWM        1000
+
+G_DEFINE_TYPE (GPPContext, gpp_context, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_IO_THREADS,
+  PROP_IO_THREAD_AFFINITY,
+  PROP_SNDHWM,
+  PROP_RCVHWM,
+  PROP_SNDBUF,
+  PROP_RCVBUF,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+/* Private API */
+
+/* Returns a zctx_t wrapping our context, destroying it only closes
+ * the sockets created through it.
+ */
+zctx_t *
+gpp_context_new_zctx (GPPContext *self)
+{
+  zctx_t *ctx = zctx_shadow_zmq_ctx (self->zmq_ctx);
+
+  zctx_set_sndhwm (ctx, self->sndhwm);
+  zctx_set_rcvhwm (ctx, self->rcvhwm);
+
+  return ctx;
+}
+
+/* For the sockets talking to other processes */
+void
+gpp_context_configure_socket (GPPContext *self, void *socket)
+{
+  if (self->sndbuf)
+    zsocket_set_sndbuf (socket, self->sndbuf);
+  if (self->rcvbuf)
+    zsocket_set_rcvbuf (socket, self->rcvbuf);
+}
+
+/* GObject */
+
+static void
+gpp_context_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GPPContext *self = GPP_CONTEXT (object);
+
+  switch (prop_id) {
+    case PROP_IO_THREADS:
+      self->io_threads = g_value_get_uint (value);
+      break;
+    case PROP_IO_THREAD_AFFINITY:
+      self->io_thread_affinity = g_value_get_uint64 (value);
+      break;
+    case PROP_SNDHWM:
+      self->sndhwm = g_value_get_uint (value);
+      break;
+    case PROP_RCVHWM:
+      self->rcvhwm = g_value_get_uint (value);
+      break;
+    case PROP_SNDBUF:
+      self->sndbuf = g_value_get_uint (value);
+      break;
+    case PROP_RCVBUF:
+      self->rcvbuf = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gpp_context_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GPPContext *self = GPP_CONTEXT (object);
+
+  switch (prop_id) {
+    case PROP_IO_THREADS:
+      g_value_set_uint (value, self->io_threads);
+      break;
+    case PROP_IO_THREAD_AFFINITY:
+      g_value_set_uint64 (value, self->io_thread_affinity);
+      break;
+    case PROP_SNDHWM:
+      g_value_set_uint (value, self->sndhwm);
+      break;
+    case PROP_RCVHWM:
+      g_value_set_uint (value, self->rcvhwm);
+      break;
+    case PROP_SNDBUF:
+      g_value_set_uint (value, self->sndbuf);
+      break;
+    case PROP_RCVBUF:
+      g_value_set_uint (value, self->rcvbuf);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+/* zeromq starts its I/O threads along with the first socket, they
+ * have to be configured before that.
+ */
+static void
+constructed (GObject *object)
+{
+  GPPContext *self = GPP_CONTEXT (object);
+
+  self->zmq_ctx = zmq_ctx_new ();
+  zmq_ctx_set (self->zmq_ctx, ZMQ_IO_THREADS, self->io_threads);
+
+  if (self->io_thread_affinity) {
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+    guint cpu;
+
+    for (cpu = 0; cpu < 64; cpu++) {
+      if (self->io_thread_affinity & (G_GUINT64_CONSTANT (1) << cpu))
+        zmq_ctx_set (self->zmq_ctx, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+    }
+#else
+    g_warning ("This version of zeromq can't pin its I/O threads");
+#endif
+  }
+
+  G_OBJECT_CLASS (gpp_context_parent_class)->constructed (object);
+}
+
+/* Objects using the context hold a reference to it, their
+ * sockets are all closed by now.
+ */
+static void
+finalize (GObject *object)
+{
+  GPPContext *self = GPP_CONTEXT (object);
+
+  zmq_ctx_term (self->zmq_ctx);
+
+  G_OBJECT_CLASS (gpp_context_parent_class)->finalize (object);
+}
+
+static void
+gpp_context_class_init (GPPContextClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->constructed = constructed;
+  gobject_class->finalize = finalize;
+  gobject_class->set_property = gpp_context_set_property;
+  gobject_class->get_property = gpp_context_get_property;
+
+  /**
+   * GPPContext:io-threads:
+   *
+   * The number of threads zeromq uses to move messages in and out of
+   * the sockets of the context. One is enough for roughly a gigabyte
+   * per second of traffic.
+   */
+  properties[PROP_IO_THREADS] =
+      g_param_spec_uint ("io-threads", "I/O threads",
+      "Number of I/O threads", 1, G_MAXINT, DEFAULT_IO_THREADS,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPContext:io-thread-affinity:
+   *
+   * A mask of the CPUs the I/O threads may run on, CPU n being
+   * bit n. 0 lets them run anywhere. Requires zeromq 4.3.
+   */
+  properties[PROP_IO_THREAD_AFFINITY] =
+      g_param_spec_uint64 ("io-thread-affinity", "I/O thread affinity",
+      "Mask of the CPUs the I/O threads may run on", 0, G_MAXUINT64, 0,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPContext:sndhwm:
+   *
+   * How many outgoing messages a socket queues for a peer before
+   * dropping or blocking, 0 means no limit.
+   */
+  properties[PROP_SNDHWM] =
+      g_param_spec_uint ("sndhwm", "Send high water mark",
+      "Outgoing messages queued per peer", 0, G_MAXINT, DEFAULT_HWM,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPContext:rcvhwm:
+   *
+   * How many incoming messages a socket queues for a peer before
+   * it stops reading from it, 0 means no limit.
+   */
+  properties[PROP_RCVHWM] =
+      g_param_spec_uint ("rcvhwm", "Receive high water mark",
+      "Incoming messages queued per peer", 0, G_MAXINT, DEFAULT_HWM,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPContext:sndbuf:
+   *
+   * The kernel send buffer size of the network sockets, in bytes,
+   * 0 keeps the system default.
+   */
+  properties[PROP_SNDBUF] =
+      g_param_spec_uint ("sndbuf", "Send buffer",
+      "Kernel send buffer size", 0, G_MAXINT, 0,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPContext:rcvbuf:
+   *
+   * The kernel receive buffer size of the network sockets, in bytes,
+   * 0 keeps the system default.
+   */
+  properties[PROP_RCVBUF] =
+      g_param_spec_uint ("rcvbuf", "Receive buffer",
+      "Kernel receive buffer size", 0, G_MAXINT, 0,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPERTIES, properties);
+}
+
+static void
+gpp_context_init (GPPContext *self)
+{
+}
+
+/* API */
+
+/**
+ * gpp_context_new:
+ * @io_threads: The number of I/O threads of the context.
+ *
+ * Create a new #GPPContext, set its other properties with
+ * g_object_new() instead.
+ *
+ * Returns: the newly-created #GPPContext.
+ */
+GPPContext *
+gpp_context_new (guint io_threads)
+{
+  return g_object_new (GPP_TYPE_CONTEXT, "io-threads", io_threads, NULL);
+}
+
+static gpointer
+create_default_context (gpointer unused)
+{
+  return g_object_new (GPP_TYPE_CONTEXT, NULL);
+}
+
+/**
+ * gpp_context_get_default:
+ *
+ * Objects constructed without a context use this one, it lives as
+ * long as the process.
+ *
+ * Returns: (transfer none): the default #GPPContext.
+ */
+GPPContext *
+gpp_context_get_default (void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  return g_once (&once, create_default_context, NULL);
+}
@@ -0,0 +1,17 @@
+#ifndef _GPP_CONTEXT
+#define _GPP_CONTEXT
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define GPP_TYPE_CONTEXT (gpp_context_get_type ())
+
+G_DECLARE_FINAL_TYPE(GPPContext, gpp_context, GPP, CONTEXT, GObject)
+
+GPPContext * gpp_context_new (guint io_threads);
+GPPContext * gpp_context_get_default (void);
+
+G_END_DECLS
+
+#endif
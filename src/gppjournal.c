@@ -0,0 +1,876 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gpputils.h"
+#include "gppjournal.h"
+
+/* The file starts with a magic string and the sequence number below
+ * which records are stale, followed by the records:
+ *
+ * [size][checksum][type][sequence number][body]
+ *
+ * The size, of the whole record, and the checksum, of what follows
+ * it, are 32-bit big-endian integers, sequence numbers are 64-bit
+ * ones. The body of an accepted request is the wall-clock time at
+ * which it was accepted, followed by its frames, each preceded by its
+ * size. The body of a completion is the sequence number of the
+ * request it completes.
+ *
+ * Each record is followed by a zero size. Reading stops there, or at
+ * the first record that was only partly written or is older than the
+ * one preceding it, which is what follows the last record once the
+ * journal was emptied. Records older than the sequence number in the
+ * header are skipped.
+ *
+ * Only appending records happens in the thread using the journal,
+ * syncing the file, emptying it and compacting it are left to a
+ * thread of its own, see gpp_journal_commit().
+ */
+
+#define JOURNAL_MAGIC       "GPPJRNL1"
+#define JOURNAL_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE  17
+
+#define JOURNAL_INITIAL_SIZE (1024 * 1024)
+/* Journals that grew past that are rewritten with only the records of
+ * the live requests, once these take less than a quarter of them.
+ */
+#define JOURNAL_COMPACT_SIZE (16 * 1024 * 1024)
+
+typedef enum {
+  RECORD_ACCEPT = 1,
+  RECORD_COMPLETE,
+} RecordType;
+
+typedef struct {
+  guint64 seq;
+  gsize offset;
+  gsize size;
+  /* Where the record goes in the compacted journal */
+  gsize compacted_offset;
+} Entry;
+
+/* What the flusher thread is asked to do, it only touches the job
+ * while it is pending.
+ */
+typedef struct {
+  gboolean pending;
+  gboolean done;
+  gboolean failed;
+  gint fd;
+  /* Records up to there are durable once the job is done */
+  gsize end;
+  /* The header was updated to make all the records stale */
+  gboolean reset;
+  /* The compacted journal replaces the journal once synced */
+  gboolean rename;
+  /* Contents of the compacted journal to write, and its file */
+  GBytes *compacted;
+  gint compacted_fd;
+  gsize compacted_end;
+  guint64 compacted_next_seq;
+} Job;
+
+struct _GPPJournal
+{
+  gchar *path;
+  gint fd;
+  guint8 *data;
+  gsize size;
+  gsize page_size;
+  /* Where the next record goes, the records before synced are durable */
+  gsize end;
+  gsize synced;
+  guint64 next_seq;
+  /* Records of the requests that weren't answered yet, by key */
+  GHashTable *live;
+  gsize live_bytes;
+  /* The compacted journal is used, but doesn't replace the file yet */
+  gchar *tmp_path;
+  gboolean rename_pending;
+
+  GThread *flusher;
+  GMutex lock;
+  GCond cond;
+  gboolean stopping;
+  Job job;
+};
+
+static void
+entry_free (Entry *entry)
+{
+  g_slice_free (Entry, entry);
+}
+
+static gint
+compare_entries (const Entry *a, const Entry *b)
+{
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static void
+write_uint32 (guint8 *data, guint32 value)
+{
+  value = GUINT32_TO_BE (value);
+  memcpy (data, &value, 4);
+}
+
+static guint32
+read_uint32 (const guint8 *data)
+{
+  guint32 value;
+
+  memcpy (&value, data, 4);
+  return GUINT32_FROM_BE (value);
+}
+
+static void
+write_uint64 (guint8 *data, guint64 value)
+{
+  value = GUINT64_TO_BE (value);
+  memcpy (data, &value, 8);
+}
+
+static guint64
+read_uint64 (const guint8 *data)
+{
+  guint64 value;
+
+  memcpy (&value, data, 8);
+  return GUINT64_FROM_BE (value);
+}
+
+static void
+set_error_from_errno (GError **error, const gchar *action, const gchar *path)
+{
+  gint saved_errno = errno;
+
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+      "Could not %s %s: %s", action, path, g_strerror (saved_errno));
+}
+
+/* Requests are keyed by the frames up to the empty delimiter, which
+ * identify the client, and by their request id.
+ */
+static GBytes *
+make_key (zmsg_t *msg)
+{
+  GByteArray *key = g_byte_array_new ();
+  zframe_t *frame;
+  GPPHeader header;
+  guint8 size[4];
+
+  for (frame = zmsg_first (msg); frame && zframe_size (frame);
+      frame = zmsg_next (msg)) {
+    write_uint32 (size, zframe_size (frame));
+    g_byte_array_append (key, size, 4);
+    g_byte_array_append (key, zframe_data (frame), zframe_size (frame));
+  }
+
+  if (!frame || !gpp_header_from_frame (zmsg_next (msg), &header)) {
+    g_byte_array_unref (key);
+    return NULL;
+  }
+
+  write_uint32 (size, header.request_id);
+  g_byte_array_append (key, size, 4);
+
+  return g_byte_array_free_to_bytes (key);
+}
+
+/* Mapping */
+
+static gboolean
+map_file (gint fd, gsize size, guint8 **data, GError **error,
+    const gchar *path)
+{
+  if (ftruncate (fd, size) < 0) {
+    set_error_from_errno (error, "resize", path);
+    return FALSE;
+  }
+
+  *data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (*data == MAP_FAILED) {
+    set_error_from_errno (error, "map", path);
+    *data = NULL;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+grow (GPPJournal *journal, gsize needed)
+{
+  GError *error = NULL;
+  gsize size = journal->size;
+  guint8 *data;
+
+  while (size < needed)
+    size *= 2;
+
+  /* Extending the file first keeps the current mapping valid */
+  if (!map_file (journal->fd, size, &data, &error, journal->path)) {
+    g_warning ("%s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  munmap (journal->data, journal->size);
+  journal->data = data;
+  journal->size = size;
+
+  return TRUE;
+}
+
+static gboolean
+sync_range (GPPJournal *journal, gsize start, gsize end)
+{
+  start -= start % journal->page_size;
+
+  if (msync (journal->data + start, end - start, MS_SYNC) < 0) {
+    g_warning ("Could not sync journal %s: %s", journal->path,
+        g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Records */
+
+/* Returns where the body of the record goes, or %NULL if the journal
+ * can't grow enough to hold it.
+ */
+static guint8 *
+begin_record (GPPJournal *journal, RecordType type, guint64 seq,
+    gsize body_size)
+{
+  gsize size = RECORD_HEADER_SIZE + body_size;
+  guint8 *record;
+
+  if (size > G_MAXUINT32)
+    return NULL;
+
+  /* Room for the zero size following it as well */
+  if (journal->end + size + 4 > journal->size &&
+      !grow (journal, journal->end + size + 4))
+    return NULL;
+
+  record = journal->data + journal->end;
+  record[8] = type;
+  write_uint64 (record + 9, seq);
+
+  return record + RECORD_HEADER_SIZE;
+}
+
+/* Returns the offset of the record. Its size is written last, so that
+ * the record doesn't exist until it is complete.
+ */
+static gsize
+end_record (GPPJournal *journal, gsize body_size)
+{
+  gsize offset = journal->end;
+  gsize size = RECORD_HEADER_SIZE + body_size;
+  guint8 *record = journal->data + offset;
+
+  write_uint32 (record + 4, gpp_hash_data (record + 8, size - 8));
+  write_uint32 (record + size, 0);
+  write_uint32 (record, size);
+  journal->end += size;
+
+  return offset;
+}
+
+static zmsg_t *
+decode_request (GPPJournal *journal, Entry *entry, gint64 *accepted_at)
+{
+  const guint8 *body = journal->data + entry->offset + RECORD_HEADER_SIZE;
+  gsize body_size = entry->size - RECORD_HEADER_SIZE;
+  gsize offset = 8;
+  zmsg_t *msg;
+
+  if (body_size < offset)
+    return NULL;
+
+  msg = zmsg_new ();
+  while (offset < body_size) {
+    guint32 size;
+
+    if (body_size - offset < 4 ||
+        (size = read_uint32 (body + offset)) > body_size - offset - 4) {
+      zmsg_destroy (&msg);
+      return NULL;
+    }
+    zmsg_addmem (msg, body + offset + 4, size);
+    offset += 4 + size;
+  }
+
+  if (accepted_at)
+    *accepted_at = read_uint64 (body);
+
+  return msg;
+}
+
+/* Reads the records left by a previous run, and keeps the requests
+ * that weren't completed.
+ */
+static void
+load_records (GPPJournal *journal)
+{
+  GHashTable *accepted = g_hash_table_new (g_int64_hash, g_int64_equal);
+  gsize offset = JOURNAL_HEADER_SIZE;
+  guint64 stale_seq = read_uint64 (journal->data + 8);
+  guint64 min_seq = 0;
+  GHashTableIter iter;
+  Entry *entry;
+
+  while (offset + RECORD_HEADER_SIZE + 4 <= journal->size) {
+    guint8 *record = journal->data + offset;
+    guint32 size = read_uint32 (record);
+    guint64 seq;
+
+    if (size < RECORD_HEADER_SIZE || size > journal->size - offset - 4 ||
+        read_uint32 (record + 4) != gpp_hash_data (record + 8, size - 8))
+      break;
+
+    seq = read_uint64 (record + 9);
+    if (seq < min_seq)
+      break;
+
+    if (seq < stale_seq) {
+      /* Written before the journal was last emptied */
+    } else if (record[8] == RECORD_ACCEPT) {
+      entry = g_slice_new (Entry);
+      entry->seq = seq;
+      entry->offset = offset;
+      entry->size = size;
+      g_hash_table_insert (accepted, &entry->seq, entry);
+    } else if (record[8] == RECORD_COMPLETE &&
+        size == RECORD_HEADER_SIZE + 8) {
+      guint64 completed = read_uint64 (record + RECORD_HEADER_SIZE);
+
+      entry = g_hash_table_lookup (accepted, &completed);
+      if (entry) {
+        g_hash_table_remove (accepted, &completed);
+        entry_free (entry);
+      }
+    } else {
+      break;
+    }
+
+    min_seq = seq + 1;
+    offset += size;
+  }
+
+  journal->end = offset;
+  journal->next_seq = MAX (min_seq, stale_seq);
+
+  g_hash_table_iter_init (&iter, accepted);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+    zmsg_t *msg = decode_request (journal, entry, NULL);
+    GBytes *key = msg ? make_key (msg) : NULL;
+
+    if (key && !g_hash_table_contains (journal->live, key)) {
+      g_hash_table_insert (journal->live, key, entry);
+      journal->live_bytes += entry->size;
+    } else {
+      g_warning ("Dropping an invalid request from journal %s",
+          journal->path);
+      if (key)
+        g_bytes_unref (key);
+      entry_free (entry);
+    }
+
+    if (msg)
+      zmsg_destroy (&msg);
+  }
+
+  g_hash_table_unref (accepted);
+}
+
+static void
+write_header (guint8 *data, guint64 min_seq)
+{
+  memcpy (data, JOURNAL_MAGIC, 8);
+  write_uint64 (data + 8, min_seq);
+  write_uint32 (data + JOURNAL_HEADER_SIZE, 0);
+}
+
+/* Flushing */
+
+/* Writes the compacted journal to a file of its own, returns its
+ * descriptor or -1.
+ */
+static gint
+write_compacted (GPPJournal *journal, GBytes *contents)
+{
+  const guint8 *data;
+  gsize size, written = 0;
+  gint fd;
+
+  fd = open (journal->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    g_warning ("Could not create %s: %s", journal->tmp_path,
+        g_strerror (errno));
+    return -1;
+  }
+
+  data = g_bytes_get_data (contents, &size);
+  while (written < size) {
+    gssize n = write (fd, data + written, size - written);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    written += n;
+  }
+
+  if (written < size || fdatasync (fd) < 0) {
+    g_warning ("Could not write %s: %s", journal->tmp_path,
+        g_strerror (errno));
+    close (fd);
+    unlink (journal->tmp_path);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+run_job (GPPJournal *journal, Job *job)
+{
+  if (job->compacted) {
+    job->compacted_fd = write_compacted (journal, job->compacted);
+    job->failed = job->compacted_fd < 0;
+    return;
+  }
+
+  if (fdatasync (job->fd) < 0) {
+    g_warning ("Could not sync journal %s: %s", journal->path,
+        g_strerror (errno));
+    job->failed = TRUE;
+  } else if (job->rename && rename (journal->tmp_path, journal->path) < 0) {
+    g_warning ("Could not replace %s: %s", journal->path,
+        g_strerror (errno));
+    job->failed = TRUE;
+  }
+}
+
+static gpointer
+flush_thread (GPPJournal *journal)
+{
+  g_mutex_lock (&journal->lock);
+  while (TRUE) {
+    while (!journal->job.pending && !journal->stopping)
+      g_cond_wait (&journal->cond, &journal->lock);
+
+    /* The last job is done before stopping */
+    if (!journal->job.pending)
+      break;
+
+    g_mutex_unlock (&journal->lock);
+    run_job (journal, &journal->job);
+    g_mutex_lock (&journal->lock);
+
+    journal->job.pending = FALSE;
+    journal->job.done = TRUE;
+  }
+  g_mutex_unlock (&journal->lock);
+
+  return NULL;
+}
+
+/* Copies the records of the live requests, for the flusher thread to
+ * write to a new file while we go on appending to this one.
+ */
+static GBytes *
+prepare_compaction (GPPJournal *journal)
+{
+  GList *entries, *tmp;
+  gsize size = JOURNAL_HEADER_SIZE + journal->live_bytes + 4;
+  gsize offset = JOURNAL_HEADER_SIZE;
+  guint8 *data = g_malloc (size);
+
+  entries = g_list_sort (g_hash_table_get_values (journal->live),
+      (GCompareFunc) compare_entries);
+
+  write_header (data, ((Entry *) entries->data)->seq);
+  for (tmp = entries; tmp; tmp = tmp->next) {
+    Entry *entry = tmp->data;
+
+    memcpy (data + offset, journal->data + entry->offset, entry->size);
+    entry->compacted_offset = offset;
+    offset += entry->size;
+  }
+  write_uint32 (data + offset, 0);
+  g_list_free (entries);
+
+  return g_bytes_new_take (data, size);
+}
+
+/* Switches to the compacted journal, to which the records appended
+ * since it was prepared are copied. It replaces the journal once
+ * these are synced as well.
+ */
+static void
+finish_compaction (GPPJournal *journal, Job *job)
+{
+  GError *error = NULL;
+  gsize start = g_bytes_get_size (job->compacted) - 4;
+  gsize tail = journal->end - job->compacted_end;
+  gsize size = JOURNAL_INITIAL_SIZE;
+  GHashTableIter iter;
+  guint8 *data;
+  Entry *entry;
+
+  while (size < (start + tail + 4) * 2)
+    size *= 2;
+
+  if (!map_file (job->compacted_fd, size, &data, &error, journal->tmp_path)) {
+    g_warning ("Could not compact the journal: %s", error->message);
+    g_error_free (error);
+    close (job->compacted_fd);
+    unlink (journal->tmp_path);
+    return;
+  }
+
+  memcpy (data + start, journal->data + job->compacted_end, tail);
+  write_uint32 (data + start + tail, 0);
+
+  g_hash_table_iter_init (&iter, journal->live);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+    if (entry->seq < job->compacted_next_seq)
+      entry->offset = entry->compacted_offset;
+    else
+      entry->offset = entry->offset - job->compacted_end + start;
+  }
+
+  munmap (journal->data, journal->size);
+  close (journal->fd);
+  journal->fd = job->compacted_fd;
+  journal->data = data;
+  journal->size = size;
+  journal->end = start + tail;
+  journal->synced = start;
+  journal->rename_pending = TRUE;
+}
+
+/* Called once the flusher thread is done with the job */
+static gboolean
+finish_job (GPPJournal *journal)
+{
+  Job *job = &journal->job;
+  gboolean failed = job->failed;
+
+  if (job->compacted) {
+    if (!failed)
+      finish_compaction (journal, job);
+    g_clear_pointer (&job->compacted, g_bytes_unref);
+  } else if (!failed) {
+    journal->synced = MAX (journal->synced, job->end);
+    if (job->rename)
+      journal->rename_pending = FALSE;
+    /* The header making the records stale is durable, new records can
+     * overwrite them, unless some were appended in the meantime.
+     */
+    if (job->reset && journal->end == job->end &&
+        !g_hash_table_size (journal->live)) {
+      write_uint32 (journal->data + JOURNAL_HEADER_SIZE, 0);
+      journal->end = journal->synced = JOURNAL_HEADER_SIZE;
+    }
+  }
+
+  memset (job, 0, sizeof (Job));
+  return !failed;
+}
+
+/* Decides what the flusher thread does next, if anything */
+static void
+start_job (GPPJournal *journal)
+{
+  Job *job = &journal->job;
+
+  if (!journal->rename_pending && !g_hash_table_size (journal->live)) {
+    /* Everything was answered, the records become stale */
+    if (journal->end == JOURNAL_HEADER_SIZE)
+      return;
+    write_uint64 (journal->data + 8, journal->next_seq);
+    job->reset = TRUE;
+  } else if (!journal->rename_pending &&
+      journal->end > JOURNAL_COMPACT_SIZE &&
+      journal->live_bytes < journal->end / 4) {
+    job->compacted = prepare_compaction (journal);
+    job->compacted_end = journal->end;
+    job->compacted_next_seq = journal->next_seq;
+  } else if (journal->end == journal->synced && !journal->rename_pending) {
+    return;
+  }
+
+  job->fd = journal->fd;
+  job->end = journal->end;
+  job->rename = journal->rename_pending;
+
+  /* Starts writing the pages back, the flusher thread waits for it */
+  if (!job->compacted && journal->end != journal->synced) {
+    gsize start = journal->synced - journal->synced % journal->page_size;
+
+    msync (journal->data + start, journal->end + 4 - start, MS_ASYNC);
+  }
+
+  g_mutex_lock (&journal->lock);
+  job->pending = TRUE;
+  g_cond_signal (&journal->cond);
+  g_mutex_unlock (&journal->lock);
+}
+
+/* API */
+
+GPPJournal *
+gpp_journal_open (const gchar *path, GError **error)
+{
+  GPPJournal *journal = g_slice_new0 (GPPJournal);
+  struct stat st;
+  gchar magic[8];
+
+  journal->path = g_strdup (path);
+  journal->tmp_path = g_strconcat (path, ".tmp", NULL);
+  journal->page_size = sysconf (_SC_PAGESIZE);
+  journal->live = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+      (GDestroyNotify) g_bytes_unref, (GDestroyNotify) entry_free);
+
+  journal->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (journal->fd < 0) {
+    set_error_from_errno (error, "open", path);
+    goto failed;
+  }
+
+  if (fstat (journal->fd, &st) < 0) {
+    set_error_from_errno (error, "stat", path);
+    goto failed;
+  }
+
+  /* Checked before mapping it, which would resize it */
+  if (st.st_size && ((gsize) st.st_size < JOURNAL_HEADER_SIZE + 4 ||
+      pread (journal->fd, magic, 8, 0) != 8 ||
+      memcmp (magic, JOURNAL_MAGIC, 8))) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+        "%s is not a journal", path);
+    goto failed;
+  }
+
+  journal->size = MAX ((gsize) st.st_size, JOURNAL_INITIAL_SIZE);
+  if (!map_file (journal->fd, journal->size, &journal->data, error, path))
+    goto failed;
+
+  if (st.st_size) {
+    load_records (journal);
+    write_uint32 (journal->data + journal->end, 0);
+  } else {
+    write_header (journal->data, 0);
+    journal->end = JOURNAL_HEADER_SIZE;
+  }
+
+  if (!sync_range (journal, 0, journal->end + 4)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "Could not sync %s", path);
+    goto failed;
+  }
+  journal->synced = journal->end;
+
+  g_mutex_init (&journal->lock);
+  g_cond_init (&journal->cond);
+  journal->flusher = g_thread_new ("gpp-journal",
+      (GThreadFunc) flush_thread, journal);
+
+  return journal;
+
+failed:
+  gpp_journal_free (journal);
+  return NULL;
+}
+
+/* Flushes what is left before closing the journal */
+void
+gpp_journal_free (GPPJournal *journal)
+{
+  if (journal->flusher) {
+    g_mutex_lock (&journal->lock);
+    journal->stopping = TRUE;
+    g_cond_signal (&journal->cond);
+    g_mutex_unlock (&journal->lock);
+    g_thread_join (journal->flusher);
+
+    if (journal->job.done)
+      finish_job (journal);
+    journal->job.fd = journal->fd;
+    journal->job.end = journal->end;
+    journal->job.rename = journal->rename_pending;
+    run_job (journal, &journal->job);
+
+    g_mutex_clear (&journal->lock);
+    g_cond_clear (&journal->cond);
+  }
+
+  if (journal->data)
+    munmap (journal->data, journal->size);
+  if (journal->fd >= 0)
+    close (journal->fd);
+  g_hash_table_unref (journal->live);
+  g_free (journal->path);
+  g_free (journal->tmp_path);
+  g_slice_free (GPPJournal, journal);
+}
+
+/* Hands the requests of the previous run over, oldest first. They
+ * stay in the journal until they are completed.
+ */
+guint
+gpp_journal_replay (GPPJournal *journal, GPPJournalFunc func,
+    gpointer user_data)
+{
+  GList *entries, *tmp;
+  GQueue requests = G_QUEUE_INIT;
+  gint64 *accepted_at;
+  guint n_replayed = 0;
+
+  /* Decoded first, handling them may complete them */
+  entries = g_list_sort (g_hash_table_get_values (journal->live),
+      (GCompareFunc) compare_entries);
+  for (tmp = entries; tmp; tmp = tmp->next) {
+    accepted_at = g_new (gint64, 1);
+    g_queue_push_tail (&requests, decode_request (journal, tmp->data,
+        accepted_at));
+    g_queue_push_tail (&requests, accepted_at);
+  }
+  g_list_free (entries);
+
+  while (!g_queue_is_empty (&requests)) {
+    zmsg_t *msg = g_queue_pop_head (&requests);
+
+    accepted_at = g_queue_pop_head (&requests);
+    func (msg, *accepted_at, user_data);
+    g_free (accepted_at);
+    n_replayed++;
+  }
+
+  return n_replayed;
+}
+
+void
+gpp_journal_accept (GPPJournal *journal, zmsg_t *msg)
+{
+  GBytes *key = make_key (msg);
+  gsize body_size = 8;
+  zframe_t *frame;
+  guint8 *body;
+  Entry *entry;
+
+  if (!key || g_hash_table_contains (journal->live, key)) {
+    if (key)
+      g_bytes_unref (key);
+    return;
+  }
+
+  for (frame = zmsg_first (msg); frame; frame = zmsg_next (msg))
+    body_size += 4 + zframe_size (frame);
+
+  body = begin_record (journal, RECORD_ACCEPT, journal->next_seq, body_size);
+  if (!body) {
+    g_bytes_unref (key);
+    return;
+  }
+
+  write_uint64 (body, g_get_real_time ());
+  body += 8;
+  for (frame = zmsg_first (msg); frame; frame = zmsg_next (msg)) {
+    write_uint32 (body, zframe_size (frame));
+    memcpy (body + 4, zframe_data (frame), zframe_size (frame));
+    body += 4 + zframe_size (frame);
+  }
+
+  entry = g_slice_new (Entry);
+  entry->seq = journal->next_seq++;
+  entry->offset = end_record (journal, body_size);
+  entry->size = RECORD_HEADER_SIZE + body_size;
+  journal->live_bytes += entry->size;
+  g_hash_table_insert (journal->live, key, entry);
+}
+
+/* Does nothing for requests the journal doesn't have */
+void
+gpp_journal_complete (GPPJournal *journal, zmsg_t *msg)
+{
+  GBytes *key;
+  Entry *entry;
+  guint8 *body;
+
+  if (!g_hash_table_size (journal->live) || !(key = make_key (msg)))
+    return;
+
+  entry = g_hash_table_lookup (journal->live, key);
+  if (entry) {
+    /* If it can't be written, the request is just replayed */
+    body = begin_record (journal, RECORD_COMPLETE, journal->next_seq, 8);
+    if (body) {
+      write_uint64 (body, entry->seq);
+      end_record (journal, 8);
+      journal->next_seq++;
+    }
+    journal->live_bytes -= entry->size;
+    g_hash_table_remove (journal->live, key);
+  }
+
+  g_bytes_unref (key);
+}
+
+/* Hands the records appended since the last commit over to the
+ * flusher thread, which makes them durable all at once, then empties
+ * or compacts the journal if the requests answered since leave enough
+ * space to reclaim. While it is busy, the records wait for the next
+ * commit. Returns %FALSE if the previous commit failed.
+ */
+gboolean
+gpp_journal_commit (GPPJournal *journal)
+{
+  gboolean pending, done, succeeded = TRUE;
+
+  g_mutex_lock (&journal->lock);
+  pending = journal->job.pending;
+  done = journal->job.done;
+  g_mutex_unlock (&journal->lock);
+
+  if (pending)
+    return TRUE;
+
+  if (done)
+    succeeded = finish_job (journal);
+  start_job (journal);
+
+  return succeeded;
+}
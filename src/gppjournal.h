@@ -0,0 +1,35 @@
+#ifndef _GPP_JOURNAL
+#define _GPP_JOURNAL
+
+#include <glib.h>
+#include <czmq.h>
+
+/* An append-only file, mapped in memory, recording the requests a
+ * queue accepted and the ones it answered, so that a queue started
+ * again after a crash can dispatch the unanswered ones again.
+ *
+ * Appending a record only writes to the mapping, gpp_journal_commit()
+ * hands all the records appended since it was last called to a thread
+ * of the journal, which makes them durable at once.
+ *
+ * Requests are told apart by their envelope and their request id,
+ * accepting a request the journal already has does nothing.
+ */
+
+typedef struct _GPPJournal GPPJournal;
+
+/* Takes ownership of @msg, @accepted_at is the wall-clock time in
+ * microseconds at which the request was first accepted.
+ */
+typedef void (*GPPJournalFunc) (zmsg_t *msg, gint64 accepted_at,
+    gpointer user_data);
+
+GPPJournal * gpp_journal_open (const gchar *path, GError **error);
+void gpp_journal_free (GPPJournal *journal);
+guint gpp_journal_replay (GPPJournal *journal, GPPJournalFunc func,
+    gpointer user_data);
+void gpp_journal_accept (GPPJournal *journal, zmsg_t *msg);
+void gpp_journal_complete (GPPJournal *journal, zmsg_t *msg);
+gboolean gpp_journal_commit (GPPJournal *journal);
+
+#endif
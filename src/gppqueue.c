@@ -17,11 +17,22 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <glib.h>
 #include <gio/gio.h>
 #include <czmq.h>
 
 #include "gpputils.h"
+#include "gpptimerwheel.h"
+#include "gppzmqsource.h"
+#include "gppstats.h"
+#include "gpptrace.h"
+#include "gppjournal.h"
 #include "gppqueue.h"
 
 /**
@@ -38,32 +49,290 @@
  * {{ ppqueue.markdown }}
  *
  * It will detect if a worker stopped answering heartbeats, and
- * inform the client it was working for if there was one.
+ * inform the client it was working for if there was one. Heartbeats
+ * and expiries are scheduled on a timer wheel, so that each tick only
+ * looks at the workers that need attention.
+ *
+ * Requests that can't be handed to a worker right away wait in
+ * the queue, see #GPPQueue:max-pending-requests and
+ * #GPPQueue:max-pending-bytes for the limits past which they are
+ * rejected. Requests whose time budget runs out while they wait are
+ * answered with a timeout instead of being handed to a worker.
+ *
+ * Waiting requests are handed to workers by order of priority, see
+ * #GPPClient:priority. So that low priority requests aren't starved,
+ * they are handled as if they were one priority higher for each
+ * #GPPQueue:priority-aging they spent waiting.
+ * gpp_queue_get_priority_stats() reports how each priority fares.
+ *
+ * A single routing thread may not keep up with a busy deployment,
+ * #GPPQueue:n-shards lets the queue spread its workers over several
+ * routing threads. Each shard binds the tcp:// endpoints of the queue
+ * itself, the system spreads the connections of clients and workers
+ * over them, and shards hand requests they can't serve over to shards
+ * with idle workers. On systems without SO_REUSEPORT, and for the
+ * other endpoints, the thread the queue was started from moves the
+ * messages between the sockets and the shards.
+ *
+ * The load of the queue is exposed as read-only properties such as
+ * #GPPQueue:pending-requests or #GPPQueue:dispatch-rate, and
+ * gpp_queue_get_stats() adds latency histograms to them. Setting
+ * #GPPQueue:stats-endpoint makes these available to other processes.
+ *
+ * It will pick workers on a least-recently-used basis, unless told
+ * otherwise with #GPPQueue:selection-policy. Requests made with a
+ * routing key, see gpp_client_send_bytes_with_key(), go to the worker
+ * the key maps to on a consistent hash ring, so that workers keep
+ * seeing the same keys as workers come and go. A worker isn't handed
+ * more than #GPPQueue:affinity-load-factor times the average number
+ * of tasks though, further requests for its keys go to the next
+ * workers on the ring. Each shard has a ring of its own, all the
+ * requests with a given key go to the shard the key maps to, which
+ * keeps them rather than handing them over to a sibling, unless it
+ * has no worker at all.
+ *
+ * With #GPPQueue:coalesce-requests, a request identical to one a
+ * worker is handling isn't handed to another worker, its client gets
+ * the same reply. #GPPQueue:reply-cache-ttl additionally makes the
+ * queue keep replies around, and answer identical requests with them
+ * without involving workers. Requests are identical when their
+ * payloads are, as sent by their clients, and their compression
+ * flags. Each shard coalesces and caches on its own.
+ *
+ * Compressed payloads are forwarded as they are, only clients and
+ * workers compress and decompress them. Batches of requests are
+ * handed to a single worker as one task.
  *
- * It will pick workers on a least-recently-used basis.
+ * Queues can be federated, see #GPPQueue:peer-endpoints: each queue
+ * advertises how many of its workers are idle to its peers, and a
+ * queue that would have to keep a request waiting forwards it to a
+ * peer with idle workers instead, then routes the reply back. A
+ * forwarded request isn't forwarded again. Federation isn't available
+ * to queues with several shards.
+ *
+ * With #GPPQueue:journal-path, the queue records the requests it takes
+ * charge of and the replies it sends in a memory-mapped file, flushed
+ * every #GPPQueue:journal-commit-interval milliseconds by a thread of
+ * its own, so that routing never waits for the disk. A queue started
+ * again after a crash dispatches the requests that weren't answered
+ * again, and clients get their replies without having to make them
+ * again, since they keep their identity across reconnections.
+ *
+ * Partial replies streamed by workers are forwarded to the client as
+ * soon as they arrive. Only the client whose request was handed to
+ * the worker gets them, so a request answered that way isn't shared
+ * with identical requests, which are handled on their own, and its
+ * reply isn't cached.
+ *
+ * Workers advertising
+ * that they can handle several tasks concurrently are handed up to
+ * that many tasks at a time.
+ *
+ * Clients and workers in the same process as the queue can reach it
+ * over inproc:// endpoints, and the ones on the same host over
+ * ipc:// endpoints, see #GPPQueue:frontend-endpoint and
+ * #GPPQueue:backend-endpoint.
+ */
+
+typedef struct {
+  GPPQueue *queue;
+  GThread *thread;
+  gint stopping;
+  /* Our ends of the links to the shard */
+  void *frontend_link;
+  void *backend_link;
+  guint frontend_source;
+  guint backend_source;
+} Shard;
+
+/* Counters and histograms, updated as requests go through */
+typedef struct {
+  guint64 n_requests;
+  guint64 n_dispatched;
+  guint64 n_replies;
+  /* Replies telling the client a worker failed */
+  guint64 n_ko;
+  guint64 n_purged_workers;
+  guint64 n_overloaded;
+  guint64 n_timed_out;
+  /* Requests answered along with an identical one */
+  guint64 n_coalesced;
+  guint64 n_cache_hits;
+  /* Requests sent to peers, and those they failed to answer */
+  guint64 n_forwarded;
+  guint64 n_lost_to_peers;
+  /* From the queue receiving a request to a worker getting it */
+  GPPHistogram wait_time;
+  /* From a worker getting a request to the queue getting the reply */
+  GPPHistogram service_time;
+} Metrics;
+
+typedef struct {
+  guint64 n_handled;
+  gint64 total_wait;
+  gint64 max_wait;
+} PriorityStats;
+
+/* The figures of a queue at some point, shards publish theirs for
+ * the queue that owns them to read.
  */
+typedef struct {
+  Metrics metrics;
+  PriorityStats priorities[GPP_N_PRIORITIES];
+  guint depths[GPP_N_PRIORITIES];
+  guint n_pending;
+  guint n_available;
+  guint n_workers;
+  gdouble dispatch_rate;
+} Snapshot;
 
 struct _GPPQueue
 {
   GObject parent;
 
   /* Messaging */
+  GMainContext *context;
+  GPPContext *gpp_context;
   zctx_t *ctx;
+  gchar *frontend_endpoint;
+  gchar *backend_endpoint;
   void *frontend;
   void *backend;
-  GIOChannel *frontend_channel;
   guint frontend_source;
-  GIOChannel *backend_channel;
   guint backend_source;
+  guint dispatch_budget;
+
+  /* Requests waiting for a worker, by priority */
+  GQueue pending[GPP_N_PRIORITIES];
+  PriorityStats stats[GPP_N_PRIORITIES];
+  guint n_pending;
+  gsize pending_bytes;
+  guint n_pending_deadlines;
+  guint max_pending_requests;
+  guint64 max_pending_bytes;
+  guint priority_aging;
 
   /* Worker Management */
   GHashTable *workerz;
-  GQueue *available_workerz;
+  GQueue available_workerz;
+  GQueue worker_pool;
+  GPPSelectionPolicy selection_policy;
+  GRand *rand;
+  /* Tasks handed to the workers and not completed yet */
+  guint n_tasks;
+
+  /* Consistent hash ring of the workers, for keyed requests */
+  GArray *ring;
+  gdouble affinity_load_factor;
+
+  /* Tasks by payload, when coalescing identical requests */
+  gboolean coalesce_requests;
+  GHashTable *flights;
+  /* Replies by request payload */
+  guint reply_cache_ttl;
+  guint64 max_reply_cache_bytes;
+  GHashTable *reply_cache;
+  GQueue cached_replies;
+  guint64 reply_cache_bytes;
+
+  /* Federation, peers by the frontend endpoint they advertise */
+  gchar *federation_endpoint;
+  gchar *federation_address;
+  gchar **peer_endpoints;
+  void *federation;
+  void *peer_states;
+  guint peer_states_source;
+  GHashTable *peers;
+  gint advertised_capacity;
+  gint64 advertised_at;
+
+  /* Journal of the requests not answered yet */
+  gchar *journal_path;
+  guint journal_commit_interval;
+  GPPJournal *journal;
+  guint journal_source;
+
+  /* Heartbeating */
+  GPPTimerWheel *timers;
+  guint timers_source;
+
+  /* Statistics */
+  Metrics metrics;
+  gint64 rate_time;
+  guint64 rate_dispatched;
+  gdouble dispatch_rate;
+  gchar *stats_endpoint;
+  GPPStatsServer *stats_server;
+
+  /* Sharding, the queue started by the user owns the shards */
+  guint n_shards;
+  Shard *shards;
+  guint next_shard;
+  /* Shards know the queue that owns them and their siblings */
+  GPPQueue *owner;
+  guint shard_index;
+  /* Whether clients connect to the shard itself */
+  gboolean shared_frontend;
+  void *handoff;
+  guint handoff_source;
+  void **handoffs;
+  /* What the shard last told its siblings about its load */
+  gint published_available;
+  gint published_pending;
+  gint published_workers;
+  /* Its figures, as of its last heartbeat */
+  GMutex published_lock;
+  Snapshot published;
 };
 
+#define DEFAULT_FRONTEND_ENDPOINT    "tcp://*:5555"
+#define DEFAULT_BACKEND_ENDPOINT     "tcp://*:5556"
+#define DEFAULT_MAX_PENDING_REQUESTS 10000
+#define DEFAULT_MAX_PENDING_BYTES    0
+#define DEFAULT_PRIORITY_AGING       1000
+#define DEFAULT_N_SHARDS             1
+#define DEFAULT_DISPATCH_BUDGET      64
+#define DEFAULT_SELECTION_POLICY     GPP_SELECTION_POLICY_LRU
+#define DEFAULT_AFFINITY_LOAD_FACTOR 1.25
+#define DEFAULT_REPLY_CACHE_TTL      0
+#define DEFAULT_MAX_REPLY_CACHE_BYTES (64 * 1024 * 1024)
+#define DEFAULT_JOURNAL_COMMIT_INTERVAL 10
+
 G_DEFINE_TYPE (GPPQueue, gpp_queue, G_TYPE_OBJECT)
 
-static gboolean check_socket_activity(GIOChannel *source, GIOCondition condition, GPPQueue *self);
+enum
+{
+  PROP_0,
+  PROP_CONTEXT,
+  PROP_FRONTEND_ENDPOINT,
+  PROP_BACKEND_ENDPOINT,
+  PROP_MAX_PENDING_REQUESTS,
+  PROP_MAX_PENDING_BYTES,
+  PROP_PRIORITY_AGING,
+  PROP_N_SHARDS,
+  PROP_DISPATCH_BUDGET,
+  PROP_SELECTION_POLICY,
+  PROP_AFFINITY_LOAD_FACTOR,
+  PROP_COALESCE_REQUESTS,
+  PROP_REPLY_CACHE_TTL,
+  PROP_MAX_REPLY_CACHE_BYTES,
+  PROP_STATS_ENDPOINT,
+  PROP_FEDERATION_ENDPOINT,
+  PROP_FEDERATION_ADDRESS,
+  PROP_PEER_ENDPOINTS,
+  PROP_JOURNAL_PATH,
+  PROP_JOURNAL_COMMIT_INTERVAL,
+  PROP_PENDING_REQUESTS,
+  PROP_AVAILABLE_WORKERS,
+  PROP_N_WORKERS,
+  PROP_DISPATCHED_REQUESTS,
+  PROP_DISPATCH_RATE,
+  PROP_KO_REPLIES,
+  PROP_PURGED_WORKERS,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
 /* Worker management */
 
@@ -71,286 +340,3144 @@ typedef struct {
     zframe_t *identity;
     gchar *id_string;
     gint64 expiry;
-    zframe_t *current_client;
+    gint64 next_heartbeat;
+    GPPTimer timer;
+    guint credit;
+    gboolean available;
+    /* Links the worker in the available workers or in the pool */
+    GList available_link;
+    /* The tasks the worker is busy with */
+    GQueue tasks;
+    GPPHistogram service_time;
+    /* Moving average of the time it takes to handle a task */
+    gdouble service_ewma;
 } Worker;
 
+typedef struct {
+  /* Envelope and header of the request */
+  zmsg_t *envelope;
+  gint64 dispatched_at;
+  /* A copy of the payload, when coalescing or caching replies */
+  GBytes *request;
+  /* Header flags of the request, identical requests share them too */
+  guint8 flags;
+  /* Envelopes of the identical requests waiting for this one */
+  GQueue waiters;
+} Task;
+
+typedef struct {
+  guint32 hash;
+  Worker *worker;
+} RingPoint;
+
+/* Purged workers are kept around for reuse, up to that many */
+#define WORKER_POOL_SIZE 64
+
 static Worker *
-worker_new (zframe_t *identity)
+worker_new (GPPQueue *queue, zframe_t *identity)
 {
-    Worker *self = g_slice_new (Worker);
+    GList *link = g_queue_pop_head_link (&queue->worker_pool);
+    Worker *self = link ? link->data : g_slice_new0 (Worker);
+    gint64 now = g_get_monotonic_time ();
+
     self->identity = identity;
     self->id_string = zframe_strhex (identity);
-    self->current_client = NULL;
+    self->expiry = now + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+    self->next_heartbeat = now + HEARTBEAT_INTERVAL;
+    self->timer.link.data = self;
+    self->credit = 1;
+    self->available = FALSE;
+    self->available_link.data = self;
+    g_queue_init (&self->tasks);
+    gpp_histogram_reset (&self->service_time);
+    self->service_ewma = 0;
+
+    gpp_timer_wheel_schedule (queue->timers, &self->timer,
+        self->next_heartbeat);
     return self;
 }
 
 static void
-worker_destroy (Worker *self)
+envelope_free (zmsg_t *envelope)
+{
+  zmsg_destroy (&envelope);
+}
+
+static void
+task_free (Task *task)
+{
+  zmsg_destroy (&task->envelope);
+  if (task->request)
+    g_bytes_unref (task->request);
+  g_queue_clear_full (&task->waiters, (GDestroyNotify) envelope_free);
+  g_slice_free (Task, task);
+}
+
+static void
+worker_clear (Worker *self)
 {
   zframe_destroy (&self->identity);
   free (self->id_string);
-  if (self->current_client)
-    zframe_destroy (&self->current_client);
-  g_slice_free (Worker, self);
+  g_queue_clear_full (&self->tasks, (GDestroyNotify) task_free);
 }
 
-static gboolean
-maybe_purge_worker (gchar *id_string, Worker *worker, GPPQueue *self)
-{
-  if (g_get_monotonic_time () > worker->expiry) {
-    g_info ("purging worker with id %s", worker->id_string);
-    if (worker->current_client) {
-      zframe_t *client_id_dup = zframe_dup (worker->current_client);
-      zframe_t *ko_frame = zframe_new (PPP_KO, 1);
-      zframe_t *empty_frame = zframe_new_empty ();
-      zmsg_t *msg = zmsg_new();
-      zmsg_prepend (msg, &ko_frame);
-      zmsg_prepend (msg, &empty_frame);
-      zmsg_prepend (msg, &client_id_dup);
-      zmsg_send (&msg, self->frontend);
-
-      g_info ("Worker had a client, sent KO message");
-    }
-
-    g_queue_remove (self->available_workerz, worker);
-    return TRUE;
-  }
-  return FALSE;
+static void
+worker_free (Worker *self)
+{
+  g_slice_free (Worker, self);
 }
 
 static void
-purge_workers (GPPQueue *self)
+worker_destroy (Worker *self)
 {
-  g_hash_table_foreach_remove (self->workerz, (GHRFunc) maybe_purge_worker, self);
-  if (g_queue_get_length (self->available_workerz) == 0 && self->frontend_source) {
-    g_source_remove (self->frontend_source);
-    self->frontend_source = 0;
-  }
+  worker_clear (self);
+  worker_free (self);
 }
 
 static void
-add_available_worker (GPPQueue *self, Worker *worker)
+worker_release (GPPQueue *queue, Worker *self)
 {
-  g_debug ("worker %s is now available", worker->id_string);
-  g_queue_push_tail (self->available_workerz, worker);
-  if (g_queue_get_length (self->available_workerz) == 1)
-    self->frontend_source = g_io_add_watch(self->frontend_channel,
-        G_IO_IN, (GIOFunc) check_socket_activity, self);
+  gpp_timer_wheel_cancel (queue->timers, &self->timer);
+  worker_clear (self);
+  if (g_queue_get_length (&queue->worker_pool) < WORKER_POOL_SIZE)
+    g_queue_push_head_link (&queue->worker_pool, &self->available_link);
+  else
+    worker_free (self);
 }
 
-static Worker *
-add_new_worker (GPPQueue *self, zframe_t *identity)
+/* Workers are looked up with the identity frame the backend
+ * gives us, without converting it to anything.
+ */
+static guint
+identity_hash (zframe_t *identity)
 {
-  Worker *worker = worker_new (identity);
-  g_hash_table_insert (self->workerz, worker->id_string, worker);
-  g_info ("Created a new worker : %s", worker->id_string);
-  add_available_worker (self, worker);
-  return worker;
+  return gpp_hash_data (zframe_data (identity), zframe_size (identity));
 }
 
-/* Messaging */
+static gboolean
+identity_equal (zframe_t *a, zframe_t *b)
+{
+  return zframe_eq (a, b);
+}
 
-int handle_backend (GPPQueue *self)
+/* Consistent hashing */
+
+/* Each worker is placed at that many points of the ring, so that
+ * the keys of a purged worker are spread over all the others.
+ */
+#define RING_POINTS_PER_WORKER 64
+
+/* Murmur3 finalizer, the identities and keys hash to values too
+ * close to each other to be spread over the ring as they are.
+ */
+static guint32
+mix_hash (guint32 hash)
 {
-  zmsg_t *msg = zmsg_recv (self->backend);
-  Worker *worker = NULL;
-  if (!msg) {
-    return -1;
-  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
 
-  zframe_t *identity = zmsg_unwrap (msg);
+  return hash;
+}
 
-  //  Validate control message, or return reply to client
+static gint
+compare_ring_points (const RingPoint *a, const RingPoint *b)
+{
+  return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
 
-  worker = g_hash_table_lookup (self->workerz, zframe_strhex (identity));
-  if (!worker)
-    worker = add_new_worker (self, identity);
+static void
+ring_add_worker (GPPQueue *self, Worker *worker)
+{
+  guint32 hash = identity_hash (worker->identity);
+  guint i;
 
-  if (zmsg_size (msg) == 1) {
-    zframe_t *frame = zmsg_first (msg);
+  for (i = 0; i < RING_POINTS_PER_WORKER; i++) {
+    RingPoint point = { mix_hash (hash + i * 0x9e3779b9u), worker };
 
-    if (memcmp (zframe_data (frame), PPP_READY, 1)
-        &&  memcmp (zframe_data (frame), PPP_HEARTBEAT, 1)) {
-      zmsg_dump (msg);
-    }
-    zmsg_destroy (&msg);
-  }
-  else {
-    g_info ("worker %s has completed a task !", worker->id_string);
-    zmsg_send (&msg, self->frontend);
-    zframe_destroy (&worker->current_client);
-    worker->current_client = NULL;
-    add_available_worker (self, worker);
+    g_array_append_val (self->ring, point);
   }
 
-  worker->expiry = g_get_monotonic_time ()
-                 + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
-
-  return 0;
+  g_array_sort (self->ring, (GCompareFunc) compare_ring_points);
 }
 
 static void
-handle_frontend (GPPQueue *self)
+ring_remove_worker (GPPQueue *self, Worker *worker)
 {
-  Worker *worker;
-  zframe_t *worker_id_dup;
-  zmsg_t *msg = zmsg_recv (self->frontend);
+  guint i, j = 0;
 
-  if (!msg)
-    return;
+  for (i = 0; i < self->ring->len; i++) {
+    RingPoint *point = &g_array_index (self->ring, RingPoint, i);
 
-  worker = g_queue_pop_head (self->available_workerz);
-  if (g_queue_get_length (self->available_workerz) == 0) {
-    g_source_remove (self->frontend_source);
-    self->frontend_source = 0;
+    if (point->worker != worker)
+      g_array_index (self->ring, RingPoint, j++) = *point;
   }
 
-  worker->current_client = zframe_dup (zmsg_first(msg));
-  worker_id_dup = zframe_dup (worker->identity);
-  zmsg_prepend (msg, &worker_id_dup);
-
-  g_info ("sending task to worker %s", worker->id_string);
-  zmsg_send (&msg, self->backend);
+  g_array_set_size (self->ring, j);
 }
 
-static gboolean check_socket_activity(GIOChannel *source, GIOCondition condition, GPPQueue *self)
+/* The first point at or after @hash, wrapping around */
+static guint
+ring_find (GPPQueue *self, guint32 hash)
 {
-  uint32_t status;
-  size_t sizeof_status = sizeof(status);
-  gboolean go_on;
+  guint low = 0, high = self->ring->len;
 
-  /* FIXME : error handling here, not sure what to do */
-  do {
-    go_on = FALSE;
+  while (low < high) {
+    guint middle = low + (high - low) / 2;
 
-    if (zmq_getsockopt(self->backend, ZMQ_EVENTS, &status, &sizeof_status)) {
-      perror("retrieving event status");
-      return 0;
-    }
+    if (g_array_index (self->ring, RingPoint, middle).hash < hash)
+      low = middle + 1;
+    else
+      high = middle;
+  }
 
-    if ((status & ZMQ_POLLIN) != 0) {
-      handle_backend (self);
-      go_on = TRUE;
-    }
+  return low == self->ring->len ? 0 : low;
+}
 
-    if (!self->frontend_source)
-      continue;
+/* Walks the ring from the point of @key_hash to the first available
+ * worker that isn't busier than its share, settling for the first
+ * available one if they all are. There must be an available worker.
+ */
+static Worker *
+select_worker_for_key (GPPQueue *self, guint32 key_hash)
+{
+  gdouble share = self->affinity_load_factor * (self->n_tasks + 1)
+      / g_hash_table_size (self->workerz);
+  guint max_tasks = (guint) share;
+  guint start = ring_find (self, mix_hash (key_hash));
+  Worker *fallback = NULL;
+  guint i;
 
-    if (zmq_getsockopt(self->frontend, ZMQ_EVENTS, &status, &sizeof_status)) {
-      perror("retrieving event status");
-      return 0;
-    }
+  if (max_tasks < share)
+    max_tasks++;
 
-    if ((status & ZMQ_POLLIN) != 0) {
-      go_on = TRUE;
-      handle_frontend (self);
-    }
-  } while (go_on);
+  for (i = 0; i < self->ring->len; i++) {
+    RingPoint *point = &g_array_index (self->ring, RingPoint,
+        (start + i) % self->ring->len);
+    Worker *worker = point->worker;
+
+    if (!worker->available)
+      continue;
+    if (g_queue_get_length (&worker->tasks) < max_tasks)
+      return worker;
+    if (!fallback)
+      fallback = worker;
+  }
 
-  return 1;
+  return fallback ? fallback : g_queue_peek_head (&self->available_workerz);
 }
 
-/* Heartbeating */
+static gboolean
+worker_has_credit (Worker *worker)
+{
+  return g_queue_get_length (&worker->tasks) < worker->credit;
+}
 
 static void
-send_heartbeat (gchar *id_string, Worker *worker, GPPQueue *self)
+remove_available_worker (GPPQueue *self, Worker *worker)
 {
-  zframe_send (&worker->identity, self->backend,
-      ZFRAME_REUSE + ZFRAME_MORE);
-  zframe_t *frame = zframe_new (PPP_HEARTBEAT, 1);
-  zframe_send (&frame, self->backend, 0);
-  g_debug ("sent heartbeat to one worker\n");
+  g_queue_unlink (&self->available_workerz, &worker->available_link);
+  worker->available = FALSE;
+}
+
+/* Replies */
+
+/* When clients connect to the shards, requests a shard hands over to
+ * a sibling start with a frame telling where they came from, so that
+ * the sibling sends the reply back through that shard. Replies to
+ * requests found in the journal start with a frame telling to send
+ * them through every shard, their client may have reconnected to any
+ * of them. Identities made up by zmq are 5 bytes long and start with
+ * a zero, the ones set by peers can't start with a zero.
+ */
+#define ORIGIN_MARKER_SIZE 6
+#define BROADCAST_MARKER "\0B"
+#define BROADCAST_MARKER_SIZE 2
+
+static zframe_t *
+origin_marker_new (guint index)
+{
+  byte data[ORIGIN_MARKER_SIZE] = { 0, 'O' };
+
+  data[2] = (index >> 24) & 0xff;
+  data[3] = (index >> 16) & 0xff;
+  data[4] = (index >> 8) & 0xff;
+  data[5] = index & 0xff;
+
+  return zframe_new (data, ORIGIN_MARKER_SIZE);
 }
 
 static gboolean
-do_heartbeat (GPPQueue *self)
+is_origin_marker (zframe_t *frame, guint *index)
 {
-  g_hash_table_foreach (self->workerz, (GHFunc) send_heartbeat, self);
+  byte *data;
+
+  if (!frame || zframe_size (frame) != ORIGIN_MARKER_SIZE)
+    return FALSE;
+
+  data = zframe_data (frame);
+  if (data[0] != 0 || data[1] != 'O')
+    return FALSE;
 
-  g_debug ("doing heartbeat\n");
-  purge_workers (self);
+  if (index)
+    *index = (data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
   return TRUE;
 }
 
-/* Initialization */
+static gboolean
+is_broadcast_marker (zframe_t *frame)
+{
+  return frame && zframe_size (frame) == BROADCAST_MARKER_SIZE &&
+      memcmp (zframe_data (frame), BROADCAST_MARKER,
+          BROADCAST_MARKER_SIZE) == 0;
+}
 
+/* All the replies go to the clients through here */
 static void
-create_channels (GPPQueue *self)
+send_to_client (GPPQueue *self, zmsg_t **msg)
+{
+  zframe_t *first = zmsg_first (*msg);
+  guint index, i;
+
+  if (self->shared_frontend && is_origin_marker (first, &index) &&
+      index < self->owner->n_shards && index != self->shard_index) {
+    zmsg_remove (*msg, first);
+    zframe_destroy (&first);
+    zmsg_send (msg, self->handoffs[index]);
+    return;
+  }
+
+  if (self->shared_frontend && is_broadcast_marker (first)) {
+    zmsg_remove (*msg, first);
+    zframe_destroy (&first);
+    for (i = 0; i < self->owner->n_shards; i++) {
+      zmsg_t *copy;
+
+      if (i == self->shard_index)
+        continue;
+      copy = zmsg_dup (*msg);
+      zmsg_send (&copy, self->handoffs[i]);
+    }
+  }
+
+  zmsg_send (msg, self->frontend);
+}
+
+/* Replies that have to go through another shard lose the benefit of
+ * sending @payload without copying it.
+ */
+static void
+send_to_client_with_payload (GPPQueue *self, zmsg_t **msg,
+    GBytes *payload)
 {
-  self->ctx = zctx_new ();
-  self->frontend = zsocket_new (self->ctx, ZMQ_ROUTER);
-  self->backend = zsocket_new (self->ctx, ZMQ_ROUTER);
-  zsocket_bind (self->frontend, "tcp://*:5555");
-  zsocket_bind (self->backend,  "tcp://*:5556");
+  zframe_t *first = zmsg_first (*msg);
+
+  if (!self->shared_frontend ||
+      (!is_origin_marker (first, NULL) && !is_broadcast_marker (first))) {
+    gpp_msg_send_with_payload (msg, self->frontend, payload);
+    return;
+  }
 
-  self->frontend_channel = g_io_channel_from_zmq_socket (self->frontend);
-  self->backend_channel = g_io_channel_from_zmq_socket (self->backend);
+  if (payload)
+    zmsg_addmem (*msg, g_bytes_get_data (payload, NULL),
+        g_bytes_get_size (payload));
+  else
+    zmsg_addmem (*msg, NULL, 0);
+  send_to_client (self, msg);
 }
 
-/* GObject */
+/* Journal */
 
+/* Called once the queue takes charge of a request */
 static void
-dispose (GObject *object)
+journal_request (GPPQueue *self, zmsg_t *msg)
 {
-  GPPQueue *self = GPP_QUEUE (object);
+  if (self->journal)
+    gpp_journal_accept (self->journal, msg);
+}
 
-  g_hash_table_unref (self->workerz);
-  zctx_destroy (&self->ctx);
+/* Called with the final reply to a request, before it goes to the
+ * client.
+ */
+static void
+journal_reply (GPPQueue *self, zmsg_t *reply)
+{
+  if (self->journal)
+    gpp_journal_complete (self->journal, reply);
 }
 
+/* Coalescing and reply cache */
+
+typedef struct {
+  GBytes *request;
+  GBytes *reply;
+  guint8 request_flags;
+  guint8 reply_flags;
+  gsize size;
+  gint64 expiry;
+  /* Links the entry in the cache, oldest first */
+  GList link;
+} CachedReply;
+
 static void
-gpp_queue_class_init (GPPQueueClass *klass)
+cached_reply_free (CachedReply *cached)
 {
-  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  g_bytes_unref (cached->request);
+  g_bytes_unref (cached->reply);
+  g_slice_free (CachedReply, cached);
+}
 
-  gobject_class->dispose = dispose;
+/* Looks at the payload of @msg without copying it, the bytes must
+ * not outlive the message.
+ */
+static GBytes *
+peek_payload (zmsg_t *msg)
+{
+  zframe_t *payload = zmsg_last (msg);
+
+  return g_bytes_new_static (zframe_data (payload), zframe_size (payload));
 }
 
+/* Leaves the envelope and the header of @msg */
 static void
-gpp_queue_init (GPPQueue *self)
+strip_payload (zmsg_t *msg, zframe_t *header)
+{
+  while (zmsg_last (msg) != header) {
+    zframe_t *frame = zmsg_last (msg);
+
+    zmsg_remove (msg, frame);
+    zframe_destroy (&frame);
+  }
+}
+
+static void
+uncache_reply (GPPQueue *self, CachedReply *cached)
+{
+  g_queue_unlink (&self->cached_replies, &cached->link);
+  self->reply_cache_bytes -= cached->size;
+  g_hash_table_remove (self->reply_cache, cached->request);
+}
+
+static void
+cache_reply (GPPQueue *self, Task *task, GBytes *reply, guint8 reply_flags)
 {
-  create_channels (self);
+  GBytes *request = task->request;
+  CachedReply *cached = g_hash_table_lookup (self->reply_cache, request);
+  gsize size = g_bytes_get_size (request) + g_bytes_get_size (reply);
+
+  if (cached)
+    uncache_reply (self, cached);
+
+  if (self->max_reply_cache_bytes) {
+    if (size > self->max_reply_cache_bytes)
+      return;
+
+    while (self->reply_cache_bytes + size > self->max_reply_cache_bytes)
+      uncache_reply (self, self->cached_replies.head->data);
+  }
 
-  self->workerz = g_hash_table_new_full (g_str_hash, g_str_equal,
-      NULL, (GDestroyNotify) worker_destroy);
-  self->available_workerz = g_queue_new();
+  cached = g_slice_new (CachedReply);
+  cached->request = g_bytes_ref (request);
+  cached->reply = g_bytes_ref (reply);
+  cached->request_flags = task->flags;
+  cached->reply_flags = reply_flags;
+  cached->size = size;
+  cached->expiry = g_get_monotonic_time ()
+      + self->reply_cache_ttl * G_TIME_SPAN_MILLISECOND;
+  cached->link.data = cached;
+  g_queue_push_tail_link (&self->cached_replies, &cached->link);
+  self->reply_cache_bytes += size;
+  g_hash_table_insert (self->reply_cache, cached->request, cached);
 }
 
-/* API */
+/* All the entries live as long, the oldest expire first */
+static void
+expire_cached_replies (GPPQueue *self, gint64 now)
+{
+  CachedReply *cached;
 
-/**
- * gpp_queue_new:
- *
- * Create a new #GPPQueue, which doesn't yet listen to #GPPWorker (s).
- * Start it with gpp_queue_start()
- *
- * Returns: the newly-created #GPPQueue.
+  while ((cached = g_queue_peek_head (&self->cached_replies)) &&
+      cached->expiry <= now)
+    uncache_reply (self, cached);
+}
+
+/* Payloads are compared as they are on the wire, compressed or not,
+ * the flags tell them apart, and whether the client can decompress
+ * the reply.
  */
-GPPQueue *
-gpp_queue_new (void)
+static gboolean
+answer_from_cache (GPPQueue *self, zmsg_t **msg, GBytes *payload,
+    guint8 flags)
 {
-  return g_object_new (GPP_TYPE_QUEUE, NULL);
+  CachedReply *cached = g_hash_table_lookup (self->reply_cache, payload);
+  zframe_t *frame;
+
+  if (!cached || cached->request_flags != flags)
+    return FALSE;
+
+  if (cached->expiry <= g_get_monotonic_time ()) {
+    uncache_reply (self, cached);
+    return FALSE;
+  }
+
+  /* The trace context, if any, goes back with the reply */
+  frame = zmsg_last (*msg);
+  zmsg_remove (*msg, frame);
+  zframe_destroy (&frame);
+  frame = gpp_msg_find_header (*msg);
+  gpp_header_frame_set_status (frame, GPP_STATUS_OK);
+  gpp_header_frame_set_timeout (frame, 0);
+  gpp_header_frame_set_flags (frame, cached->reply_flags);
+  journal_reply (self, *msg);
+  send_to_client_with_payload (self, msg, cached->reply);
+  self->metrics.n_cache_hits++;
+
+  return TRUE;
 }
 
-/**
- * gpp_queue_start:
- * @self: A #GPPQueue to start.
- *
- * Makes @self start to route requests to available workers,
- * and check worker's liveness.
- *
- * Returns: %TRUE if the queue was started, %FALSE if it was already.
+/* Makes the client wait for the reply to the identical request a
+ * worker is handling already.
  */
-gboolean
-gpp_queue_start (GPPQueue *self)
+static gboolean
+join_flight (GPPQueue *self, zmsg_t **msg, GBytes *payload, guint8 flags)
 {
-  if (self->backend_source)
-    return FALSE;
+  Task *leader = g_hash_table_lookup (self->flights, payload);
 
-  self->backend_source = g_io_add_watch (self->backend_channel,
-      G_IO_IN, (GIOFunc) check_socket_activity, self);
+  if (!leader || leader->flags != flags)
+    return FALSE;
 
-  g_timeout_add (HEARTBEAT_INTERVAL / 1000, (GSourceFunc) do_heartbeat, self);
+  journal_request (self, *msg);
+  strip_payload (*msg, gpp_msg_find_header (*msg));
+  g_queue_push_tail (&leader->waiters, *msg);
+  *msg = NULL;
+  self->metrics.n_coalesced++;
 
   return TRUE;
 }
+
+static void
+leave_flight (GPPQueue *self, Task *task)
+{
+  if (self->flights &&
+      g_hash_table_lookup (self->flights, task->request) == task)
+    g_hash_table_remove (self->flights, task->request);
+}
+
+static void
+answer_waiters (GPPQueue *self, Task *task, GPPStatus status, GBytes *reply,
+    guint8 reply_flags)
+{
+  zmsg_t *waiter;
+
+  while ((waiter = g_queue_pop_head (&task->waiters))) {
+    zframe_t *header = zmsg_last (waiter);
+
+    gpp_header_frame_set_status (header, status);
+    gpp_header_frame_set_timeout (header, 0);
+    gpp_header_frame_set_flags (header, reply_flags);
+    journal_reply (self, waiter);
+    send_to_client_with_payload (self, &waiter, reply);
+  }
+}
+
+/* Called with the reply of the worker before it goes to the client */
+static void
+settle_task (GPPQueue *self, Task *task, zmsg_t *reply)
+{
+  zframe_t *header_frame = gpp_msg_find_header (reply);
+  zframe_t *payload = zmsg_last (reply);
+  GBytes *reply_bytes = NULL;
+  GPPHeader header;
+
+  if (!task->request)
+    return;
+
+  leave_flight (self, task);
+
+  if (!gpp_header_from_frame (header_frame, &header)) {
+    header.status = GPP_STATUS_KO;
+    header.flags = 0;
+  }
+
+  /* Copied once, then shared by the waiters and the cache */
+  if (header.status == GPP_STATUS_OK && payload != header_frame &&
+      (self->reply_cache || !g_queue_is_empty (&task->waiters)))
+    reply_bytes = g_bytes_new (zframe_data (payload), zframe_size (payload));
+
+  if (reply_bytes && self->reply_cache)
+    cache_reply (self, task, reply_bytes, header.flags);
+  answer_waiters (self, task, header.status, reply_bytes, header.flags);
+
+  if (reply_bytes)
+    g_bytes_unref (reply_bytes);
+}
+
+static void
+purge_worker (GPPQueue *self, Worker *worker)
+{
+  Task *task;
+
+  g_info ("purging worker with id %s", worker->id_string);
+  g_hash_table_steal (self->workerz, worker->identity);
+  self->metrics.n_purged_workers++;
+
+  while ((task = g_queue_pop_head (&worker->tasks))) {
+    gpp_header_frame_set_status (zmsg_last (task->envelope), GPP_STATUS_KO);
+    journal_reply (self, task->envelope);
+    send_to_client (self, &task->envelope);
+    if (task->request) {
+      leave_flight (self, task);
+      answer_waiters (self, task, GPP_STATUS_KO, NULL, 0);
+    }
+    task_free (task);
+    self->n_tasks--;
+    self->metrics.n_ko++;
+
+    g_info ("Worker had a client, sent KO message");
+  }
+
+  if (worker->available)
+    remove_available_worker (self, worker);
+  ring_remove_worker (self, worker);
+
+  worker_release (self, worker);
+}
+
+static void
+add_available_worker (GPPQueue *self, Worker *worker)
+{
+  g_debug ("worker %s is now available", worker->id_string);
+  worker->available = TRUE;
+  g_queue_push_tail_link (&self->available_workerz, &worker->available_link);
+}
+
+static Worker *
+add_new_worker (GPPQueue *self, zframe_t *identity)
+{
+  Worker *worker = worker_new (self, identity);
+  g_hash_table_insert (self->workerz, worker->identity, worker);
+  ring_add_worker (self, worker);
+  g_info ("Created a new worker : %s", worker->id_string);
+  add_available_worker (self, worker);
+  return worker;
+}
+
+static void
+set_worker_credit (GPPQueue *self, Worker *worker, zframe_t *credit_frame)
+{
+  guint32 credit;
+
+  if (!gpp_uint32_from_frame (credit_frame, &credit) || credit == 0)
+    return;
+
+  if (credit != worker->credit)
+    g_info ("worker %s can now handle %u tasks", worker->id_string, credit);
+
+  worker->credit = credit;
+  if (!worker->available && worker_has_credit (worker))
+    add_available_worker (self, worker);
+}
+
+/* Messaging */
+
+/* Copies everything up to the header, that's what we need to
+ * match the reply of a worker with the task, or to send a KO
+ * to the client if the worker dies.
+ */
+static zmsg_t *
+dup_envelope (zmsg_t *msg, zframe_t *header)
+{
+  zmsg_t *envelope = zmsg_new ();
+  zframe_t *frame;
+
+  for (frame = zmsg_first (msg); frame; frame = zmsg_next (msg)) {
+    zframe_t *copy = zframe_dup (frame);
+    zmsg_append (envelope, &copy);
+    if (frame == header)
+      break;
+  }
+
+  return envelope;
+}
+
+static gboolean
+task_matches_reply (zmsg_t *task, zmsg_t *reply)
+{
+  zframe_t *task_frame, *reply_frame;
+  GPPHeader task_header, reply_header;
+
+  reply_frame = zmsg_first (reply);
+  for (task_frame = zmsg_first (task); task_frame != zmsg_last (task);
+      task_frame = zmsg_next (task)) {
+    if (!reply_frame || !zframe_eq (task_frame, reply_frame))
+      return FALSE;
+    reply_frame = zmsg_next (reply);
+  }
+
+  if (!gpp_header_from_frame (task_frame, &task_header) ||
+      !gpp_header_from_frame (reply_frame, &reply_header))
+    return FALSE;
+
+  return task_header.request_id == reply_header.request_id;
+}
+
+/* Worker selection, among the available workers */
+
+GType
+gpp_selection_policy_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { GPP_SELECTION_POLICY_LRU, "GPP_SELECTION_POLICY_LRU", "lru" },
+    { GPP_SELECTION_POLICY_LEAST_OUTSTANDING,
+      "GPP_SELECTION_POLICY_LEAST_OUTSTANDING", "least-outstanding" },
+    { GPP_SELECTION_POLICY_POWER_OF_TWO,
+      "GPP_SELECTION_POLICY_POWER_OF_TWO", "power-of-two" },
+    { GPP_SELECTION_POLICY_LATENCY_EWMA,
+      "GPP_SELECTION_POLICY_LATENCY_EWMA", "latency-ewma" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter (&type))
+    g_once_init_leave (&type,
+        g_enum_register_static ("GPPSelectionPolicy", values));
+
+  return type;
+}
+
+/* How much the last task weighs in the average */
+#define SERVICE_EWMA_WEIGHT 0.2
+
+static void
+update_service_ewma (Worker *worker, gint64 service_time)
+{
+  if (worker->service_ewma == 0)
+    worker->service_ewma = service_time;
+  else
+    worker->service_ewma += SERVICE_EWMA_WEIGHT *
+        (service_time - worker->service_ewma);
+}
+
+/* Ties go to the least recently used worker */
+static Worker *
+select_least_outstanding (GPPQueue *self)
+{
+  Worker *best = NULL;
+  GList *tmp;
+
+  for (tmp = self->available_workerz.head; tmp; tmp = tmp->next) {
+    Worker *worker = tmp->data;
+
+    if (!best || g_queue_get_length (&worker->tasks) <
+        g_queue_get_length (&best->tasks))
+      best = worker;
+  }
+
+  return best;
+}
+
+static Worker *
+select_power_of_two (GPPQueue *self)
+{
+  guint n = g_queue_get_length (&self->available_workerz);
+  guint i, j;
+  Worker *a, *b;
+
+  if (n == 1)
+    return g_queue_peek_head (&self->available_workerz);
+
+  i = g_rand_int_range (self->rand, 0, n);
+  j = g_rand_int_range (self->rand, 0, n - 1);
+  if (j >= i)
+    j++;
+
+  a = g_queue_peek_nth (&self->available_workerz, i);
+  b = g_queue_peek_nth (&self->available_workerz, j);
+
+  return g_queue_get_length (&b->tasks) < g_queue_get_length (&a->tasks) ?
+      b : a;
+}
+
+/* Workers that haven't handled anything yet are tried first */
+static Worker *
+select_latency_ewma (GPPQueue *self)
+{
+  Worker *best = NULL;
+  gdouble best_cost = 0;
+  GList *tmp;
+
+  for (tmp = self->available_workerz.head; tmp; tmp = tmp->next) {
+    Worker *worker = tmp->data;
+    gdouble cost = worker->service_ewma *
+        (g_queue_get_length (&worker->tasks) + 1);
+
+    if (!best || cost < best_cost) {
+      best = worker;
+      best_cost = cost;
+    }
+  }
+
+  return best;
+}
+
+/* There must be an available worker */
+static Worker *
+select_worker (GPPQueue *self)
+{
+  switch (self->selection_policy) {
+    case GPP_SELECTION_POLICY_LEAST_OUTSTANDING:
+      return select_least_outstanding (self);
+    case GPP_SELECTION_POLICY_POWER_OF_TWO:
+      return select_power_of_two (self);
+    case GPP_SELECTION_POLICY_LATENCY_EWMA:
+      return select_latency_ewma (self);
+    case GPP_SELECTION_POLICY_LRU:
+    default:
+      return g_queue_peek_head (&self->available_workerz);
+  }
+}
+
+static gboolean
+is_partial_reply (zmsg_t *reply)
+{
+  GPPHeader header;
+
+  return gpp_header_from_frame (gpp_msg_find_header (reply), &header) &&
+      header.status == GPP_STATUS_PARTIAL;
+}
+
+static void
+complete_task (GPPQueue *self, Worker *worker, zmsg_t *reply)
+{
+  GList *tmp;
+
+  for (tmp = worker->tasks.head; tmp; tmp = tmp->next) {
+    Task *task = tmp->data;
+
+    if (task_matches_reply (task->envelope, reply)) {
+      gint64 service_time = g_get_monotonic_time () - task->dispatched_at;
+
+      gpp_histogram_record (&worker->service_time, service_time);
+      update_service_ewma (worker, service_time);
+      gpp_histogram_record (&self->metrics.service_time, service_time);
+      settle_task (self, task, reply);
+      g_queue_delete_link (&worker->tasks, tmp);
+      task_free (task);
+      self->n_tasks--;
+      break;
+    }
+  }
+
+  if (!worker->available && worker_has_credit (worker))
+    add_available_worker (self, worker);
+}
+
+static void handle_request (GPPQueue *self, zmsg_t *msg,
+    gboolean can_hand_off);
+
+/* Partial replies only go to the client the task is for, identical
+ * requests can't share them. The ones waiting for this task are
+ * handled on their own again, and the reply isn't cached.
+ */
+static void
+unshare_task (GPPQueue *self, Worker *worker, zmsg_t *partial)
+{
+  GList *tmp;
+
+  for (tmp = worker->tasks.head; tmp; tmp = tmp->next) {
+    Task *task = tmp->data;
+    zmsg_t *waiter;
+
+    if (!task_matches_reply (task->envelope, partial))
+      continue;
+
+    if (!task->request)
+      return;
+
+    leave_flight (self, task);
+    while ((waiter = g_queue_pop_head (&task->waiters))) {
+      zmsg_addmem (waiter, g_bytes_get_data (task->request, NULL),
+          g_bytes_get_size (task->request));
+      handle_request (self, waiter, FALSE);
+    }
+    g_clear_pointer (&task->request, g_bytes_unref);
+    return;
+  }
+}
+
+static void
+dispatch_request (GPPQueue *self, zmsg_t *msg)
+{
+  Worker *worker;
+  zframe_t *worker_id_dup;
+  Task *task = g_slice_new (Task);
+  zframe_t *header_frame = gpp_msg_find_header (msg);
+  zframe_t *trace = gpp_msg_find_trace (msg);
+  GPPHeader header;
+
+  if (trace) {
+    gpp_trace_frame_stamp (trace, GPP_HOP_QUEUE_DISPATCH);
+    gpp_trace_record_span (trace, "client-to-queue", GPP_HOP_CLIENT_SEND,
+        GPP_HOP_QUEUE_RECEIVE);
+    gpp_trace_record_span (trace, "queue-wait", GPP_HOP_QUEUE_RECEIVE,
+        GPP_HOP_QUEUE_DISPATCH);
+  }
+
+  gpp_header_from_frame (header_frame, &header);
+  if (header.key_hash && self->ring->len)
+    worker = select_worker_for_key (self, header.key_hash);
+  else
+    worker = select_worker (self);
+  task->envelope = dup_envelope (msg, header_frame);
+  task->dispatched_at = g_get_monotonic_time ();
+  task->request = NULL;
+  task->flags = header.flags;
+  g_queue_init (&task->waiters);
+  if (self->flights || self->reply_cache) {
+    zframe_t *payload = zmsg_last (msg);
+
+    task->request = g_bytes_new (zframe_data (payload), zframe_size (payload));
+    if (self->flights)
+      g_hash_table_replace (self->flights, task->request, task);
+  }
+  g_queue_push_tail (&worker->tasks, task);
+  self->n_tasks++;
+  self->metrics.n_dispatched++;
+
+  /* Keep handing tasks to it in a round-robin fashion */
+  if (worker_has_credit (worker)) {
+    g_queue_unlink (&self->available_workerz, &worker->available_link);
+    g_queue_push_tail_link (&self->available_workerz,
+        &worker->available_link);
+  } else {
+    remove_available_worker (self, worker);
+  }
+
+  worker_id_dup = zframe_dup (worker->identity);
+  zmsg_prepend (msg, &worker_id_dup);
+
+  g_info ("sending task to worker %s", worker->id_string);
+  zmsg_send (&msg, self->backend);
+}
+
+/* Sends the request back to the client, without its payload */
+static void
+reject_request (GPPQueue *self, zmsg_t *msg, GPPStatus status)
+{
+  zframe_t *payload = zmsg_last (msg);
+
+  zmsg_remove (msg, payload);
+  zframe_destroy (&payload);
+  gpp_header_frame_set_status (gpp_msg_find_header (msg), status);
+  journal_reply (self, msg);
+  send_to_client (self, &msg);
+
+  if (status == GPP_STATUS_OVERLOADED)
+    self->metrics.n_overloaded++;
+  else if (status == GPP_STATUS_TIMEOUT)
+    self->metrics.n_timed_out++;
+}
+
+/* Requests waiting for a worker */
+
+typedef struct {
+  zmsg_t *msg;
+  gsize size;
+  guint priority;
+  gint64 queued_at;
+  /* Monotonic time past which the client gave up, 0 if never */
+  gint64 deadline;
+} PendingRequest;
+
+static void
+pending_request_free (PendingRequest *pending)
+{
+  if (pending->msg)
+    zmsg_destroy (&pending->msg);
+  g_slice_free (PendingRequest, pending);
+}
+
+static void
+record_wait (GPPQueue *self, guint priority, gint64 wait)
+{
+  PriorityStats *stats = &self->stats[priority];
+
+  stats->n_handled++;
+  stats->total_wait += wait;
+  stats->max_wait = MAX (stats->max_wait, wait);
+  gpp_histogram_record (&self->metrics.wait_time, wait);
+}
+
+static void
+queue_request (GPPQueue *self, zmsg_t *msg, guint priority, gint64 now,
+    gint64 deadline)
+{
+  PendingRequest *pending;
+  gsize size = zmsg_content_size (msg);
+
+  if ((self->max_pending_requests &&
+       self->n_pending >= self->max_pending_requests) ||
+      (self->max_pending_bytes &&
+       self->pending_bytes + size > self->max_pending_bytes)) {
+    g_info ("Too many pending requests, rejecting one");
+    reject_request (self, msg, GPP_STATUS_OVERLOADED);
+    return;
+  }
+
+  journal_request (self, msg);
+  pending = g_slice_new (PendingRequest);
+  pending->msg = msg;
+  pending->size = size;
+  pending->priority = priority;
+  pending->queued_at = now;
+  pending->deadline = deadline;
+
+  self->n_pending++;
+  self->pending_bytes += size;
+  if (deadline)
+    self->n_pending_deadlines++;
+  g_queue_push_tail (&self->pending[priority], pending);
+}
+
+static zmsg_t *
+unqueue_request (GPPQueue *self, GList *link)
+{
+  PendingRequest *pending = link->data;
+  zmsg_t *msg = pending->msg;
+
+  g_queue_delete_link (&self->pending[pending->priority], link);
+  self->n_pending--;
+  self->pending_bytes -= pending->size;
+  if (pending->deadline)
+    self->n_pending_deadlines--;
+
+  pending->msg = NULL;
+  pending_request_free (pending);
+  return msg;
+}
+
+/* Strict priority, except that a request climbs one priority
+ * for each priority_aging milliseconds it waited. Ties go to the
+ * most urgent queue.
+ */
+static GList *
+next_pending_request (GPPQueue *self, gint64 now)
+{
+  GList *best = NULL;
+  gint64 best_rank = G_MAXINT64;
+  guint i;
+
+  for (i = 0; i < GPP_N_PRIORITIES; i++) {
+    PendingRequest *pending = g_queue_peek_head (&self->pending[i]);
+    gint64 rank = i;
+
+    if (!pending)
+      continue;
+
+    if (self->priority_aging)
+      rank -= (now - pending->queued_at) /
+          (self->priority_aging * G_TIME_SPAN_MILLISECOND);
+
+    if (rank < best_rank) {
+      best = self->pending[i].head;
+      best_rank = rank;
+    }
+  }
+
+  return best;
+}
+
+/* Returns %FALSE if the request timed out, otherwise passes what's
+ * left of its budget on.
+ */
+static gboolean
+update_request_timeout (GPPQueue *self, zmsg_t *msg, gint64 deadline,
+    gint64 now)
+{
+  if (!deadline)
+    return TRUE;
+
+  if (now >= deadline) {
+    g_info ("Request timed out before reaching a worker");
+    reject_request (self, msg, GPP_STATUS_TIMEOUT);
+    return FALSE;
+  }
+
+  gpp_header_frame_set_timeout (gpp_msg_find_header (msg),
+      MAX (1, (deadline - now) / 1000));
+  return TRUE;
+}
+
+static void
+dispatch_pending_requests (GPPQueue *self)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  while (self->n_pending && !g_queue_is_empty (&self->available_workerz)) {
+    GList *link = next_pending_request (self, now);
+    PendingRequest *pending = link->data;
+    gint64 deadline = pending->deadline;
+    guint priority = pending->priority;
+    gint64 queued_at = pending->queued_at;
+    zmsg_t *msg = unqueue_request (self, link);
+
+    if (update_request_timeout (self, msg, deadline, now)) {
+      record_wait (self, priority, now - queued_at);
+      dispatch_request (self, msg);
+    }
+  }
+}
+
+/* Clients shouldn't wait for workers that may never come */
+static void
+expire_pending_requests (GPPQueue *self)
+{
+  gint64 now;
+  GList *link, *next;
+  guint i;
+
+  if (!self->n_pending_deadlines)
+    return;
+
+  now = g_get_monotonic_time ();
+  for (i = 0; i < GPP_N_PRIORITIES; i++) {
+    for (link = self->pending[i].head; link; link = next) {
+      gint64 deadline = ((PendingRequest *) link->data)->deadline;
+
+      next = link->next;
+      if (deadline && now >= deadline)
+        update_request_timeout (self, unqueue_request (self, link), deadline,
+            now);
+    }
+  }
+}
+
+static void publish_load (GPPQueue *self);
+static void publish_stats (GPPQueue *self);
+
+static gboolean
+handle_backend (GPPQueue *self)
+{
+  zmsg_t *msg = zmsg_recv (self->backend);
+  Worker *worker = NULL;
+  if (!msg) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  zframe_t *identity = zmsg_unwrap (msg);
+
+  //  Validate control message, or return reply to client
+
+  worker = g_hash_table_lookup (self->workerz, identity);
+  if (worker)
+    zframe_destroy (&identity);
+  else
+    worker = add_new_worker (self, identity);
+
+  if (zmsg_size (msg) <= 2) {
+    zframe_t *frame = zmsg_first (msg);
+
+    if (zframe_size (frame) != 1 || (memcmp (zframe_data (frame), PPP_READY, 1)
+        &&  memcmp (zframe_data (frame), PPP_HEARTBEAT, 1))) {
+      zmsg_dump (msg);
+    } else {
+      set_worker_credit (self, worker, zmsg_next (msg));
+    }
+    zmsg_destroy (&msg);
+  }
+  else if (is_partial_reply (msg)) {
+    /* Streamed to the client right away, the task goes on */
+    unshare_task (self, worker, msg);
+    send_to_client (self, &msg);
+  }
+  else {
+    GPPHeader header;
+
+    g_info ("worker %s has completed a task !", worker->id_string);
+    complete_task (self, worker, msg);
+    self->metrics.n_replies++;
+    if (gpp_header_from_frame (gpp_msg_find_header (msg), &header) &&
+        header.status == GPP_STATUS_KO)
+      self->metrics.n_ko++;
+    journal_reply (self, msg);
+    send_to_client (self, &msg);
+  }
+
+  worker->expiry = g_get_monotonic_time ()
+                 + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+
+  dispatch_pending_requests (self);
+  publish_load (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean hand_off_request (GPPQueue *self, zmsg_t **msg);
+static gboolean hand_off_keyed_request (GPPQueue *self, zmsg_t **msg,
+    guint32 key_hash);
+static gboolean forward_to_peer (GPPQueue *self, zmsg_t **msg,
+    GPPHeader *header);
+
+static void
+handle_request (GPPQueue *self, zmsg_t *msg, gboolean can_hand_off)
+{
+  zframe_t *header_frame;
+  GPPHeader header;
+  gint64 now, deadline = 0;
+
+  header_frame = gpp_msg_find_header (msg);
+  if (!gpp_header_from_frame (header_frame, &header) ||
+      header_frame == zmsg_last (msg)) {
+    g_warning ("E: invalid request\n");
+    zmsg_dump (msg);
+    zmsg_destroy (&msg);
+    return;
+  }
+
+  /* Requests handed over were counted by the shard that got them */
+  if (can_hand_off)
+    self->metrics.n_requests++;
+
+  if (can_hand_off && header.key_hash &&
+      hand_off_keyed_request (self, &msg, header.key_hash))
+    return;
+
+  if (self->reply_cache || self->flights) {
+    GBytes *payload = peek_payload (msg);
+    gboolean answered = (self->reply_cache &&
+        answer_from_cache (self, &msg, payload, header.flags)) ||
+        (self->flights && join_flight (self, &msg, payload, header.flags));
+
+    g_bytes_unref (payload);
+    if (answered)
+      return;
+  }
+
+  if (!self->n_pending && !g_queue_is_empty (&self->available_workerz)) {
+    journal_request (self, msg);
+    record_wait (self, header.priority, 0);
+    dispatch_request (self, msg);
+    return;
+  }
+
+  /* Keyed requests stay on the ring of their shard */
+  if (can_hand_off && !(header.key_hash && self->ring->len) &&
+      hand_off_request (self, &msg))
+    return;
+
+  if (self->peers && forward_to_peer (self, &msg, &header))
+    return;
+
+  now = g_get_monotonic_time ();
+  if (header.timeout)
+    deadline = now + header.timeout * G_TIME_SPAN_MILLISECOND;
+  queue_request (self, msg, header.priority, now, deadline);
+}
+
+static gboolean
+handle_frontend (GPPQueue *self)
+{
+  zmsg_t *msg = zmsg_recv (self->frontend);
+
+  if (msg) {
+    zframe_t *trace = gpp_msg_find_trace (msg);
+
+    if (trace)
+      gpp_trace_frame_stamp (trace, GPP_HOP_QUEUE_RECEIVE);
+    handle_request (self, msg, TRUE);
+  }
+  publish_load (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Requests handed over by another shard, which couldn't serve them,
+ * and replies to the requests we handed over, or to be sent to all
+ * the clients connected to us.
+ */
+static gboolean
+handle_handoff (GPPQueue *self)
+{
+  zmsg_t *msg = zmsg_recv (self->handoff);
+  GPPHeader header;
+
+  if (msg && gpp_header_from_frame (gpp_msg_find_header (msg), &header) &&
+      header.status != GPP_STATUS_REQUEST)
+    send_to_client (self, &msg);
+  else if (msg)
+    handle_request (self, msg, FALSE);
+  publish_load (self);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Federation */
+
+static guint
+add_watch (GPPQueue *self, void *socket, GPPZmqSourceFunc func,
+    gpointer user_data)
+{
+  return gpp_zmq_source_attach (socket, self->dispatch_budget, func,
+      user_data, self->context);
+}
+
+static void
+remove_source (GPPQueue *self, guint *source_id)
+{
+  if (!*source_id)
+    return;
+
+  g_source_destroy (g_main_context_find_source_by_id (self->context,
+      *source_id));
+  *source_id = 0;
+}
+
+typedef struct {
+  GPPQueue *queue;
+  /* The frontend endpoint it advertises */
+  gchar *address;
+  void *socket;
+  guint source;
+  /* Its idle workers, minus the requests sent to it since it said so */
+  gint capacity;
+  gint64 expiry;
+  /* Envelopes of the requests forwarded to it and not answered yet */
+  GQueue forwarded;
+} Peer;
+
+static void
+peer_free (Peer *peer)
+{
+  zmsg_t *envelope;
+
+  while ((envelope = g_queue_pop_head (&peer->forwarded)))
+    zmsg_destroy (&envelope);
+  g_free (peer->address);
+  g_slice_free (Peer, peer);
+}
+
+/* Replies to the requests we forwarded, on their way to the clients */
+static gboolean
+handle_peer (Peer *peer)
+{
+  GPPQueue *self = peer->queue;
+  zmsg_t *msg = zmsg_recv (peer->socket);
+  GPPHeader header;
+  GList *tmp;
+
+  if (!msg)
+    return G_SOURCE_CONTINUE;
+
+  if (!gpp_header_from_frame (gpp_msg_find_header (msg), &header)) {
+    g_warning ("E: invalid reply from peer %s\n", peer->address);
+    zmsg_dump (msg);
+    zmsg_destroy (&msg);
+    return G_SOURCE_CONTINUE;
+  }
+
+  for (tmp = peer->forwarded.head; tmp; tmp = tmp->next) {
+    zmsg_t *envelope = tmp->data;
+
+    if (task_matches_reply (envelope, msg))
+      break;
+  }
+
+  /* Clients of requests we gave up on were told already */
+  if (!tmp) {
+    zmsg_destroy (&msg);
+    return G_SOURCE_CONTINUE;
+  }
+
+  if (header.status != GPP_STATUS_PARTIAL) {
+    zmsg_t *envelope = tmp->data;
+
+    zmsg_destroy (&envelope);
+    g_queue_delete_link (&peer->forwarded, tmp);
+    self->metrics.n_replies++;
+    if (header.status == GPP_STATUS_KO)
+      self->metrics.n_ko++;
+    journal_reply (self, msg);
+  }
+
+  send_to_client (self, &msg);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+connect_peer (GPPQueue *self, Peer *peer)
+{
+  peer->socket = zsocket_new (self->ctx, ZMQ_DEALER);
+  gpp_context_configure_socket (self->gpp_context, peer->socket);
+  zsocket_connect (peer->socket, "%s", peer->address);
+  peer->source = add_watch (self, peer->socket,
+      (GPPZmqSourceFunc) handle_peer, peer);
+}
+
+/* States are made of the frontend endpoint of a peer and its number
+ * of idle workers.
+ */
+static gboolean
+handle_peer_state (GPPQueue *self)
+{
+  zmsg_t *msg = zmsg_recv (self->peer_states);
+  gchar *address;
+  guint32 capacity;
+  Peer *peer;
+
+  if (!msg)
+    return G_SOURCE_CONTINUE;
+
+  address = zmsg_popstr (msg);
+  if (!address || !gpp_uint32_from_frame (zmsg_first (msg), &capacity)) {
+    g_warning ("E: invalid peer state\n");
+    zmsg_dump (msg);
+    goto done;
+  }
+
+  if (!g_strcmp0 (address, self->federation_address))
+    goto done;
+
+  peer = g_hash_table_lookup (self->peers, address);
+  if (!peer) {
+    g_info ("new peer at %s", address);
+    peer = g_slice_new0 (Peer);
+    peer->queue = self;
+    peer->address = g_strdup (address);
+    connect_peer (self, peer);
+    g_hash_table_insert (self->peers, peer->address, peer);
+  }
+
+  peer->capacity = MIN (capacity, G_MAXINT);
+  peer->expiry = g_get_monotonic_time ()
+      + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+
+done:
+  g_free (address);
+  zmsg_destroy (&msg);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Called when we would have to queue @msg, sends it to the peer with
+ * the most idle workers instead.
+ */
+static gboolean
+forward_to_peer (GPPQueue *self, zmsg_t **msg, GPPHeader *header)
+{
+  gint64 now = g_get_monotonic_time ();
+  GHashTableIter iter;
+  Peer *peer, *best = NULL;
+  zframe_t *header_frame;
+
+  if (header->flags & GPP_HEADER_FLAG_FORWARDED)
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, self->peers);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &peer))
+    if (peer->expiry > now && peer->capacity > 0 &&
+        (!best || peer->capacity > best->capacity))
+      best = peer;
+
+  if (!best)
+    return FALSE;
+
+  g_debug ("forwarding a request to peer %s", best->address);
+  best->capacity--;
+  journal_request (self, *msg);
+  header_frame = gpp_msg_find_header (*msg);
+  gpp_header_frame_set_flags (header_frame,
+      header->flags | GPP_HEADER_FLAG_FORWARDED);
+  g_queue_push_tail (&best->forwarded, dup_envelope (*msg, header_frame));
+  zmsg_send (msg, best->socket);
+  self->metrics.n_forwarded++;
+
+  return TRUE;
+}
+
+/* Fails the requests of the peers that went silent */
+static void
+expire_peers (GPPQueue *self, gint64 now)
+{
+  GHashTableIter iter;
+  Peer *peer;
+
+  g_hash_table_iter_init (&iter, self->peers);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &peer)) {
+    zmsg_t *envelope;
+
+    if (peer->expiry > now || g_queue_is_empty (&peer->forwarded))
+      continue;
+
+    g_warning ("peer %s stopped advertising its state, failing the %u "
+        "requests forwarded to it", peer->address,
+        g_queue_get_length (&peer->forwarded));
+    peer->capacity = 0;
+
+    while ((envelope = g_queue_pop_head (&peer->forwarded))) {
+      gpp_header_frame_set_status (zmsg_last (envelope), GPP_STATUS_KO);
+      journal_reply (self, envelope);
+      send_to_client (self, &envelope);
+      self->metrics.n_ko++;
+      self->metrics.n_lost_to_peers++;
+    }
+
+    /* Drops what is still waiting to be sent to it */
+    remove_source (self, &peer->source);
+    zsocket_destroy (self->ctx, peer->socket);
+    connect_peer (self, peer);
+  }
+}
+
+/* Peers hear from us when our capacity changes, and at least once per
+ * heartbeat interval.
+ */
+static void
+advertise_capacity (GPPQueue *self, gint64 now)
+{
+  gint capacity = 0;
+  zmsg_t *msg;
+  zframe_t *frame;
+
+  if (!self->n_pending)
+    capacity = g_queue_get_length (&self->available_workerz);
+
+  if (capacity == self->advertised_capacity &&
+      now - self->advertised_at < HEARTBEAT_INTERVAL)
+    return;
+
+  msg = zmsg_new ();
+  frame = gpp_uint32_to_frame (capacity);
+  zmsg_addstr (msg, self->federation_address);
+  zmsg_append (msg, &frame);
+  zmsg_send (&msg, self->federation);
+  self->advertised_capacity = capacity;
+  self->advertised_at = now;
+}
+
+static void
+start_federation (GPPQueue *self)
+{
+  gchar **endpoint;
+
+  if (self->federation_endpoint && self->federation_address) {
+    self->federation = zsocket_new (self->ctx, ZMQ_PUB);
+    if (zsocket_bind (self->federation, "%s", self->federation_endpoint) == -1)
+      g_warning ("Could not bind to %s", self->federation_endpoint);
+  }
+
+  if (!self->peer_endpoints || !*self->peer_endpoints)
+    return;
+
+  self->peers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) peer_free);
+  self->peer_states = zsocket_new (self->ctx, ZMQ_SUB);
+  zsocket_set_subscribe (self->peer_states, "");
+  for (endpoint = self->peer_endpoints; *endpoint; endpoint++)
+    zsocket_connect (self->peer_states, "%s", *endpoint);
+  self->peer_states_source = add_watch (self, self->peer_states,
+      (GPPZmqSourceFunc) handle_peer_state, self);
+}
+
+static void
+stop_federation (GPPQueue *self)
+{
+  if (self->peers) {
+    GHashTableIter iter;
+    Peer *peer;
+
+    g_hash_table_iter_init (&iter, self->peers);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &peer))
+      remove_source (self, &peer->source);
+  }
+
+  remove_source (self, &self->peer_states_source);
+  g_clear_pointer (&self->peers, g_hash_table_unref);
+}
+
+/* Heartbeating */
+
+static void
+send_heartbeat (GPPQueue *self, Worker *worker)
+{
+  zframe_send (&worker->identity, self->backend,
+      ZFRAME_REUSE + ZFRAME_MORE);
+  zframe_t *frame = zframe_new (PPP_HEARTBEAT, 1);
+  zframe_send (&frame, self->backend, 0);
+  g_debug ("sent heartbeat to one worker\n");
+}
+
+/* Each worker has a single timer, due either when we need to
+ * send it a heartbeat or when it may have expired. Messages from
+ * the worker only push its expiry back, we check it here.
+ */
+static void
+worker_timer_cb (GPPTimer *timer, GPPQueue *self)
+{
+  Worker *worker = timer->link.data;
+  gint64 now = g_get_monotonic_time ();
+
+  if (now > worker->expiry) {
+    purge_worker (self, worker);
+    return;
+  }
+
+  if (now >= worker->next_heartbeat) {
+    send_heartbeat (self, worker);
+    worker->next_heartbeat = now + HEARTBEAT_INTERVAL;
+  }
+
+  gpp_timer_wheel_schedule (self->timers, timer,
+      MIN (worker->next_heartbeat, worker->expiry + 1));
+}
+
+static void
+update_dispatch_rate (GPPQueue *self, gint64 now)
+{
+  gint64 elapsed = now - self->rate_time;
+
+  if (elapsed < G_USEC_PER_SEC)
+    return;
+
+  self->dispatch_rate = (gdouble)
+      (self->metrics.n_dispatched - self->rate_dispatched) * G_USEC_PER_SEC
+      / elapsed;
+  self->rate_dispatched = self->metrics.n_dispatched;
+  self->rate_time = now;
+}
+
+static gboolean
+do_heartbeat (GPPQueue *self)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  gpp_timer_wheel_advance (self->timers, now);
+  expire_pending_requests (self);
+  if (self->reply_cache)
+    expire_cached_replies (self, now);
+  update_dispatch_rate (self, now);
+  publish_load (self);
+  publish_stats (self);
+  if (self->peers)
+    expire_peers (self, now);
+  if (self->federation)
+    advertise_capacity (self, now);
+  return TRUE;
+}
+
+/* Statistics */
+
+/* Reads the figures of @queue, from the thread it runs in */
+static void
+snapshot_fill (Snapshot *snapshot, GPPQueue *queue)
+{
+  guint i;
+
+  snapshot->metrics = queue->metrics;
+  for (i = 0; i < GPP_N_PRIORITIES; i++) {
+    snapshot->priorities[i] = queue->stats[i];
+    snapshot->depths[i] = g_queue_get_length (&queue->pending[i]);
+  }
+  snapshot->n_pending = queue->n_pending;
+  snapshot->n_available = g_queue_get_length (&queue->available_workerz);
+  snapshot->n_workers = g_hash_table_size (queue->workerz);
+  snapshot->dispatch_rate = queue->dispatch_rate;
+}
+
+static void
+snapshot_merge (Snapshot *snapshot, const Snapshot *other)
+{
+  const Metrics *metrics = &other->metrics;
+  guint i;
+
+  snapshot->metrics.n_requests += metrics->n_requests;
+  snapshot->metrics.n_dispatched += metrics->n_dispatched;
+  snapshot->metrics.n_replies += metrics->n_replies;
+  snapshot->metrics.n_ko += metrics->n_ko;
+  snapshot->metrics.n_purged_workers += metrics->n_purged_workers;
+  snapshot->metrics.n_overloaded += metrics->n_overloaded;
+  snapshot->metrics.n_timed_out += metrics->n_timed_out;
+  snapshot->metrics.n_coalesced += metrics->n_coalesced;
+  snapshot->metrics.n_cache_hits += metrics->n_cache_hits;
+  snapshot->metrics.n_forwarded += metrics->n_forwarded;
+  snapshot->metrics.n_lost_to_peers += metrics->n_lost_to_peers;
+  gpp_histogram_merge (&snapshot->metrics.wait_time, &metrics->wait_time);
+  gpp_histogram_merge (&snapshot->metrics.service_time,
+      &metrics->service_time);
+  for (i = 0; i < GPP_N_PRIORITIES; i++) {
+    PriorityStats *stats = &snapshot->priorities[i];
+
+    stats->n_handled += other->priorities[i].n_handled;
+    stats->total_wait += other->priorities[i].total_wait;
+    stats->max_wait = MAX (stats->max_wait, other->priorities[i].max_wait);
+    snapshot->depths[i] += other->depths[i];
+  }
+  snapshot->n_pending += other->n_pending;
+  snapshot->n_available += other->n_available;
+  snapshot->n_workers += other->n_workers;
+  snapshot->dispatch_rate += other->dispatch_rate;
+}
+
+/* Called by shards on each heartbeat, nothing else they own may be
+ * read from another thread.
+ */
+static void
+publish_stats (GPPQueue *self)
+{
+  if (!self->owner)
+    return;
+
+  g_mutex_lock (&self->published_lock);
+  snapshot_fill (&self->published, self);
+  g_mutex_unlock (&self->published_lock);
+}
+
+/* Shards keep their own figures, we merge the ones they last
+ * published, which are at most a heartbeat old.
+ */
+static Snapshot *
+take_snapshot (GPPQueue *self)
+{
+  Snapshot *snapshot = g_new0 (Snapshot, 1);
+  guint i;
+
+  if (!self->shards)
+    snapshot_fill (snapshot, self);
+
+  for (i = 0; self->shards && i < self->n_shards; i++) {
+    GPPQueue *shard = self->shards[i].queue;
+
+    g_mutex_lock (&shard->published_lock);
+    snapshot_merge (snapshot, &shard->published);
+    g_mutex_unlock (&shard->published_lock);
+  }
+
+  return snapshot;
+}
+
+/* Sharding */
+
+/* Shards publish their load after each batch of messages, the
+ * queue and the other shards read it without taking any lock.
+ */
+static void
+publish_load (GPPQueue *self)
+{
+  if (!self->owner)
+    return;
+
+  g_atomic_int_set (&self->published_available,
+      g_queue_get_length (&self->available_workerz));
+  g_atomic_int_set (&self->published_pending, self->n_pending);
+  g_atomic_int_set (&self->published_workers,
+      g_hash_table_size (self->workerz));
+}
+
+/* Claims one of the available workers @shard published, so that
+ * concurrent senders don't all pick the same idle worker.
+ */
+static gboolean
+reserve_available_worker (GPPQueue *shard)
+{
+  gint available;
+
+  do {
+    available = g_atomic_int_get (&shard->published_available);
+    if (available <= 0)
+      return FALSE;
+  } while (!g_atomic_int_compare_and_exchange (&shard->published_available,
+      available, available - 1));
+
+  return TRUE;
+}
+
+/* When clients are connected to us, the reply comes back through us */
+static void
+send_to_shard (GPPQueue *self, guint index, zmsg_t **msg)
+{
+  if (self->shared_frontend) {
+    zframe_t *marker = origin_marker_new (self->shard_index);
+
+    zmsg_prepend (*msg, &marker);
+  }
+
+  zmsg_send (msg, self->handoffs[index]);
+}
+
+/* Called when we would have to queue @msg, hands it over to a
+ * sibling that has an available worker instead.
+ */
+static gboolean
+hand_off_request (GPPQueue *self, zmsg_t **msg)
+{
+  guint i;
+
+  if (!self->owner)
+    return FALSE;
+
+  for (i = 1; i < self->owner->n_shards; i++) {
+    guint index = (self->shard_index + i) % self->owner->n_shards;
+
+    if (reserve_available_worker (self->owner->shards[index].queue)) {
+      g_debug ("handing a request over to shard %u", index);
+      send_to_shard (self, index, msg);
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* When clients connect to the shards directly, keyed requests reach
+ * any of them, the ones whose key maps to another shard with workers
+ * go there, as they would through route_client_message().
+ */
+static gboolean
+hand_off_keyed_request (GPPQueue *self, zmsg_t **msg, guint32 key_hash)
+{
+  guint index;
+
+  if (!self->shared_frontend)
+    return FALSE;
+
+  index = key_hash % self->owner->n_shards;
+  if (index == self->shard_index ||
+      !g_atomic_int_get (&self->owner->shards[index].queue->published_workers))
+    return FALSE;
+
+  send_to_shard (self, index, msg);
+  return TRUE;
+}
+
+/* Favours shards with available workers, then the least loaded
+ * ones, starting from a different shard each time.
+ */
+static guint
+pick_shard (GPPQueue *self)
+{
+  guint i, best = self->next_shard;
+  gint best_pending = G_MAXINT;
+
+  for (i = 0; i < self->n_shards; i++) {
+    guint index = (self->next_shard + i) % self->n_shards;
+    GPPQueue *shard = self->shards[index].queue;
+    gint pending;
+
+    if (reserve_available_worker (shard)) {
+      best = index;
+      break;
+    }
+
+    pending = g_atomic_int_get (&shard->published_pending);
+    if (pending < best_pending) {
+      best = index;
+      best_pending = pending;
+    }
+  }
+
+  self->next_shard = (self->next_shard + 1) % self->n_shards;
+  return best;
+}
+
+/* Sends @part and the parts following it on @from to @to,
+ * without copying them.
+ */
+static void
+forward_parts (void *from, void *to, zmq_msg_t *part)
+{
+  while (TRUE) {
+    gboolean more = zmq_msg_more (part);
+
+    if (zmq_msg_send (part, to, more ? ZMQ_SNDMORE : 0) == -1)
+      zmq_msg_close (part);
+
+    if (!more)
+      break;
+
+    zmq_msg_init (part);
+    zmq_msg_recv (part, from, 0);
+  }
+}
+
+static gboolean
+receive_first_part (void *socket, zmq_msg_t *part)
+{
+  zmq_msg_init (part);
+  if (zmq_msg_recv (part, socket, ZMQ_DONTWAIT) == -1) {
+    zmq_msg_close (part);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+forward_message (void *from, void *to)
+{
+  zmq_msg_t part;
+
+  if (receive_first_part (from, &part))
+    forward_parts (from, to, &part);
+}
+
+/* Enough for the identity of the client, the empty delimiter and the
+ * header, more when the request went through intermediaries.
+ */
+#define MAX_PEEKED_PARTS 8
+
+/* Requests with a routing key all go to the shard the key maps to,
+ * so that they reach the same worker, the others go to the shard
+ * pick_shard() favours. The parts up to the header are read to find
+ * out, the payload is forwarded without being looked at.
+ */
+static gboolean
+route_client_message (GPPQueue *self)
+{
+  zmq_msg_t parts[MAX_PEEKED_PARTS];
+  guint n_parts = 1, index, i;
+  zmq_msg_t *last = &parts[0];
+  GPPHeader header;
+  void *link;
+
+  if (!receive_first_part (self->frontend, &parts[0]))
+    return G_SOURCE_CONTINUE;
+
+  while (zmq_msg_more (last) && n_parts < MAX_PEEKED_PARTS) {
+    gboolean delimiter = zmq_msg_size (last) == 0;
+
+    last = &parts[n_parts++];
+    zmq_msg_init (last);
+    zmq_msg_recv (last, self->frontend, 0);
+    if (delimiter)
+      break;
+  }
+
+  if (n_parts >= 2 && zmq_msg_size (&parts[n_parts - 2]) == 0 &&
+      gpp_header_from_data (zmq_msg_data (last), zmq_msg_size (last),
+          &header) && header.key_hash)
+    index = header.key_hash % self->n_shards;
+  else
+    index = pick_shard (self);
+
+  link = self->shards[index].frontend_link;
+  for (i = 0; i < n_parts - 1; i++)
+    if (zmq_msg_send (&parts[i], link, ZMQ_SNDMORE) == -1)
+      zmq_msg_close (&parts[i]);
+  forward_parts (self->frontend, link, last);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* A worker always talks to the same shard */
+static gboolean
+route_worker_message (GPPQueue *self)
+{
+  zmq_msg_t part;
+  guint index;
+
+  if (!receive_first_part (self->backend, &part))
+    return G_SOURCE_CONTINUE;
+
+  index = gpp_hash_data (zmq_msg_data (&part), zmq_msg_size (&part))
+      % self->n_shards;
+  forward_parts (self->backend, self->shards[index].backend_link, &part);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+route_shard_reply (Shard *shard)
+{
+  forward_message (shard->frontend_link, shard->queue->owner->frontend);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+route_shard_worker_message (Shard *shard)
+{
+  forward_message (shard->backend_link, shard->queue->owner->backend);
+  return G_SOURCE_CONTINUE;
+}
+
+static gpointer
+shard_thread (Shard *shard)
+{
+  GMainContext *context = shard->queue->context;
+
+  g_main_context_push_thread_default (context);
+  while (!g_atomic_int_get (&shard->stopping))
+    g_main_context_iteration (context, TRUE);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static guint64
+split_limit (guint64 limit, guint n_shards)
+{
+  return limit ? (limit + n_shards - 1) / n_shards : 0;
+}
+
+/* Initialization */
+
+/* Whether @endpoint can be bound by each shard, in which case the
+ * kernel spreads the connections over them, see bind_shared().
+ */
+static gboolean
+parse_shared_endpoint (const gchar *endpoint, gchar **host, gchar **port)
+{
+#if defined(SO_REUSEPORT) && defined(ZMQ_USE_FD)
+  const gchar *address, *colon;
+  gint64 number;
+
+  if (!g_str_has_prefix (endpoint, "tcp://"))
+    return FALSE;
+
+  address = endpoint + strlen ("tcp://");
+  colon = strrchr (address, ':');
+  /* Ports picked by the system would differ between shards */
+  if (!colon || colon == address || !g_ascii_isdigit (colon[1]))
+    return FALSE;
+  number = g_ascii_strtoll (colon + 1, NULL, 10);
+  if (number <= 0 || number > G_MAXUINT16)
+    return FALSE;
+
+  if (host && address[0] == '[' && colon[-1] == ']')
+    *host = g_strndup (address + 1, colon - address - 2);
+  else if (host)
+    *host = g_strndup (address, colon - address);
+  if (port)
+    *port = g_strdup (colon + 1);
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* Binds @zsock through a listening socket of our own, with
+ * SO_REUSEPORT, which zmq then accepts connections from. Returns -1
+ * on failure, like zsocket_bind().
+ */
+static gint
+bind_shared (void *zsock, const gchar *endpoint)
+{
+#if defined(SO_REUSEPORT) && defined(ZMQ_USE_FD)
+  struct addrinfo hints, *info;
+  gchar *host, *port;
+  gint fd = -1, on = 1, rc;
+
+  if (!parse_shared_endpoint (endpoint, &host, &port))
+    return -1;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  /* Like zmq, the wildcard address only stands for IPv4 addresses */
+  hints.ai_family = g_str_equal (host, "*") ? AF_INET : AF_UNSPEC;
+  rc = getaddrinfo (g_str_equal (host, "*") ? NULL : host, port, &hints,
+      &info);
+  g_free (host);
+  g_free (port);
+  if (rc != 0)
+    return -1;
+
+  fd = socket (info->ai_family, info->ai_socktype, info->ai_protocol);
+  if (fd != -1 &&
+      (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) == -1 ||
+       setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) == -1 ||
+       bind (fd, info->ai_addr, info->ai_addrlen) == -1 ||
+       listen (fd, SOMAXCONN) == -1 ||
+       zmq_setsockopt (zsock, ZMQ_USE_FD, &fd, sizeof (fd)) == -1)) {
+    close (fd);
+    fd = -1;
+  }
+  freeaddrinfo (info);
+
+  if (fd == -1)
+    return -1;
+
+  return zsocket_bind (zsock, "%s", endpoint);
+#else
+  return -1;
+#endif
+}
+
+static void *
+create_router (GPPQueue *self, const gchar *endpoint, gboolean shared)
+{
+  void *router = zsocket_new (self->ctx, ZMQ_ROUTER);
+  gint rc;
+
+  gpp_context_configure_socket (self->gpp_context, router);
+  if (shared)
+    rc = bind_shared (router, endpoint);
+  else
+    rc = zsocket_bind (router, "%s", endpoint);
+  if (rc == -1)
+    g_warning ("Could not bind to %s", endpoint);
+
+  return router;
+}
+
+static void
+create_channels (GPPQueue *self)
+{
+  self->ctx = gpp_context_new_zctx (self->gpp_context);
+  self->frontend = create_router (self, self->frontend_endpoint, FALSE);
+  /* Clients keep their identity when they reconnect */
+  zsocket_set_router_handover (self->frontend, 1);
+  self->backend = create_router (self, self->backend_endpoint, FALSE);
+}
+
+/* Shards bind the tcp:// endpoints themselves, and talk to the queue
+ * that owns them through a pair of sockets for the others, messages
+ * look the same as on the real sockets.
+ */
+static void
+create_shard_channels (GPPQueue *self, GPPQueue *owner, guint index)
+{
+  self->ctx = zctx_shadow (owner->ctx);
+
+  if (owner->frontend) {
+    self->frontend = zsocket_new (self->ctx, ZMQ_PAIR);
+    zsocket_connect (self->frontend, "inproc://gpp-queue-%p-frontend-%u",
+        owner, index);
+  } else {
+    self->frontend = create_router (self, owner->frontend_endpoint, TRUE);
+    zsocket_set_router_handover (self->frontend, 1);
+    self->shared_frontend = TRUE;
+  }
+
+  if (owner->backend) {
+    self->backend = zsocket_new (self->ctx, ZMQ_PAIR);
+    zsocket_connect (self->backend, "inproc://gpp-queue-%p-backend-%u",
+        owner, index);
+  } else {
+    self->backend = create_router (self, owner->backend_endpoint, TRUE);
+  }
+
+  self->handoff = zsocket_new (self->ctx, ZMQ_PULL);
+  zsocket_bind (self->handoff, "inproc://gpp-queue-%p-handoff-%u",
+      owner, index);
+}
+
+/* Requests left unanswered by a previous run, their clients are still
+ * waiting for them as long as their timeout didn't run out.
+ */
+static void
+replay_request (zmsg_t *msg, gint64 accepted_at, GPPQueue *self)
+{
+  zframe_t *header_frame = gpp_msg_find_header (msg);
+  gint64 elapsed = MAX (0, g_get_real_time () - accepted_at) / 1000;
+  zframe_t *first = zmsg_first (msg);
+  GPPHeader header;
+
+  /* Its client may now be connected to any shard. The request is
+   * journaled again with the marker, under another key.
+   */
+  if (self->shared_frontend && !is_broadcast_marker (first)) {
+    gpp_journal_complete (self->journal, msg);
+    if (is_origin_marker (first, NULL)) {
+      zmsg_remove (msg, first);
+      zframe_destroy (&first);
+    }
+    zmsg_pushmem (msg, BROADCAST_MARKER, BROADCAST_MARKER_SIZE);
+  }
+
+  if (gpp_header_from_frame (header_frame, &header) && header.timeout) {
+    if (elapsed >= header.timeout) {
+      reject_request (self, msg, GPP_STATUS_TIMEOUT);
+      return;
+    }
+    gpp_header_frame_set_timeout (header_frame, header.timeout - elapsed);
+  }
+
+  handle_request (self, msg, FALSE);
+}
+
+static void
+open_journal (GPPQueue *self)
+{
+  GError *error = NULL;
+  guint n_replayed;
+
+  if (!self->journal_path)
+    return;
+
+  self->journal = gpp_journal_open (self->journal_path, &error);
+  if (!self->journal) {
+    g_warning ("Running without a journal: %s", error->message);
+    g_error_free (error);
+    return;
+  }
+
+  n_replayed = gpp_journal_replay (self->journal,
+      (GPPJournalFunc) replay_request, self);
+  if (n_replayed)
+    g_info ("dispatching %u requests found in %s again", n_replayed,
+        self->journal_path);
+}
+
+static gboolean
+commit_journal (GPPQueue *self)
+{
+  gpp_journal_commit (self->journal);
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+attach_sources (GPPQueue *self)
+{
+  GSource *source;
+
+  self->backend_source = add_watch (self, self->backend,
+      (GPPZmqSourceFunc) handle_backend, self);
+  self->frontend_source = add_watch (self, self->frontend,
+      (GPPZmqSourceFunc) handle_frontend, self);
+  if (self->handoff)
+    self->handoff_source = add_watch (self, self->handoff,
+        (GPPZmqSourceFunc) handle_handoff, self);
+
+  source = g_timeout_source_new (HEARTBEAT_INTERVAL / 10000);
+  g_source_set_callback (source, (GSourceFunc) do_heartbeat, self, NULL);
+  self->timers_source = g_source_attach (source, self->context);
+  g_source_unref (source);
+
+  /* Group commit, one flush for everything journaled in the meantime */
+  if (self->journal) {
+    source = g_timeout_source_new (self->journal_commit_interval);
+    g_source_set_callback (source, (GSourceFunc) commit_journal, self, NULL);
+    self->journal_source = g_source_attach (source, self->context);
+    g_source_unref (source);
+  }
+}
+
+static void
+start_shards (GPPQueue *self)
+{
+  guint i, j;
+
+  /* We only move the messages of the endpoints shards can't bind */
+  self->ctx = gpp_context_new_zctx (self->gpp_context);
+  if (!parse_shared_endpoint (self->frontend_endpoint, NULL, NULL)) {
+    self->frontend = create_router (self, self->frontend_endpoint, FALSE);
+    zsocket_set_router_handover (self->frontend, 1);
+  }
+  if (!parse_shared_endpoint (self->backend_endpoint, NULL, NULL))
+    self->backend = create_router (self, self->backend_endpoint, FALSE);
+  self->shards = g_new0 (Shard, self->n_shards);
+
+  /* Bind everything before anything connects */
+  for (i = 0; i < self->n_shards; i++) {
+    Shard *shard = &self->shards[i];
+
+    if (self->frontend) {
+      shard->frontend_link = zsocket_new (self->ctx, ZMQ_PAIR);
+      zsocket_bind (shard->frontend_link,
+          "inproc://gpp-queue-%p-frontend-%u", self, i);
+    }
+    if (self->backend) {
+      shard->backend_link = zsocket_new (self->ctx, ZMQ_PAIR);
+      zsocket_bind (shard->backend_link, "inproc://gpp-queue-%p-backend-%u",
+          self, i);
+    }
+
+    shard->queue = g_object_new (GPP_TYPE_QUEUE,
+        "context", self->gpp_context,
+        "max-pending-requests",
+        (guint) split_limit (self->max_pending_requests, self->n_shards),
+        "max-pending-bytes",
+        split_limit (self->max_pending_bytes, self->n_shards),
+        "priority-aging", self->priority_aging,
+        "dispatch-budget", self->dispatch_budget,
+        "selection-policy", self->selection_policy,
+        "affinity-load-factor", self->affinity_load_factor,
+        "coalesce-requests", self->coalesce_requests,
+        "reply-cache-ttl", self->reply_cache_ttl,
+        "max-reply-cache-bytes",
+        split_limit (self->max_reply_cache_bytes, self->n_shards),
+        "journal-commit-interval", self->journal_commit_interval,
+        NULL);
+    if (self->journal_path)
+      shard->queue->journal_path = g_strdup_printf ("%s.%u",
+          self->journal_path, i);
+    shard->queue->owner = self;
+    shard->queue->shard_index = i;
+    create_shard_channels (shard->queue, self, i);
+  }
+
+  for (i = 0; i < self->n_shards; i++) {
+    GPPQueue *queue = self->shards[i].queue;
+
+    queue->handoffs = g_new0 (void *, self->n_shards);
+    for (j = 0; j < self->n_shards; j++) {
+      if (j == i)
+        continue;
+      queue->handoffs[j] = zsocket_new (queue->ctx, ZMQ_PUSH);
+      zsocket_connect (queue->handoffs[j], "inproc://gpp-queue-%p-handoff-%u",
+          self, j);
+    }
+  }
+
+  /* The sockets of each shard are only used from its thread from now on */
+  for (i = 0; i < self->n_shards; i++) {
+    Shard *shard = &self->shards[i];
+
+    shard->queue->context = g_main_context_new ();
+    open_journal (shard->queue);
+    attach_sources (shard->queue);
+    shard->thread = g_thread_new ("gpp-queue-shard",
+        (GThreadFunc) shard_thread, shard);
+
+    if (shard->frontend_link)
+      shard->frontend_source = add_watch (self, shard->frontend_link,
+          (GPPZmqSourceFunc) route_shard_reply, shard);
+    if (shard->backend_link)
+      shard->backend_source = add_watch (self, shard->backend_link,
+          (GPPZmqSourceFunc) route_shard_worker_message, shard);
+  }
+
+  if (self->frontend)
+    self->frontend_source = add_watch (self, self->frontend,
+        (GPPZmqSourceFunc) route_client_message, self);
+  if (self->backend)
+    self->backend_source = add_watch (self, self->backend,
+        (GPPZmqSourceFunc) route_worker_message, self);
+}
+
+static void
+stop_shards (GPPQueue *self)
+{
+  guint i;
+
+  for (i = 0; i < self->n_shards; i++) {
+    Shard *shard = &self->shards[i];
+
+    g_atomic_int_set (&shard->stopping, TRUE);
+    g_main_context_wakeup (shard->queue->context);
+    g_thread_join (shard->thread);
+
+    remove_source (self, &shard->frontend_source);
+    remove_source (self, &shard->backend_source);
+    g_object_unref (shard->queue);
+  }
+
+  g_clear_pointer (&self->shards, g_free);
+}
+
+/* GObject */
+
+static void
+gpp_queue_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GPPQueue *self = GPP_QUEUE (object);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      self->gpp_context = g_value_dup_object (value);
+      if (!self->gpp_context)
+        self->gpp_context = g_object_ref (gpp_context_get_default ());
+      break;
+    case PROP_FRONTEND_ENDPOINT:
+      g_free (self->frontend_endpoint);
+      self->frontend_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_BACKEND_ENDPOINT:
+      g_free (self->backend_endpoint);
+      self->backend_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_MAX_PENDING_REQUESTS:
+      self->max_pending_requests = g_value_get_uint (value);
+      break;
+    case PROP_MAX_PENDING_BYTES:
+      self->max_pending_bytes = g_value_get_uint64 (value);
+      break;
+    case PROP_PRIORITY_AGING:
+      self->priority_aging = g_value_get_uint (value);
+      break;
+    case PROP_N_SHARDS:
+      self->n_shards = g_value_get_uint (value);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      self->dispatch_budget = g_value_get_uint (value);
+      break;
+    case PROP_SELECTION_POLICY:
+      self->selection_policy = g_value_get_enum (value);
+      break;
+    case PROP_AFFINITY_LOAD_FACTOR:
+      self->affinity_load_factor = g_value_get_double (value);
+      break;
+    case PROP_COALESCE_REQUESTS:
+      self->coalesce_requests = g_value_get_boolean (value);
+      break;
+    case PROP_REPLY_CACHE_TTL:
+      self->reply_cache_ttl = g_value_get_uint (value);
+      break;
+    case PROP_MAX_REPLY_CACHE_BYTES:
+      self->max_reply_cache_bytes = g_value_get_uint64 (value);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_free (self->stats_endpoint);
+      self->stats_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_FEDERATION_ENDPOINT:
+      g_free (self->federation_endpoint);
+      self->federation_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_FEDERATION_ADDRESS:
+      g_free (self->federation_address);
+      self->federation_address = g_value_dup_string (value);
+      break;
+    case PROP_PEER_ENDPOINTS:
+      g_strfreev (self->peer_endpoints);
+      self->peer_endpoints = g_value_dup_boxed (value);
+      break;
+    case PROP_JOURNAL_PATH:
+      g_free (self->journal_path);
+      self->journal_path = g_value_dup_string (value);
+      break;
+    case PROP_JOURNAL_COMMIT_INTERVAL:
+      self->journal_commit_interval = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gpp_queue_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GPPQueue *self = GPP_QUEUE (object);
+  Snapshot *snapshot = NULL;
+
+  if (prop_id >= PROP_PENDING_REQUESTS)
+    snapshot = take_snapshot (self);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      g_value_set_object (value, self->gpp_context);
+      break;
+    case PROP_FRONTEND_ENDPOINT:
+      g_value_set_string (value, self->frontend_endpoint);
+      break;
+    case PROP_BACKEND_ENDPOINT:
+      g_value_set_string (value, self->backend_endpoint);
+      break;
+    case PROP_MAX_PENDING_REQUESTS:
+      g_value_set_uint (value, self->max_pending_requests);
+      break;
+    case PROP_MAX_PENDING_BYTES:
+      g_value_set_uint64 (value, self->max_pending_bytes);
+      break;
+    case PROP_PRIORITY_AGING:
+      g_value_set_uint (value, self->priority_aging);
+      break;
+    case PROP_N_SHARDS:
+      g_value_set_uint (value, self->n_shards);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      g_value_set_uint (value, self->dispatch_budget);
+      break;
+    case PROP_SELECTION_POLICY:
+      g_value_set_enum (value, self->selection_policy);
+      break;
+    case PROP_AFFINITY_LOAD_FACTOR:
+      g_value_set_double (value, self->affinity_load_factor);
+      break;
+    case PROP_COALESCE_REQUESTS:
+      g_value_set_boolean (value, self->coalesce_requests);
+      break;
+    case PROP_REPLY_CACHE_TTL:
+      g_value_set_uint (value, self->reply_cache_ttl);
+      break;
+    case PROP_MAX_REPLY_CACHE_BYTES:
+      g_value_set_uint64 (value, self->max_reply_cache_bytes);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_value_set_string (value, self->stats_endpoint);
+      break;
+    case PROP_FEDERATION_ENDPOINT:
+      g_value_set_string (value, self->federation_endpoint);
+      break;
+    case PROP_FEDERATION_ADDRESS:
+      g_value_set_string (value, self->federation_address);
+      break;
+    case PROP_PEER_ENDPOINTS:
+      g_value_set_boxed (value, self->peer_endpoints);
+      break;
+    case PROP_JOURNAL_PATH:
+      g_value_set_string (value, self->journal_path);
+      break;
+    case PROP_JOURNAL_COMMIT_INTERVAL:
+      g_value_set_uint (value, self->journal_commit_interval);
+      break;
+    case PROP_PENDING_REQUESTS:
+      g_value_set_uint (value, snapshot->n_pending);
+      break;
+    case PROP_AVAILABLE_WORKERS:
+      g_value_set_uint (value, snapshot->n_available);
+      break;
+    case PROP_N_WORKERS:
+      g_value_set_uint (value, snapshot->n_workers);
+      break;
+    case PROP_DISPATCHED_REQUESTS:
+      g_value_set_uint64 (value, snapshot->metrics.n_dispatched);
+      break;
+    case PROP_DISPATCH_RATE:
+      g_value_set_double (value, snapshot->dispatch_rate);
+      break;
+    case PROP_KO_REPLIES:
+      g_value_set_uint64 (value, snapshot->metrics.n_ko);
+      break;
+    case PROP_PURGED_WORKERS:
+      g_value_set_uint64 (value, snapshot->metrics.n_purged_workers);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+
+  g_free (snapshot);
+}
+
+static void
+constructed (GObject *object)
+{
+  GPPQueue *self = GPP_QUEUE (object);
+
+  if (self->coalesce_requests)
+    self->flights = g_hash_table_new (g_bytes_hash, g_bytes_equal);
+  if (self->reply_cache_ttl)
+    self->reply_cache = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+        NULL, (GDestroyNotify) cached_reply_free);
+
+  G_OBJECT_CLASS (gpp_queue_parent_class)->constructed (object);
+}
+
+static void
+dispose (GObject *object)
+{
+  GPPQueue *self = GPP_QUEUE (object);
+  guint i;
+
+  g_clear_pointer (&self->stats_server, gpp_stats_server_free);
+
+  if (self->context)
+    stop_federation (self);
+
+  /* Shards use our context, they have to go first */
+  if (self->shards)
+    stop_shards (self);
+
+  for (i = 0; i < GPP_N_PRIORITIES; i++)
+    g_queue_clear_full (&self->pending[i],
+        (GDestroyNotify) pending_request_free);
+  self->n_pending = 0;
+  self->pending_bytes = 0;
+  self->n_pending_deadlines = 0;
+
+  if (self->context) {
+    remove_source (self, &self->frontend_source);
+    remove_source (self, &self->backend_source);
+    remove_source (self, &self->handoff_source);
+    remove_source (self, &self->timers_source);
+    remove_source (self, &self->journal_source);
+    g_clear_pointer (&self->context, g_main_context_unref);
+  }
+
+  /* What is still pending stays in it, for the next run */
+  g_clear_pointer (&self->journal, gpp_journal_free);
+
+  g_clear_pointer (&self->handoffs, g_free);
+
+  if (self->workerz) {
+    GHashTableIter iter;
+    Worker *worker;
+
+    g_hash_table_iter_init (&iter, self->workerz);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &worker))
+      gpp_timer_wheel_cancel (self->timers, &worker->timer);
+  }
+
+  g_clear_pointer (&self->workerz, g_hash_table_unref);
+  g_clear_pointer (&self->ring, g_array_unref);
+  g_clear_pointer (&self->flights, g_hash_table_unref);
+  g_clear_pointer (&self->reply_cache, g_hash_table_unref);
+  g_queue_init (&self->cached_replies);
+  self->reply_cache_bytes = 0;
+  g_clear_pointer (&self->timers, gpp_timer_wheel_free);
+  while (!g_queue_is_empty (&self->worker_pool))
+    worker_free (g_queue_pop_head_link (&self->worker_pool)->data);
+  zctx_destroy (&self->ctx);
+  g_clear_object (&self->gpp_context);
+}
+
+static void
+finalize (GObject *object)
+{
+  GPPQueue *self = GPP_QUEUE (object);
+
+  g_free (self->frontend_endpoint);
+  g_free (self->backend_endpoint);
+  g_free (self->stats_endpoint);
+  g_free (self->federation_endpoint);
+  g_free (self->federation_address);
+  g_strfreev (self->peer_endpoints);
+  g_free (self->journal_path);
+  g_rand_free (self->rand);
+  g_mutex_clear (&self->published_lock);
+
+  G_OBJECT_CLASS (gpp_queue_parent_class)->finalize (object);
+}
+
+static void
+gpp_queue_class_init (GPPQueueClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->constructed = constructed;
+  gobject_class->dispose = dispose;
+  gobject_class->set_property = gpp_queue_set_property;
+  gobject_class->get_property = gpp_queue_get_property;
+  gobject_class->finalize = finalize;
+
+  /**
+   * GPPQueue:context:
+   *
+   * The #GPPContext the queue creates its sockets in, the default
+   * context if %NULL. Shards all share it.
+   */
+  properties[PROP_CONTEXT] =
+      g_param_spec_object ("context", "Context",
+      "The context sockets are created in", GPP_TYPE_CONTEXT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:frontend-endpoint:
+   *
+   * The endpoint clients connect to. Use an inproc:// endpoint when
+   * they run in the same process as the queue, or an ipc:// one when
+   * they run on the same host.
+   */
+  properties[PROP_FRONTEND_ENDPOINT] =
+      g_param_spec_string ("frontend-endpoint", "Frontend endpoint",
+      "Endpoint clients connect to", DEFAULT_FRONTEND_ENDPOINT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:backend-endpoint:
+   *
+   * The endpoint workers connect to, see #GPPQueue:frontend-endpoint.
+   */
+  properties[PROP_BACKEND_ENDPOINT] =
+      g_param_spec_string ("backend-endpoint", "Backend endpoint",
+      "Endpoint workers connect to", DEFAULT_BACKEND_ENDPOINT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:max-pending-requests:
+   *
+   * The maximum number of requests waiting for a worker, further
+   * requests are rejected right away. 0 means unlimited.
+   */
+  properties[PROP_MAX_PENDING_REQUESTS] =
+      g_param_spec_uint ("max-pending-requests", "Maximum pending requests",
+      "Maximum number of requests waiting for a worker", 0, G_MAXUINT,
+      DEFAULT_MAX_PENDING_REQUESTS,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:max-pending-bytes:
+   *
+   * The maximum size of the requests waiting for a worker, further
+   * requests are rejected right away. 0 means unlimited.
+   */
+  properties[PROP_MAX_PENDING_BYTES] =
+      g_param_spec_uint64 ("max-pending-bytes", "Maximum pending bytes",
+      "Maximum size of the requests waiting for a worker", 0, G_MAXUINT64,
+      DEFAULT_MAX_PENDING_BYTES,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:priority-aging:
+   *
+   * How long, in milliseconds, a waiting request has to wait before
+   * being handled as if it had one priority higher. 0 means requests
+   * are always handled by strict order of priority.
+   */
+  properties[PROP_PRIORITY_AGING] =
+      g_param_spec_uint ("priority-aging", "Priority aging",
+      "Milliseconds a request waits before climbing one priority", 0,
+      G_MAXUINT, DEFAULT_PRIORITY_AGING,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:n-shards:
+   *
+   * The number of threads routing requests, each of them handles the
+   * clients and workers connected to it. Only taken into account when
+   * the queue is started.
+   */
+  properties[PROP_N_SHARDS] =
+      g_param_spec_uint ("n-shards", "Number of shards",
+      "Number of threads routing requests", 1, G_MAXUINT16,
+      DEFAULT_N_SHARDS,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:dispatch-budget:
+   *
+   * The maximum number of messages read from one socket before the
+   * main loop gets to run other sources, 0 means the socket is
+   * drained every time. Only taken into account when the queue is
+   * started.
+   */
+  properties[PROP_DISPATCH_BUDGET] =
+      g_param_spec_uint ("dispatch-budget", "Dispatch budget",
+      "Maximum number of messages read from a socket in a row", 0,
+      G_MAXUINT, DEFAULT_DISPATCH_BUDGET,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:selection-policy:
+   *
+   * How the queue picks the worker it hands a request to, among the
+   * ones that can take one more. Least-recently-used spreads requests
+   * evenly, the other policies send fewer of them to workers that are
+   * slower or busier than the others.
+   */
+  properties[PROP_SELECTION_POLICY] =
+      g_param_spec_enum ("selection-policy", "Selection policy",
+      "How workers are picked", GPP_TYPE_SELECTION_POLICY,
+      DEFAULT_SELECTION_POLICY,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:affinity-load-factor:
+   *
+   * How many times the average number of tasks per worker the worker
+   * a routing key maps to may be handling before requests for that
+   * key go to the next worker on the ring. The lower, the more evenly
+   * the load is spread, and the more keys move between workers.
+   */
+  properties[PROP_AFFINITY_LOAD_FACTOR] =
+      g_param_spec_double ("affinity-load-factor", "Affinity load factor",
+      "Maximum load of a worker relative to the average, for keyed "
+      "requests", 1, G_MAXDOUBLE, DEFAULT_AFFINITY_LOAD_FACTOR,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:coalesce-requests:
+   *
+   * Whether requests identical to one a worker is handling wait for
+   * its reply instead of being handed to another worker. If the worker
+   * fails, they all fail and their clients retry them.
+   */
+  properties[PROP_COALESCE_REQUESTS] =
+      g_param_spec_boolean ("coalesce-requests", "Coalesce requests",
+      "Whether identical requests share the same worker", FALSE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:reply-cache-ttl:
+   *
+   * How long, in milliseconds, the queue answers requests with the
+   * successful reply a worker made to an identical request. 0 means
+   * replies aren't cached.
+   */
+  properties[PROP_REPLY_CACHE_TTL] =
+      g_param_spec_uint ("reply-cache-ttl", "Reply cache TTL",
+      "Milliseconds replies are reused for, 0 to disable", 0, G_MAXUINT,
+      DEFAULT_REPLY_CACHE_TTL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:max-reply-cache-bytes:
+   *
+   * The maximum size of the cached requests and replies, the oldest
+   * are dropped past it. 0 means unlimited.
+   */
+  properties[PROP_MAX_REPLY_CACHE_BYTES] =
+      g_param_spec_uint64 ("max-reply-cache-bytes", "Maximum reply cache bytes",
+      "Maximum size of the reply cache", 0, G_MAXUINT64,
+      DEFAULT_MAX_REPLY_CACHE_BYTES,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:stats-endpoint:
+   *
+   * If set, the queue binds a REP socket to this endpoint when started,
+   * and answers any message sent to it with the snapshot returned by
+   * gpp_queue_get_stats(), in the #GVariant text format. This is meant
+   * for a local endpoint, such as ipc:///tmp/gpp-queue-stats.
+   */
+  properties[PROP_STATS_ENDPOINT] =
+      g_param_spec_string ("stats-endpoint", "Stats endpoint",
+      "Endpoint serving statistics snapshots", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:federation-endpoint:
+   *
+   * If set along with #GPPQueue:federation-address, the queue binds a
+   * PUB socket to this endpoint when started, on which it advertises
+   * its number of idle workers to its peers.
+   */
+  properties[PROP_FEDERATION_ENDPOINT] =
+      g_param_spec_string ("federation-endpoint", "Federation endpoint",
+      "Endpoint the queue advertises its capacity on", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:federation-address:
+   *
+   * The endpoint at which peers reach #GPPQueue:frontend-endpoint, such
+   * as tcp://host:5555, advertised along with the capacity of the queue.
+   */
+  properties[PROP_FEDERATION_ADDRESS] =
+      g_param_spec_string ("federation-address", "Federation address",
+      "Frontend endpoint advertised to peers", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:peer-endpoints:
+   *
+   * The #GPPQueue:federation-endpoint of the peers of the queue. Once
+   * started, the queue forwards the requests it would have to keep
+   * waiting to the peer with the most idle workers, and routes the
+   * replies back to the clients. The requests forwarded to a peer
+   * that stops advertising its capacity fail.
+   */
+  properties[PROP_PEER_ENDPOINTS] =
+      g_param_spec_boxed ("peer-endpoints", "Peer endpoints",
+      "Federation endpoints of the peers", G_TYPE_STRV,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:journal-path:
+   *
+   * If set, the queue records the requests it accepts and the ones it
+   * answers in this file, and when started dispatches again the
+   * requests a previous run left unanswered, with what is left of
+   * their timeout. Each shard of the queue has its own file, named
+   * after this one followed by its index.
+   *
+   * Requests handed to a worker when the queue stopped are dispatched
+   * again, so they may be handled twice.
+   */
+  properties[PROP_JOURNAL_PATH] =
+      g_param_spec_string ("journal-path", "Journal path",
+      "File recording the requests not answered yet", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:journal-commit-interval:
+   *
+   * How often, in milliseconds, what was written to
+   * #GPPQueue:journal-path is flushed to disk. All the requests
+   * accepted or answered in the meantime are flushed at once, those
+   * of the last interval may be lost if the host crashes.
+   */
+  properties[PROP_JOURNAL_COMMIT_INTERVAL] =
+      g_param_spec_uint ("journal-commit-interval", "Journal commit interval",
+      "Interval between flushes of the journal, in milliseconds", 1,
+      G_MAXUINT, DEFAULT_JOURNAL_COMMIT_INTERVAL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:pending-requests:
+   *
+   * The number of requests currently waiting for a worker.
+   */
+  properties[PROP_PENDING_REQUESTS] =
+      g_param_spec_uint ("pending-requests", "Pending requests",
+      "Number of requests waiting for a worker", 0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:available-workers:
+   *
+   * The number of workers that can take one more request right now.
+   */
+  properties[PROP_AVAILABLE_WORKERS] =
+      g_param_spec_uint ("available-workers", "Available workers",
+      "Number of workers able to take a request", 0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:n-workers:
+   *
+   * The number of workers known to be alive.
+   */
+  properties[PROP_N_WORKERS] =
+      g_param_spec_uint ("n-workers", "Number of workers",
+      "Number of live workers", 0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:dispatched-requests:
+   *
+   * The number of requests handed to workers since the queue started.
+   */
+  properties[PROP_DISPATCHED_REQUESTS] =
+      g_param_spec_uint64 ("dispatched-requests", "Dispatched requests",
+      "Number of requests handed to workers", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:dispatch-rate:
+   *
+   * The number of requests handed to workers per second, updated
+   * every second.
+   */
+  properties[PROP_DISPATCH_RATE] =
+      g_param_spec_double ("dispatch-rate", "Dispatch rate",
+      "Requests handed to workers per second", 0, G_MAXDOUBLE, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:ko-replies:
+   *
+   * The number of KO replies sent to clients, either because a worker
+   * failed a request or because it was purged while handling it.
+   */
+  properties[PROP_KO_REPLIES] =
+      g_param_spec_uint64 ("ko-replies", "KO replies",
+      "Number of KO replies sent to clients", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPQueue:purged-workers:
+   *
+   * The number of workers purged for missing their heartbeats.
+   */
+  properties[PROP_PURGED_WORKERS] =
+      g_param_spec_uint64 ("purged-workers", "Purged workers",
+      "Number of workers purged for missing heartbeats", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPERTIES, properties);
+}
+
+static void
+gpp_queue_init (GPPQueue *self)
+{
+  guint i;
+
+  self->workerz = g_hash_table_new_full ((GHashFunc) identity_hash,
+      (GEqualFunc) identity_equal, NULL, (GDestroyNotify) worker_destroy);
+  g_queue_init (&self->worker_pool);
+  g_queue_init (&self->available_workerz);
+  for (i = 0; i < GPP_N_PRIORITIES; i++)
+    g_queue_init (&self->pending[i]);
+  self->timers = gpp_timer_wheel_new (HEARTBEAT_INTERVAL / 10,
+      (GPPTimerFunc) worker_timer_cb, self);
+  self->rand = g_rand_new ();
+  self->ring = g_array_new (FALSE, FALSE, sizeof (RingPoint));
+  g_mutex_init (&self->published_lock);
+}
+
+/* API */
+
+/**
+ * gpp_queue_new:
+ *
+ * Create a new #GPPQueue, which doesn't yet listen to #GPPWorker (s).
+ * Start it with gpp_queue_start()
+ *
+ * Returns: the newly-created #GPPQueue.
+ */
+GPPQueue *
+gpp_queue_new (void)
+{
+  return g_object_new (GPP_TYPE_QUEUE, NULL);
+}
+
+/**
+ * gpp_queue_start:
+ * @self: A #GPPQueue to start.
+ *
+ * Makes @self start to route requests to available workers,
+ * and check worker's liveness.
+ *
+ * Returns: %TRUE if the queue was started, %FALSE if it was already.
+ */
+gboolean
+gpp_queue_start (GPPQueue *self)
+{
+  if (self->context)
+    return FALSE;
+
+  self->context = g_main_context_ref_thread_default ();
+  self->rate_time = g_get_monotonic_time ();
+
+  if (self->n_shards > 1)
+    start_shards (self);
+  else {
+    create_channels (self);
+    open_journal (self);
+    attach_sources (self);
+  }
+
+  if (self->n_shards > 1 &&
+      (self->peer_endpoints || self->federation_endpoint))
+    g_warning ("Queues with several shards can't be federated");
+  else
+    start_federation (self);
+
+  if (self->stats_endpoint)
+    self->stats_server = gpp_stats_server_new (self->ctx,
+        self->stats_endpoint, (GPPStatsFunc) gpp_queue_get_stats, self,
+        self->context);
+
+  return TRUE;
+}
+
+/**
+ * gpp_queue_get_priority_stats:
+ * @self: A #GPPQueue
+ * @priority: The priority to report on, from 0 to 3
+ * @depth: (out) (allow-none): The number of requests of @priority
+ *  currently waiting for a worker
+ * @mean_wait: (out) (allow-none): The mean time, in microseconds,
+ *  the requests of @priority handed to workers so far waited for one
+ * @max_wait: (out) (allow-none): The longest time, in microseconds,
+ *  one of these requests waited for a worker
+ *
+ * Reports how the requests of @priority are faring. When the queue
+ * has several shards, the figures are the ones the shards published
+ * on their last heartbeat, a tenth of a second ago at most.
+ */
+void
+gpp_queue_get_priority_stats (GPPQueue *self, guint priority, guint *depth,
+    gint64 *mean_wait, gint64 *max_wait)
+{
+  Snapshot *snapshot;
+  PriorityStats *stats;
+
+  g_return_if_fail (priority < GPP_N_PRIORITIES);
+
+  snapshot = take_snapshot (self);
+  stats = &snapshot->priorities[priority];
+
+  if (depth)
+    *depth = snapshot->depths[priority];
+  if (mean_wait)
+    *mean_wait = stats->n_handled ? stats->total_wait / stats->n_handled : 0;
+  if (max_wait)
+    *max_wait = stats->max_wait;
+
+  g_free (snapshot);
+}
+
+static void
+add_priority_stats (Snapshot *snapshot, GVariantBuilder *builder)
+{
+  GVariantBuilder priorities;
+  guint i;
+
+  g_variant_builder_init (&priorities, G_VARIANT_TYPE ("aa{sv}"));
+
+  for (i = 0; i < GPP_N_PRIORITIES; i++) {
+    PriorityStats *stats = &snapshot->priorities[i];
+
+    g_variant_builder_open (&priorities, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&priorities, "{sv}", "depth",
+        g_variant_new_uint32 (snapshot->depths[i]));
+    g_variant_builder_add (&priorities, "{sv}", "mean-wait",
+        g_variant_new_int64 (stats->n_handled ?
+            stats->total_wait / stats->n_handled : 0));
+    g_variant_builder_add (&priorities, "{sv}", "max-wait",
+        g_variant_new_int64 (stats->max_wait));
+    g_variant_builder_close (&priorities);
+  }
+
+  g_variant_builder_add (builder, "{sv}", "priorities",
+      g_variant_builder_end (&priorities));
+}
+
+static void
+add_worker_stats (GPPQueue *self, GVariantBuilder *builder)
+{
+  GVariantBuilder workers;
+  GHashTableIter iter;
+  Worker *worker;
+
+  g_variant_builder_init (&workers, G_VARIANT_TYPE ("a{sv}"));
+  g_hash_table_iter_init (&iter, self->workerz);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &worker))
+    g_variant_builder_add (&workers, "{sv}", worker->id_string,
+        gpp_histogram_to_variant (&worker->service_time));
+
+  g_variant_builder_add (builder, "{sv}", "workers",
+      g_variant_builder_end (&workers));
+}
+
+/**
+ * gpp_queue_get_stats:
+ * @self: A #GPPQueue
+ *
+ * Takes a snapshot of the statistics of @self, as a dictionary
+ * mapping names to values. It holds the request counters, the
+ * current load, the histograms of the time requests waited for a
+ * worker ("wait-time") and spent in workers ("service-time"), the
+ * figures of gpp_queue_get_priority_stats() for each priority and,
+ * unless the queue has several shards, the service-time histogram
+ * of each worker. Times are in microseconds.
+ *
+ * Returns: (transfer full): A #GVariant of type a{sv}
+ */
+GVariant *
+gpp_queue_get_stats (GPPQueue *self)
+{
+  GVariantBuilder builder;
+  Snapshot *snapshot = take_snapshot (self);
+  Metrics *metrics = &snapshot->metrics;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "requests",
+      g_variant_new_uint64 (metrics->n_requests));
+  g_variant_builder_add (&builder, "{sv}", "dispatched-requests",
+      g_variant_new_uint64 (metrics->n_dispatched));
+  g_variant_builder_add (&builder, "{sv}", "replies",
+      g_variant_new_uint64 (metrics->n_replies));
+  g_variant_builder_add (&builder, "{sv}", "ko-replies",
+      g_variant_new_uint64 (metrics->n_ko));
+  g_variant_builder_add (&builder, "{sv}", "overloaded-replies",
+      g_variant_new_uint64 (metrics->n_overloaded));
+  g_variant_builder_add (&builder, "{sv}", "timed-out-requests",
+      g_variant_new_uint64 (metrics->n_timed_out));
+  g_variant_builder_add (&builder, "{sv}", "coalesced-requests",
+      g_variant_new_uint64 (metrics->n_coalesced));
+  g_variant_builder_add (&builder, "{sv}", "cache-hits",
+      g_variant_new_uint64 (metrics->n_cache_hits));
+  g_variant_builder_add (&builder, "{sv}", "forwarded-requests",
+      g_variant_new_uint64 (metrics->n_forwarded));
+  g_variant_builder_add (&builder, "{sv}", "requests-lost-to-peers",
+      g_variant_new_uint64 (metrics->n_lost_to_peers));
+  g_variant_builder_add (&builder, "{sv}", "purged-workers",
+      g_variant_new_uint64 (metrics->n_purged_workers));
+  g_variant_builder_add (&builder, "{sv}", "pending-requests",
+      g_variant_new_uint32 (snapshot->n_pending));
+  g_variant_builder_add (&builder, "{sv}", "available-workers",
+      g_variant_new_uint32 (snapshot->n_available));
+  g_variant_builder_add (&builder, "{sv}", "n-workers",
+      g_variant_new_uint32 (snapshot->n_workers));
+  g_variant_builder_add (&builder, "{sv}", "dispatch-rate",
+      g_variant_new_double (snapshot->dispatch_rate));
+  g_variant_builder_add (&builder, "{sv}", "wait-time",
+      gpp_histogram_to_variant (&metrics->wait_time));
+  g_variant_builder_add (&builder, "{sv}", "service-time",
+      gpp_histogram_to_variant (&metrics->service_time));
+  add_priority_stats (snapshot, &builder);
+  if (!self->shards)
+    add_worker_stats (self, &builder);
+
+  g_free (snapshot);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
@@ -9,7 +9,38 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE(GPPQueue, gpp_queue, GPP, QUEUE, GObject)
 
+/**
+ * GPPSelectionPolicy:
+ * @GPP_SELECTION_POLICY_LRU: Hand requests to the available worker
+ *  that has waited the longest for one.
+ * @GPP_SELECTION_POLICY_LEAST_OUTSTANDING: Hand requests to the
+ *  available worker handling the fewest tasks.
+ * @GPP_SELECTION_POLICY_POWER_OF_TWO: Pick two available workers at
+ *  random, and hand requests to the one handling the fewest tasks.
+ * @GPP_SELECTION_POLICY_LATENCY_EWMA: Hand requests to the available
+ *  worker expected to be done with them first, going by a moving
+ *  average of the time it took to handle its previous tasks.
+ *
+ * How a #GPPQueue picks the worker it hands a request to.
+ */
+typedef enum {
+  GPP_SELECTION_POLICY_LRU,
+  GPP_SELECTION_POLICY_LEAST_OUTSTANDING,
+  GPP_SELECTION_POLICY_POWER_OF_TWO,
+  GPP_SELECTION_POLICY_LATENCY_EWMA,
+} GPPSelectionPolicy;
+
+#define GPP_TYPE_SELECTION_POLICY (gpp_selection_policy_get_type ())
+
+GType gpp_selection_policy_get_type (void);
+
 GPPQueue * gpp_queue_new (void);
 gboolean gpp_queue_start (GPPQueue *self);
+void gpp_queue_get_priority_stats (GPPQueue *self,
+                                   guint priority,
+                                   guint *depth,
+                                   gint64 *mean_wait,
+                                   gint64 *max_wait);
+GVariant * gpp_queue_get_stats (GPPQueue *self);
 
 #endif
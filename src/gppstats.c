@@ -0,0 +1,196 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <czmq.h>
+
+#include "gppstats.h"
+#include "gppzmqsource.h"
+
+/* Histograms */
+
+void
+gpp_histogram_reset (GPPHistogram *histogram)
+{
+  memset (histogram, 0, sizeof (GPPHistogram));
+}
+
+static guint
+bucket_for_value (guint64 value)
+{
+  guint msb, shift;
+
+  if (value < GPP_HISTOGRAM_SUB_BUCKETS)
+    return value;
+
+  msb = g_bit_storage (value) - 1;
+  if (msb > GPP_HISTOGRAM_MAX_BITS)
+    return GPP_HISTOGRAM_N_BUCKETS - 1;
+
+  shift = msb - GPP_HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift + 1) * GPP_HISTOGRAM_SUB_BUCKETS
+      + ((value >> shift) & (GPP_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* The middle of the range of values that fall in @bucket */
+static guint64
+value_for_bucket (guint bucket)
+{
+  guint shift;
+  guint64 lower;
+
+  if (bucket < GPP_HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+
+  shift = bucket / GPP_HISTOGRAM_SUB_BUCKETS - 1;
+  lower = (guint64) (GPP_HISTOGRAM_SUB_BUCKETS
+      + bucket % GPP_HISTOGRAM_SUB_BUCKETS) << shift;
+
+  return lower + ((G_GUINT64_CONSTANT (1) << shift) >> 1);
+}
+
+void
+gpp_histogram_record (GPPHistogram *histogram, gint64 value)
+{
+  guint64 v = MAX (value, 0);
+
+  histogram->count++;
+  histogram->sum += v;
+  histogram->max = MAX (histogram->max, v);
+  histogram->buckets[bucket_for_value (v)]++;
+}
+
+void
+gpp_histogram_merge (GPPHistogram *histogram, const GPPHistogram *other)
+{
+  guint i;
+
+  histogram->count += other->count;
+  histogram->sum += other->sum;
+  histogram->max = MAX (histogram->max, other->max);
+  for (i = 0; i < GPP_HISTOGRAM_N_BUCKETS; i++)
+    histogram->buckets[i] += other->buckets[i];
+}
+
+/* @percentile goes from 0 to 100 */
+guint64
+gpp_histogram_percentile (const GPPHistogram *histogram, gdouble percentile)
+{
+  guint64 rank, seen = 0;
+  guint i;
+
+  if (!histogram->count)
+    return 0;
+
+  rank = MAX (1, (guint64) (histogram->count * percentile / 100.0 + 0.5));
+  for (i = 0; i < GPP_HISTOGRAM_N_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+      return MIN (value_for_bucket (i), histogram->max);
+  }
+
+  return histogram->max;
+}
+
+GVariant *
+gpp_histogram_to_variant (const GPPHistogram *histogram)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "count",
+      g_variant_new_uint64 (histogram->count));
+  g_variant_builder_add (&builder, "{sv}", "mean",
+      g_variant_new_uint64 (histogram->count ?
+          histogram->sum / histogram->count : 0));
+  g_variant_builder_add (&builder, "{sv}", "max",
+      g_variant_new_uint64 (histogram->max));
+  g_variant_builder_add (&builder, "{sv}", "p50",
+      g_variant_new_uint64 (gpp_histogram_percentile (histogram, 50)));
+  g_variant_builder_add (&builder, "{sv}", "p99",
+      g_variant_new_uint64 (gpp_histogram_percentile (histogram, 99)));
+  g_variant_builder_add (&builder, "{sv}", "p999",
+      g_variant_new_uint64 (gpp_histogram_percentile (histogram, 99.9)));
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Stats server */
+
+struct _GPPStatsServer
+{
+  zctx_t *ctx;
+  void *socket;
+  GSource *source;
+  GPPStatsFunc func;
+  gpointer object;
+};
+
+static gboolean
+handle_stats_request (GPPStatsServer *self)
+{
+  zmsg_t *msg = zmsg_recv (self->socket);
+  GVariant *stats;
+  gchar *text;
+
+  if (!msg)
+    return G_SOURCE_CONTINUE;
+  zmsg_destroy (&msg);
+
+  stats = self->func (self->object);
+  text = g_variant_print (stats, TRUE);
+  zstr_send (self->socket, text);
+  g_free (text);
+  g_variant_unref (stats);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* @ctx is the zctx_t of the object, @context the main context it
+ * runs in, %NULL for the default one.
+ */
+GPPStatsServer *
+gpp_stats_server_new (gpointer ctx, const gchar *endpoint, GPPStatsFunc func,
+    gpointer object, GMainContext *context)
+{
+  GPPStatsServer *self = g_slice_new0 (GPPStatsServer);
+
+  self->ctx = ctx;
+  self->socket = zsocket_new (self->ctx, ZMQ_REP);
+  if (zsocket_bind (self->socket, "%s", endpoint) == -1)
+    g_warning ("Could not bind the stats socket to %s", endpoint);
+
+  self->func = func;
+  self->object = object;
+  self->source = gpp_zmq_source_new (self->socket, 1);
+  g_source_set_callback (self->source, (GSourceFunc) handle_stats_request,
+      self, NULL);
+  g_source_attach (self->source, context);
+
+  return self;
+}
+
+void
+gpp_stats_server_free (GPPStatsServer *self)
+{
+  g_source_destroy (self->source);
+  g_source_unref (self->source);
+  zsocket_destroy (self->ctx, self->socket);
+  g_slice_free (GPPStatsServer, self);
+}
@@ -0,0 +1,47 @@
+#ifndef _GPP_STATS
+#define _GPP_STATS
+
+#include <glib.h>
+
+/* Latency histograms, in microseconds. Each power of two is split
+ * in GPP_HISTOGRAM_SUB_BUCKETS buckets, so percentiles are within
+ * about 6% of the actual values, and recording a value is a couple
+ * of shifts.
+ */
+
+#define GPP_HISTOGRAM_SUB_BUCKET_BITS 3
+#define GPP_HISTOGRAM_SUB_BUCKETS (1 << GPP_HISTOGRAM_SUB_BUCKET_BITS)
+/* Values past 2^40 microseconds, about 12 days, are clamped */
+#define GPP_HISTOGRAM_MAX_BITS 40
+#define GPP_HISTOGRAM_N_BUCKETS \
+  ((GPP_HISTOGRAM_MAX_BITS - GPP_HISTOGRAM_SUB_BUCKET_BITS + 2) * \
+   GPP_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+  guint64 count;
+  guint64 sum;
+  guint64 max;
+  guint64 buckets[GPP_HISTOGRAM_N_BUCKETS];
+} GPPHistogram;
+
+void gpp_histogram_reset (GPPHistogram *histogram);
+void gpp_histogram_record (GPPHistogram *histogram, gint64 value);
+void gpp_histogram_merge (GPPHistogram *histogram, const GPPHistogram *other);
+guint64 gpp_histogram_percentile (const GPPHistogram *histogram,
+    gdouble percentile);
+GVariant * gpp_histogram_to_variant (const GPPHistogram *histogram);
+
+/* A socket answering any request with a snapshot of the statistics
+ * of an object, printed in the GVariant text format.
+ */
+
+/* Returns a full reference to the snapshot */
+typedef GVariant * (*GPPStatsFunc) (gpointer object);
+
+typedef struct _GPPStatsServer GPPStatsServer;
+
+GPPStatsServer * gpp_stats_server_new (gpointer ctx, const gchar *endpoint,
+    GPPStatsFunc func, gpointer object, GMainContext *context);
+void gpp_stats_server_free (GPPStatsServer *server);
+
+#endif
@@ -0,0 +1,355 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "gppthreadedworker.h"
+
+/**
+ * SECTION: gppthreadedworker
+ *
+ * #GPPThreadedWorker is a #GPPWorker for handlers that block, such as
+ * CPU-bound ones. Subclasses implement
+ * #GPPThreadedWorkerClass.handle_blocking, which is called from a
+ * pool of #GPPThreadedWorker:n-threads threads, and the replies are
+ * sent from the thread running the main loop of the worker, which
+ * owns its socket. One worker can thus keep all the cores of a host
+ * busy through a single connection to the #GPPQueue.
+ *
+ * The #GPPWorker:concurrency of the worker is raised to the number of
+ * threads if it is lower, it can be set higher to keep requests
+ * waiting for a free thread in the worker rather than in the queue.
+ */
+
+#define GET_PRIV(self) (gpp_threaded_worker_get_instance_private (GPP_THREADED_WORKER (self)))
+
+enum
+{
+  PROP_0,
+  PROP_N_THREADS,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+typedef struct _Job Job;
+
+struct _Job
+{
+  /* Links completed jobs */
+  Job *next;
+  guint task_id;
+  GBytes *request;
+  GBytes *reply;
+  gboolean success;
+};
+
+typedef struct _GPPThreadedWorkerPrivate
+{
+  guint n_threads;
+  GThreadPool *pool;
+  /* Set when disposing, jobs are then dropped without being handled */
+  gint cancelled;
+
+  /* Stack of the completed jobs, pushed by the threads of the pool and
+   * emptied at once by the main thread.
+   */
+  gpointer completions;
+  /* Written to wake the main thread up, an eventfd where available */
+  gint wakeup_fds[2];
+  guint wakeup_source;
+} GPPThreadedWorkerPrivate;
+
+G_DEFINE_TYPE_WITH_CODE (GPPThreadedWorker, gpp_threaded_worker,
+    GPP_TYPE_WORKER, G_ADD_PRIVATE (GPPThreadedWorker));
+
+static void
+job_free (Job *job)
+{
+  g_bytes_unref (job->request);
+  if (job->reply)
+    g_bytes_unref (job->reply);
+  g_slice_free (Job, job);
+}
+
+/* Wake-ups */
+
+static gboolean
+open_wakeup (GPPThreadedWorkerPrivate *priv)
+{
+#ifdef __linux__
+  priv->wakeup_fds[0] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  priv->wakeup_fds[1] = priv->wakeup_fds[0];
+
+  return priv->wakeup_fds[0] >= 0;
+#else
+  return g_unix_open_pipe (priv->wakeup_fds, FD_CLOEXEC, NULL) &&
+      g_unix_set_fd_nonblocking (priv->wakeup_fds[0], TRUE, NULL) &&
+      g_unix_set_fd_nonblocking (priv->wakeup_fds[1], TRUE, NULL);
+#endif
+}
+
+static void
+close_wakeup (GPPThreadedWorkerPrivate *priv)
+{
+  if (priv->wakeup_fds[1] != priv->wakeup_fds[0])
+    close (priv->wakeup_fds[1]);
+  close (priv->wakeup_fds[0]);
+  priv->wakeup_fds[0] = priv->wakeup_fds[1] = -1;
+}
+
+static void
+signal_wakeup (GPPThreadedWorkerPrivate *priv)
+{
+  /* eventfds only take 8-byte integers, pipes take them as well. A full
+   * pipe already wakes the main thread up.
+   */
+  guint64 one = 1;
+
+  while (write (priv->wakeup_fds[1], &one, sizeof (one)) < 0 &&
+      errno == EINTR);
+}
+
+static void
+acknowledge_wakeup (GPPThreadedWorkerPrivate *priv)
+{
+  guint64 value;
+
+  while (read (priv->wakeup_fds[0], &value, sizeof (value)) > 0 ||
+      errno == EINTR);
+}
+
+/* Completions */
+
+static void
+push_completion (GPPThreadedWorkerPrivate *priv, Job *job)
+{
+  Job *head;
+
+  do {
+    head = g_atomic_pointer_get (&priv->completions);
+    job->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&priv->completions, head,
+      job));
+
+  /* The main thread is already due to wake up otherwise */
+  if (!head)
+    signal_wakeup (priv);
+}
+
+/* Returns the completed jobs, oldest first */
+static Job *
+pop_completions (GPPThreadedWorkerPrivate *priv)
+{
+  Job *head, *job, *completions = NULL;
+
+  do {
+    head = g_atomic_pointer_get (&priv->completions);
+  } while (!g_atomic_pointer_compare_and_exchange (&priv->completions, head,
+      NULL));
+
+  while ((job = head)) {
+    head = job->next;
+    job->next = completions;
+    completions = job;
+  }
+
+  return completions;
+}
+
+static gboolean
+handle_completions (gint fd, GIOCondition condition, GPPThreadedWorker *self)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (self);
+  Job *job, *next;
+
+  /* Jobs completed from now on wake us up again */
+  acknowledge_wakeup (priv);
+
+  for (job = pop_completions (priv); job; job = next) {
+    next = job->next;
+    gpp_worker_set_task_done_bytes (GPP_WORKER (self), job->task_id,
+        job->reply, job->success);
+    job_free (job);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Runs in the threads of the pool */
+static void
+run_job (Job *job, GPPThreadedWorker *self)
+{
+  GPPThreadedWorkerClass *klass = GPP_THREADED_WORKER_GET_CLASS (self);
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (self);
+
+  if (!g_atomic_int_get (&priv->cancelled) && klass->handle_blocking)
+    job->success = klass->handle_blocking (self, job->request, &job->reply);
+
+  push_completion (priv, job);
+}
+
+/* GPPWorker */
+
+static gboolean
+handle_bytes (GPPWorker *worker, guint task_id, GBytes *request)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (worker);
+  Job *job;
+
+  if (!priv->pool)
+    return FALSE;
+
+  job = g_slice_new0 (Job);
+  job->task_id = task_id;
+  job->request = g_bytes_ref (request);
+
+  return g_thread_pool_push (priv->pool, job, NULL);
+}
+
+/* GObject */
+
+static void
+gpp_threaded_worker_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (object);
+
+  switch (prop_id) {
+    case PROP_N_THREADS:
+      priv->n_threads = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gpp_threaded_worker_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (object);
+
+  switch (prop_id) {
+    case PROP_N_THREADS:
+      g_value_set_uint (value, priv->n_threads);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+constructed (GObject *object)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (object);
+  guint concurrency;
+
+  G_OBJECT_CLASS (gpp_threaded_worker_parent_class)->constructed (object);
+
+  if (!priv->n_threads)
+    priv->n_threads = g_get_num_processors ();
+
+  if (!open_wakeup (priv))
+    g_error ("Could not create a wake-up file descriptor: %s",
+        g_strerror (errno));
+  priv->wakeup_source = g_unix_fd_add (priv->wakeup_fds[0], G_IO_IN,
+      (GUnixFDSourceFunc) handle_completions, object);
+
+  priv->pool = g_thread_pool_new ((GFunc) run_job, object, priv->n_threads,
+      FALSE, NULL);
+
+  g_object_get (object, "concurrency", &concurrency, NULL);
+  if (concurrency < priv->n_threads)
+    g_object_set (object, "concurrency", priv->n_threads, NULL);
+}
+
+static void
+dispose (GObject *object)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (object);
+
+  if (priv->pool) {
+    /* Lets the running handlers finish, and drops the waiting jobs */
+    g_atomic_int_set (&priv->cancelled, TRUE);
+    g_thread_pool_free (priv->pool, FALSE, TRUE);
+    priv->pool = NULL;
+  }
+
+  if (priv->wakeup_source) {
+    Job *job, *next;
+
+    for (job = pop_completions (priv); job; job = next) {
+      next = job->next;
+      job_free (job);
+    }
+
+    g_source_remove (priv->wakeup_source);
+    priv->wakeup_source = 0;
+    close_wakeup (priv);
+  }
+
+  /* Detaches the sources of the worker, which could still hand us
+   * requests or wake it up otherwise.
+   */
+  G_OBJECT_CLASS (gpp_threaded_worker_parent_class)->dispose (object);
+}
+
+static void
+gpp_threaded_worker_class_init (GPPThreadedWorkerClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GPPWorkerClass *gpp_worker_class = GPP_WORKER_CLASS (klass);
+
+  gobject_class->set_property = gpp_threaded_worker_set_property;
+  gobject_class->get_property = gpp_threaded_worker_get_property;
+  gobject_class->constructed = constructed;
+  gobject_class->dispose = dispose;
+
+  gpp_worker_class->handle_bytes = handle_bytes;
+
+  /**
+   * GPPThreadedWorker:n-threads:
+   *
+   * The number of threads requests are handled in, 0 meaning as many
+   * as the host has processors.
+   */
+  properties[PROP_N_THREADS] =
+      g_param_spec_uint ("n-threads", "Number of threads",
+      "Number of threads handling requests", 0, G_MAXINT, 0,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPERTIES, properties);
+}
+
+static void
+gpp_threaded_worker_init (GPPThreadedWorker *self)
+{
+  GPPThreadedWorkerPrivate *priv = GET_PRIV (self);
+
+  priv->wakeup_fds[0] = priv->wakeup_fds[1] = -1;
+}
@@ -0,0 +1,36 @@
+#ifndef _GPP_THREADED_WORKER
+#define _GPP_THREADED_WORKER
+
+#include <glib-object.h>
+
+#include "gppworker.h"
+
+G_BEGIN_DECLS
+
+#define GPP_TYPE_THREADED_WORKER (gpp_threaded_worker_get_type ())
+
+G_DECLARE_DERIVABLE_TYPE(GPPThreadedWorker, gpp_threaded_worker, GPP, THREADED_WORKER, GPPWorker)
+
+struct _GPPThreadedWorkerClass
+{
+  GPPWorkerClass parent_class;
+
+  /**
+   * GPPThreadedWorkerClass::handle_blocking:
+   * @self: the #GPPThreadedWorker
+   * @request: The request to handle
+   * @reply: (out) (allow-none): Return location for the reply
+   *
+   * Implement this method to handle requests, it is called from a
+   * thread of the pool of the worker, and can block until the request
+   * has been handled. It can be called from several threads at the
+   * same time.
+   *
+   * Returns: %TRUE if the request was successfully handled, %FALSE otherwise.
+   */
+  gboolean (*handle_blocking) (GPPThreadedWorker *self, GBytes *request, GBytes **reply);
+};
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,144 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "gpptimerwheel.h"
+
+#define N_SLOTS 64
+/* Where due timers wait for their callback to be called */
+#define FIRING_SLOT N_SLOTS
+
+struct _GPPTimerWheel
+{
+  gint64 resolution;
+  /* The last tick we processed */
+  gint64 current_tick;
+  GQueue slots[N_SLOTS + 1];
+
+  GPPTimerFunc func;
+  gpointer user_data;
+};
+
+GPPTimerWheel *
+gpp_timer_wheel_new (gint64 resolution, GPPTimerFunc func, gpointer user_data)
+{
+  GPPTimerWheel *wheel = g_slice_new0 (GPPTimerWheel);
+  guint i;
+
+  wheel->resolution = resolution;
+  wheel->current_tick = g_get_monotonic_time () / resolution;
+  wheel->func = func;
+  wheel->user_data = user_data;
+
+  for (i = 0; i <= N_SLOTS; i++)
+    g_queue_init (&wheel->slots[i]);
+
+  return wheel;
+}
+
+/* Timers are owned by the caller, they are only unlinked */
+void
+gpp_timer_wheel_free (GPPTimerWheel *wheel)
+{
+  guint i;
+
+  for (i = 0; i <= N_SLOTS; i++) {
+    GList *link;
+
+    while ((link = g_queue_pop_head_link (&wheel->slots[i])))
+      ((GPPTimer *) link)->scheduled = FALSE;
+  }
+
+  g_slice_free (GPPTimerWheel, wheel);
+}
+
+void
+gpp_timer_wheel_schedule (GPPTimerWheel *wheel, GPPTimer *timer,
+    gint64 deadline)
+{
+  /* Rounded up, timers are only looked at once per revolution and
+   * must be due by the time their tick is processed.
+   */
+  gint64 tick = (deadline + wheel->resolution - 1) / wheel->resolution;
+
+  if (timer->scheduled)
+    gpp_timer_wheel_cancel (wheel, timer);
+
+  /* Timers can't fire in the tick being processed */
+  if (tick <= wheel->current_tick)
+    tick = wheel->current_tick + 1;
+
+  timer->deadline = deadline;
+  timer->slot = tick % N_SLOTS;
+  timer->scheduled = TRUE;
+  g_queue_push_tail_link (&wheel->slots[timer->slot], &timer->link);
+}
+
+void
+gpp_timer_wheel_cancel (GPPTimerWheel *wheel, GPPTimer *timer)
+{
+  if (!timer->scheduled)
+    return;
+
+  g_queue_unlink (&wheel->slots[timer->slot], &timer->link);
+  timer->scheduled = FALSE;
+}
+
+/* Fires all the timers whose deadline is past @now, the callback
+ * may reschedule or cancel any timer.
+ */
+void
+gpp_timer_wheel_advance (GPPTimerWheel *wheel, gint64 now)
+{
+  gint64 now_tick = now / wheel->resolution;
+  gint64 tick;
+
+  /* After a long stall, each slot only needs to be visited once */
+  if (now_tick - wheel->current_tick > N_SLOTS)
+    wheel->current_tick = now_tick - N_SLOTS;
+
+  for (tick = wheel->current_tick + 1; tick <= now_tick; tick++) {
+    GQueue *slot = &wheel->slots[tick % N_SLOTS];
+    GQueue *firing = &wheel->slots[FIRING_SLOT];
+    GList *link, *next;
+
+    wheel->current_tick = tick;
+
+    /* Timers further than one revolution away stay where they are,
+     * due ones are moved away so that callbacks can reschedule them
+     * or cancel any other timer.
+     */
+    for (link = slot->head; link; link = next) {
+      GPPTimer *timer = (GPPTimer *) link;
+
+      next = link->next;
+      if (timer->deadline <= now) {
+        g_queue_unlink (slot, link);
+        timer->slot = FIRING_SLOT;
+        g_queue_push_tail_link (firing, link);
+      }
+    }
+
+    while ((link = g_queue_pop_head_link (firing))) {
+      GPPTimer *timer = (GPPTimer *) link;
+
+      timer->scheduled = FALSE;
+      wheel->func (timer, wheel->user_data);
+    }
+  }
+}
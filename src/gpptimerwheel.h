@@ -0,0 +1,31 @@
+#ifndef _GPP_TIMER_WHEEL
+#define _GPP_TIMER_WHEEL
+
+#include <glib.h>
+
+/* A hashed timer wheel, scheduling, rescheduling and cancelling
+ * timers are O(1), and advancing it only looks at the timers
+ * hashed in the slots that elapsed.
+ */
+
+typedef struct _GPPTimerWheel GPPTimerWheel;
+
+typedef struct {
+  /* link.data is left untouched, use it to point to the owner */
+  GList link;
+  gint64 deadline;
+  guint slot;
+  gboolean scheduled;
+} GPPTimer;
+
+typedef void (*GPPTimerFunc) (GPPTimer *timer, gpointer user_data);
+
+GPPTimerWheel * gpp_timer_wheel_new (gint64 resolution, GPPTimerFunc func,
+    gpointer user_data);
+void gpp_timer_wheel_free (GPPTimerWheel *wheel);
+void gpp_timer_wheel_schedule (GPPTimerWheel *wheel, GPPTimer *timer,
+    gint64 deadline);
+void gpp_timer_wheel_cancel (GPPTimerWheel *wheel, GPPTimer *timer);
+void gpp_timer_wheel_advance (GPPTimerWheel *wheel, gint64 now);
+
+#endif
@@ -0,0 +1,178 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gpputils.h"
+#include "gpptrace.h"
+
+/* Trace context frames */
+
+static void
+write_uint64 (byte *data, guint64 value)
+{
+  value = GUINT64_TO_BE (value);
+  memcpy (data, &value, 8);
+}
+
+static guint64
+read_uint64 (const byte *data)
+{
+  guint64 value;
+
+  memcpy (&value, data, 8);
+  return GUINT64_FROM_BE (value);
+}
+
+zframe_t *
+gpp_trace_frame_new (void)
+{
+  byte data[GPP_TRACE_SIZE] = { 0, };
+  guint64 trace_id;
+
+  trace_id = ((guint64) g_random_int () << 32) | g_random_int ();
+  write_uint64 (data, trace_id);
+
+  return zframe_new (data, GPP_TRACE_SIZE);
+}
+
+/* Forgets the hops of a previous attempt, keeping the trace id */
+void
+gpp_trace_frame_reset (zframe_t *frame)
+{
+  memset (zframe_data (frame) + 8, 0, GPP_TRACE_SIZE - 8);
+}
+
+void
+gpp_trace_frame_stamp (zframe_t *frame, GPPHop hop)
+{
+  write_uint64 (zframe_data (frame) + 8 * (1 + hop), g_get_real_time ());
+}
+
+/* The trace frame can't be the last one, which is the payload */
+zframe_t *
+gpp_msg_find_trace (zmsg_t *msg)
+{
+  zframe_t *frame;
+
+  if (!gpp_msg_find_header (msg))
+    return NULL;
+
+  frame = zmsg_next (msg);
+  if (!frame || frame == zmsg_last (msg) ||
+      zframe_size (frame) != GPP_TRACE_SIZE)
+    return NULL;
+
+  return frame;
+}
+
+/* Trace file */
+
+static GMutex trace_lock;
+static FILE *trace_file;
+
+/* g_strescape() would write bytes above 0x7f as octal escapes, which
+ * JSON doesn't have.
+ */
+static gchar *
+json_escape (const gchar *string)
+{
+  GString *escaped = g_string_new (NULL);
+  const gchar *c;
+
+  for (c = string; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      g_string_append_printf (escaped, "\\%c", *c);
+    else if ((guchar) *c < 0x20)
+      g_string_append_printf (escaped, "\\u%04x", (guchar) *c);
+    else
+      g_string_append_c (escaped, *c);
+  }
+
+  return g_string_free (escaped, FALSE);
+}
+
+static gpointer
+open_trace_file (gpointer unused)
+{
+  const gchar *pattern = g_getenv ("GPP_TRACE_FILE");
+  gchar *pid, **parts, *path, *name;
+
+  if (!pattern || !*pattern)
+    return NULL;
+
+  pid = g_strdup_printf ("%d", (gint) getpid ());
+  parts = g_strsplit (pattern, "%p", -1);
+  path = g_strjoinv (pid, parts);
+  g_strfreev (parts);
+
+  /* One event per line, each written out as soon as it is recorded,
+   * so that the file stays valid however the process stops.
+   */
+  trace_file = fopen (path, "w");
+  if (!trace_file) {
+    g_warning ("Could not open trace file %s", path);
+  } else {
+    setvbuf (trace_file, NULL, _IOLBF, 0);
+    name = json_escape (g_get_prgname () ? g_get_prgname () : "gpp");
+    fprintf (trace_file, "{\"name\": \"process_name\", \"ph\": \"M\", "
+        "\"pid\": %s, \"args\": {\"name\": \"%s\"}}\n", pid, name);
+    g_free (name);
+  }
+
+  g_free (path);
+  g_free (pid);
+
+  return NULL;
+}
+
+/* Records, as a complete event, the time the request spent between
+ * two hops, if both were stamped. Events of all the processes a
+ * request went through can be told apart by their pid and tied
+ * together by their trace id.
+ */
+void
+gpp_trace_record_span (zframe_t *frame, const gchar *name, GPPHop from,
+    GPPHop to)
+{
+  static GOnce once = G_ONCE_INIT;
+  const byte *data = zframe_data (frame);
+  gint64 start, end;
+
+  g_once (&once, open_trace_file, NULL);
+
+  start = read_uint64 (data + 8 * (1 + from));
+  end = read_uint64 (data + 8 * (1 + to));
+  if (!trace_file || !start || !end)
+    return;
+
+  g_mutex_lock (&trace_lock);
+  if (trace_file) {
+    fprintf (trace_file, "{\"name\": \"%s\", \"cat\": \"gpp\", "
+        "\"ph\": \"X\", \"ts\": %" G_GINT64_FORMAT ", "
+        "\"dur\": %" G_GINT64_FORMAT ", \"pid\": %d, \"tid\": %u, "
+        "\"args\": {\"trace-id\": \"%016" G_GINT64_MODIFIER "x\"}}\n",
+        name, start, MAX (0, end - start),
+        (gint) getpid (), g_direct_hash (g_thread_self ()),
+        read_uint64 (data));
+  }
+  g_mutex_unlock (&trace_lock);
+}
@@ -0,0 +1,42 @@
+#ifndef _GPP_TRACE
+#define _GPP_TRACE
+
+#include <glib.h>
+#include <czmq.h>
+
+/* Traced requests carry a trace context frame between their header
+ * and their payload:
+ *
+ * [envelope frames ...][empty][header][trace][payload]
+ *
+ * It holds a trace id followed by the wall-clock time, in
+ * microseconds, at which each hop saw the request, 0 for the hops it
+ * didn't reach yet. All are 64-bit big-endian integers.
+ */
+
+typedef enum {
+  GPP_HOP_CLIENT_SEND,
+  GPP_HOP_QUEUE_RECEIVE,
+  GPP_HOP_QUEUE_DISPATCH,
+  GPP_HOP_WORKER_RECEIVE,
+  GPP_HOP_WORKER_DONE,
+  GPP_HOP_CLIENT_RECEIVE,
+  GPP_N_HOPS
+} GPPHop;
+
+#define GPP_TRACE_SIZE (8 * (1 + GPP_N_HOPS))
+
+zframe_t * gpp_trace_frame_new (void);
+void gpp_trace_frame_reset (zframe_t *frame);
+void gpp_trace_frame_stamp (zframe_t *frame, GPPHop hop);
+zframe_t * gpp_msg_find_trace (zmsg_t *msg);
+
+/* Spans are written to the file named by the GPP_TRACE_FILE
+ * environment variable, in which %p is replaced with the process id,
+ * as Chrome trace events, one JSON object per line. Nothing is
+ * written if it isn't set.
+ */
+void gpp_trace_record_span (zframe_t *frame, const gchar *name, GPPHop from,
+    GPPHop to);
+
+#endif
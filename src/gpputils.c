@@ -1,14 +1,392 @@
 #include <czmq.h>
 
 #include "gpputils.h"
-  
-GIOChannel *
-g_io_channel_from_zmq_socket (void *socket)
+
+/* Headers */
+
+zframe_t *
+gpp_header_to_frame (const GPPHeader *header)
+{
+  byte data[GPP_HEADER_SIZE];
+  guint32 request_id = GUINT32_TO_BE (header->request_id);
+  guint32 timeout = GUINT32_TO_BE (header->timeout);
+  guint32 key_hash = GUINT32_TO_BE (header->key_hash);
+
+  memcpy (data, &request_id, 4);
+  data[4] = header->status;
+  memcpy (data + 5, &timeout, 4);
+  data[9] = header->priority;
+  memcpy (data + 10, &key_hash, 4);
+  data[14] = header->flags;
+
+  return zframe_new (data, GPP_HEADER_SIZE);
+}
+
+gboolean
+gpp_header_from_frame (zframe_t *frame, GPPHeader *header)
+{
+  if (!frame)
+    return FALSE;
+
+  return gpp_header_from_data (zframe_data (frame), zframe_size (frame),
+      header);
+}
+
+gboolean
+gpp_header_from_data (const byte *data, size_t size, GPPHeader *header)
+{
+  guint32 request_id, timeout, key_hash;
+
+  if (size != GPP_HEADER_SIZE)
+    return FALSE;
+
+  memcpy (&request_id, data, 4);
+  header->request_id = GUINT32_FROM_BE (request_id);
+  header->status = data[4];
+  memcpy (&timeout, data + 5, 4);
+  header->timeout = GUINT32_FROM_BE (timeout);
+  header->priority = MIN (data[9], GPP_N_PRIORITIES - 1);
+  memcpy (&key_hash, data + 10, 4);
+  header->key_hash = GUINT32_FROM_BE (key_hash);
+  header->flags = data[14];
+
+  return TRUE;
+}
+
+void
+gpp_header_frame_set_status (zframe_t *frame, GPPStatus status)
+{
+  zframe_data (frame)[4] = status;
+}
+
+void
+gpp_header_frame_set_timeout (zframe_t *frame, guint32 timeout)
+{
+  timeout = GUINT32_TO_BE (timeout);
+  memcpy (zframe_data (frame) + 5, &timeout, 4);
+}
+
+void
+gpp_header_frame_set_flags (zframe_t *frame, guint8 flags)
 {
-  int fd;
-  size_t sizeof_fd = sizeof(fd);
-  if (zmq_getsockopt(socket, ZMQ_FD, &fd, &sizeof_fd))
-    perror("retrieving zmq fd");
+  zframe_data (frame)[14] = flags;
+}
+
+/* Returns the frame following the first empty delimiter, the message
+ * cursor is left on it.
+ */
+zframe_t *
+gpp_msg_find_header (zmsg_t *msg)
+{
+  zframe_t *frame;
+
+  for (frame = zmsg_first (msg); frame; frame = zmsg_next (msg)) {
+    if (zframe_size (frame) == 0)
+      return zmsg_next (msg);
+  }
+
+  return NULL;
+}
+
+/* Payloads */
+
+static void
+free_bytes (void *data, void *hint)
+{
+  g_bytes_unref (hint);
+}
+
+/* Sends @bytes as the last frame of a message, zeromq will
+ * release our reference once it is done with the data.
+ */
+gboolean
+gpp_send_bytes (void *socket, GBytes *bytes)
+{
+  zmq_msg_t msg;
+  gsize size;
+  gconstpointer data = g_bytes_get_data (bytes, &size);
+
+  zmq_msg_init_data (&msg, (gpointer) data, size, free_bytes,
+      g_bytes_ref (bytes));
+
+  if (zmq_msg_send (&msg, socket, 0) == -1) {
+    zmq_msg_close (&msg);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Sends the frames of *msg_p followed by @payload, an empty payload
+ * frame is sent if @payload is %NULL.
+ */
+void
+gpp_msg_send_with_payload (zmsg_t **msg_p, void *socket, GBytes *payload)
+{
+  zframe_t *frame;
+
+  while ((frame = zmsg_pop (*msg_p)))
+    zframe_send (&frame, socket, ZFRAME_MORE);
+  zmsg_destroy (msg_p);
+
+  if (payload) {
+    gpp_send_bytes (socket, payload);
+  } else {
+    frame = zframe_new_empty ();
+    zframe_send (&frame, socket, 0);
+  }
+}
+
+static void
+frame_free (zframe_t *frame)
+{
+  zframe_destroy (&frame);
+}
+
+/* Takes ownership of @frame, which must have been removed from
+ * its message, and exposes its data without copying it.
+ */
+GBytes *
+gpp_bytes_new_from_frame (zframe_t *frame)
+{
+  return g_bytes_new_with_free_func (zframe_data (frame), zframe_size (frame),
+      (GDestroyNotify) frame_free, frame);
+}
+
+/* Compression */
+
+/* Makes room for more output, up to one byte past @max_size, which
+ * tells it was exceeded. Returns %FALSE if it already was.
+ */
+static gboolean
+grow_output (GByteArray *out, gsize size, gsize max_size)
+{
+  if (max_size) {
+    if (out->len > max_size)
+      return FALSE;
+    size = MIN (size, max_size + 1);
+  }
+
+  g_byte_array_set_size (out, size);
+  return TRUE;
+}
+
+/* Fails if the output is larger than @max_size, 0 for no limit */
+static GBytes *
+convert_bytes (GConverter *converter, GBytes *bytes, gsize max_size,
+    GError **error)
+{
+  gsize in_left, out_len = 0, n_read, n_written;
+  const guint8 *in = g_bytes_get_data (bytes, &in_left);
+  GByteArray *out = g_byte_array_new ();
+  GConverterResult result;
+
+  grow_output (out, MAX (in_left, 64), max_size);
+
+  do {
+    GError *convert_error = NULL;
+
+    if (out_len == out->len && !grow_output (out, out->len * 2, max_size))
+      goto too_large;
+
+    result = g_converter_convert (converter, in, in_left, out->data + out_len,
+        out->len - out_len, G_CONVERTER_INPUT_AT_END, &n_read, &n_written,
+        &convert_error);
+
+    if (result == G_CONVERTER_ERROR) {
+      if (!g_error_matches (convert_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        g_propagate_error (error, convert_error);
+        g_byte_array_unref (out);
+        return NULL;
+      }
+
+      /* The output buffer is too small to make any progress */
+      g_error_free (convert_error);
+      if (!grow_output (out, out->len * 2, max_size))
+        goto too_large;
+      continue;
+    }
+
+    in += n_read;
+    in_left -= n_read;
+    out_len += n_written;
+  } while (result != G_CONVERTER_FINISHED);
+
+  if (max_size && out_len > max_size)
+    goto too_large;
+
+  g_byte_array_set_size (out, out_len);
+  return g_byte_array_free_to_bytes (out);
+
+too_large:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE,
+      "Payload larger than %" G_GSIZE_FORMAT " bytes once decompressed",
+      max_size);
+  g_byte_array_unref (out);
+  return NULL;
+}
+
+/* Returns @bytes compressed if it is at least @threshold bytes long,
+ * and compressing it makes it smaller, or a new reference to @bytes.
+ * A @threshold of 0 disables compression.
+ */
+GBytes *
+gpp_bytes_compress (GBytes *bytes, gsize threshold, gboolean *compressed)
+{
+  GConverter *compressor;
+  GBytes *result;
+
+  *compressed = FALSE;
+  if (!threshold || g_bytes_get_size (bytes) < threshold)
+    return g_bytes_ref (bytes);
+
+  compressor = G_CONVERTER (g_zlib_compressor_new (
+      G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+  result = convert_bytes (compressor, bytes, 0, NULL);
+  g_object_unref (compressor);
+
+  if (!result || g_bytes_get_size (result) >= g_bytes_get_size (bytes)) {
+    if (result)
+      g_bytes_unref (result);
+    return g_bytes_ref (bytes);
+  }
+
+  *compressed = TRUE;
+  return result;
+}
+
+/* Fails when @bytes would decompress to more than @max_size bytes,
+ * so that a small payload can't make us allocate without bounds. A
+ * @max_size of 0 means no limit.
+ */
+GBytes *
+gpp_bytes_decompress (GBytes *bytes, gsize max_size, GError **error)
+{
+  GConverter *decompressor;
+  GBytes *result;
+
+  decompressor = G_CONVERTER (g_zlib_decompressor_new (
+      G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+  result = convert_bytes (decompressor, bytes, max_size, error);
+  g_object_unref (decompressor);
+
+  return result;
+}
+
+/* Batches */
+
+static void
+bytes_unref_nullable (GBytes *bytes)
+{
+  if (bytes)
+    g_bytes_unref (bytes);
+}
+
+/* Returns an array of @n_items %NULL items, that can be replaced with
+ * #GBytes it then owns.
+ */
+GPtrArray *
+gpp_batch_new (guint n_items)
+{
+  GPtrArray *items = g_ptr_array_new_full (n_items,
+      (GDestroyNotify) bytes_unref_nullable);
+
+  g_ptr_array_set_size (items, n_items);
+  return items;
+}
+
+/* @items holds #GBytes, %NULL for failed items */
+GBytes *
+gpp_batch_encode (GPtrArray *items)
+{
+  GByteArray *array = g_byte_array_new ();
+  guint i;
+
+  for (i = 0; i < items->len; i++) {
+    GBytes *item = g_ptr_array_index (items, i);
+    guint32 size = item ? g_bytes_get_size (item) : GPP_BATCH_ITEM_FAILED;
+    guint32 be_size = GUINT32_TO_BE (size);
+
+    g_byte_array_append (array, (const guint8 *) &be_size, 4);
+    if (item)
+      g_byte_array_append (array, g_bytes_get_data (item, NULL), size);
+  }
+
+  return g_byte_array_free_to_bytes (array);
+}
+
+/* The items share the memory of @bytes. Returns %NULL if @bytes
+ * isn't a valid batch.
+ */
+GPtrArray *
+gpp_batch_decode (GBytes *bytes)
+{
+  GPtrArray *items = gpp_batch_new (0);
+  gsize size, offset = 0;
+  const guint8 *data = g_bytes_get_data (bytes, &size);
+
+  while (offset < size) {
+    guint32 item_size;
+
+    if (size - offset < 4)
+      goto invalid;
+
+    memcpy (&item_size, data + offset, 4);
+    item_size = GUINT32_FROM_BE (item_size);
+    offset += 4;
+
+    if (item_size == GPP_BATCH_ITEM_FAILED) {
+      g_ptr_array_add (items, NULL);
+      continue;
+    }
+
+    if (size - offset < item_size)
+      goto invalid;
+
+    g_ptr_array_add (items, g_bytes_new_from_bytes (bytes, offset, item_size));
+    offset += item_size;
+  }
+
+  return items;
+
+invalid:
+  g_ptr_array_unref (items);
+  return NULL;
+}
+
+/* Integers */
+
+zframe_t *
+gpp_uint32_to_frame (guint32 value)
+{
+  value = GUINT32_TO_BE (value);
+  return zframe_new (&value, sizeof (value));
+}
+
+gboolean
+gpp_uint32_from_frame (zframe_t *frame, guint32 *value)
+{
+  if (!frame || zframe_size (frame) != sizeof (guint32))
+    return FALSE;
+
+  memcpy (value, zframe_data (frame), sizeof (guint32));
+  *value = GUINT32_FROM_BE (*value);
+  return TRUE;
+}
+
+/* Hashing */
+
+guint32
+gpp_hash_data (const byte *data, size_t size)
+{
+  size_t i;
+  /* FNV-1a */
+  guint32 hash = 2166136261u;
+
+  for (i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
 
-  return g_io_channel_unix_new(fd);
+  return hash;
 }
@@ -2,14 +2,101 @@
 #define _GPP_UTILS
 
 #include <gio/gio.h>
+#include <czmq.h>
 
-GIOChannel * g_io_channel_from_zmq_socket (void *socket);
+#include "gppcontext.h"
+
+zctx_t * gpp_context_new_zctx (GPPContext *self);
+void gpp_context_configure_socket (GPPContext *self, void *socket);
 
 #define HEARTBEAT_LIVENESS  3
 #define HEARTBEAT_INTERVAL  G_USEC_PER_SEC
 
+/* Workers follow these with a frame advertising how many
+ * tasks they can handle concurrently.
+ */
 #define PPP_READY       "\001"
 #define PPP_HEARTBEAT   "\002"
-#define PPP_KO          "\003"
+
+/* Requests and replies look like this on the wire, once
+ * the ROUTER sockets have prepended their identities:
+ *
+ * [envelope frames ...][empty][header][payload]
+ *
+ * The header lets the client match a reply with the request
+ * it made, the payload is never looked at by the queue.
+ */
+
+typedef enum {
+  GPP_STATUS_REQUEST,
+  GPP_STATUS_OK,
+  GPP_STATUS_KO,
+  /* The queue had too many pending requests */
+  GPP_STATUS_OVERLOADED,
+  /* The request ran out of time before reaching a worker */
+  GPP_STATUS_TIMEOUT,
+  /* A chunk of the reply, the task goes on */
+  GPP_STATUS_PARTIAL,
+} GPPStatus;
+
+typedef struct {
+  guint32 request_id;
+  GPPStatus status;
+  /* What's left of the time budget of the request, in milliseconds,
+   * each hop rewrites it when forwarding the request. 0 means none.
+   */
+  guint32 timeout;
+  /* From 0, the most urgent, to GPP_N_PRIORITIES - 1 */
+  guint8 priority;
+  /* Hash of the routing key of the request, 0 if it has none */
+  guint32 key_hash;
+  guint8 flags;
+} GPPHeader;
+
+#define GPP_HEADER_SIZE 15
+
+/* The payload following the header is zlib-compressed */
+#define GPP_HEADER_FLAG_COMPRESSED          (1 << 0)
+/* The client of the request can decompress the reply */
+#define GPP_HEADER_FLAG_ACCEPTS_COMPRESSED  (1 << 1)
+/* The payload is a batch of requests, or of their replies */
+#define GPP_HEADER_FLAG_BATCH               (1 << 2)
+/* A queue forwarded the request to a peer, which won't forward it */
+#define GPP_HEADER_FLAG_FORWARDED           (1 << 3)
+
+#define GPP_N_PRIORITIES 4
+#define GPP_DEFAULT_PRIORITY 1
+
+zframe_t * gpp_header_to_frame (const GPPHeader *header);
+gboolean gpp_header_from_frame (zframe_t *frame, GPPHeader *header);
+gboolean gpp_header_from_data (const byte *data, size_t size,
+    GPPHeader *header);
+void gpp_header_frame_set_status (zframe_t *frame, GPPStatus status);
+void gpp_header_frame_set_timeout (zframe_t *frame, guint32 timeout);
+void gpp_header_frame_set_flags (zframe_t *frame, guint8 flags);
+zframe_t * gpp_msg_find_header (zmsg_t *msg);
+
+gboolean gpp_send_bytes (void *socket, GBytes *bytes);
+void gpp_msg_send_with_payload (zmsg_t **msg_p, void *socket, GBytes *payload);
+GBytes * gpp_bytes_new_from_frame (zframe_t *frame);
+GBytes * gpp_bytes_compress (GBytes *bytes, gsize threshold,
+    gboolean *compressed);
+GBytes * gpp_bytes_decompress (GBytes *bytes, gsize max_size,
+    GError **error);
+
+/* Batches are sent as a single payload, in which each item is
+ * preceded by its size as a 32-bit big-endian integer. Failed items
+ * of a batch of replies have a size of G_MAXUINT32, and no data.
+ */
+#define GPP_BATCH_ITEM_FAILED G_MAXUINT32
+
+GPtrArray * gpp_batch_new (guint n_items);
+GBytes * gpp_batch_encode (GPtrArray *items);
+GPtrArray * gpp_batch_decode (GBytes *bytes);
+
+zframe_t * gpp_uint32_to_frame (guint32 value);
+gboolean gpp_uint32_from_frame (zframe_t *frame, guint32 *value);
+
+guint32 gpp_hash_data (const byte *data, size_t size);
 
 #endif
@@ -18,6 +18,9 @@
  */
 
 #include "gpputils.h"
+#include "gppstats.h"
+#include "gpptrace.h"
+#include "gppzmqsource.h"
 #include "gppworker.h"
 
 #include "czmq.h"
@@ -25,97 +28,404 @@
 #define INTERVAL_INIT       1000
 #define INTERVAL_MAX       32000
 
+#define DEFAULT_QUEUE_ENDPOINT "tcp://localhost:5556"
+#define DEFAULT_DISPATCH_BUDGET 64
+#define DEFAULT_MAX_DECOMPRESSED_SIZE (64 * 1024 * 1024)
+
 /* Structure definitions */
 
 /**
  * SECTION: gppworker
  *
  * #GPPWorker receives requests from a #GPPQueue, transmits them
- * as a simple string to the user, and notifies the queue when the
- * user marks the task as done.
+ * as a simple string or as #GBytes to the user, and notifies the
+ * queue when the user marks the task as done.
+ *
+ * A worker can handle several tasks at the same time, see
+ * #GPPWorker:concurrency.
+ *
+ * How many tasks the worker handled and how long they took can be
+ * followed with gpp_worker_get_stats(), or from another process
+ * through #GPPWorker:stats-endpoint.
+ *
+ * Compressed requests are decompressed before being handed to the
+ * worker, and replies can be compressed in turn, see
+ * #GPPWorker:compression-threshold. Requests larger than
+ * #GPPWorker:max-decompressed-size once decompressed fail.
+ *
+ * Clients can send batches of small requests as a single message,
+ * workers implementing #GPPWorkerClass.handle_batch get them all at
+ * once, the other ones get their requests as separate tasks, no more
+ * of them at a time than #GPPWorker:concurrency allows. Either
+ * way the replies go back to the client as a single message.
+ *
+ * Large replies can be streamed to the client as they are produced
+ * with gpp_worker_send_partial(), instead of being held until the task
+ * is done.
  *
  * {{ ppworker.markdown }}
  */
 
 #define GET_PRIV(self) (gpp_worker_get_instance_private (GPP_WORKER (self)))
 
+enum
+{
+  PROP_0,
+  PROP_CONTEXT,
+  PROP_QUEUE_ENDPOINT,
+  PROP_CONCURRENCY,
+  PROP_DISPATCH_BUDGET,
+  PROP_STATS_ENDPOINT,
+  PROP_COMPRESSION_THRESHOLD,
+  PROP_MAX_DECOMPRESSED_SIZE,
+  PROP_RUNNING_TASKS,
+  PROP_HANDLED_TASKS,
+  PROP_FAILED_TASKS,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 typedef struct _GPPWorkerPrivate
 {
+  GPPContext *gpp_context;
   zctx_t *ctx;
 
+  gchar *queue_endpoint;
   void *frontend;
-  GIOChannel *frontend_channel;
   guint frontend_source;
+  guint dispatch_budget;
 
   guint liveness;
   guint interval;
-  zmsg_t *current_task;
+  guint heartbeat_source;
+  guint reconnect_source;
+
+  guint concurrency;
+  guint compression_threshold;
+  guint64 max_decompressed_size;
+  GHashTable *tasks;
+  guint next_task_id;
+
+  /* Statistics */
+  guint64 n_tasks;
+  guint64 n_succeeded;
+  guint64 n_failed;
+  guint64 n_reconnections;
+  /* From receiving a request to sending its reply */
+  GPPHistogram task_time;
+  gchar *stats_endpoint;
+  GPPStatsServer *stats_server;
 } GPPWorkerPrivate;
 
 G_DEFINE_TYPE_WITH_CODE (GPPWorker, gpp_worker, G_TYPE_OBJECT,
     G_ADD_PRIVATE (GPPWorker));
 
+typedef struct _Task Task;
+
+struct _Task
+{
+  /* Envelope and header of the request, NULL for items of a batch */
+  zmsg_t *msg;
+  /* Monotonic time past which the client gave up, 0 if never */
+  gint64 deadline;
+  gint64 received_at;
+  /* The trace context frame of @msg, if the request has one */
+  zframe_t *trace;
+  /* Whether the client can decompress the reply */
+  gboolean accepts_compressed;
+
+  /* Batches handled item by item keep their items and the replies
+   * to them, the items point back to their batch.
+   */
+  GPtrArray *items;
+  GPtrArray *replies;
+  guint next_item;
+  guint n_items_left;
+  gboolean starting_items;
+  Task *batch;
+  guint index;
+};
+
+static void
+task_free (Task *task)
+{
+  if (task->msg)
+    zmsg_destroy (&task->msg);
+  if (task->items)
+    g_ptr_array_unref (task->items);
+  if (task->replies)
+    g_ptr_array_unref (task->replies);
+  /* The last item of a batch takes it along */
+  if (task->batch && --task->batch->n_items_left == 0)
+    task_free (task->batch);
+  g_slice_free (Task, task);
+}
+
+static guint
+add_task (GPPWorker *self, Task *task)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  guint task_id = priv->next_task_id++;
+
+  if (priv->next_task_id == 0)
+    priv->next_task_id = 1;
+  g_hash_table_insert (priv->tasks, GUINT_TO_POINTER (task_id), task);
+
+  return task_id;
+}
+
+static gboolean
+handle_item (GPPWorker *self, guint task_id, GBytes *request)
+{
+  GPPWorkerClass *klass = GPP_WORKER_GET_CLASS (self);
+  gchar *request_string;
+  gboolean handled;
+
+  if (klass->handle_bytes)
+    return klass->handle_bytes (self, task_id, request);
+
+  request_string = g_strndup (g_bytes_get_data (request, NULL),
+      g_bytes_get_size (request));
+  handled = klass->handle_request (self, task_id, request_string);
+  g_free (request_string);
+
+  return handled;
+}
+
+/* Sends the reply of @task, which must have been removed from the
+ * tasks, and frees it.
+ */
+static void
+finish_task (GPPWorker *self, Task *task, GBytes *reply, gboolean success)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  zframe_t *header_frame;
+  gboolean compressed = FALSE;
+
+  gpp_histogram_record (&priv->task_time,
+      g_get_monotonic_time () - task->received_at);
+  if (success)
+    priv->n_succeeded++;
+  else
+    priv->n_failed++;
+
+  header_frame = gpp_msg_find_header (task->msg);
+  gpp_header_frame_set_status (header_frame,
+      success ? GPP_STATUS_OK : GPP_STATUS_KO);
+  gpp_header_frame_set_timeout (header_frame, 0);
+
+  /* The flags now describe the reply */
+  if (success && reply)
+    reply = gpp_bytes_compress (reply, task->accepts_compressed ?
+        priv->compression_threshold : 0, &compressed);
+  else
+    reply = NULL;
+  gpp_header_frame_set_flags (header_frame,
+      compressed ? GPP_HEADER_FLAG_COMPRESSED : 0);
+
+  if (task->trace) {
+    gpp_trace_frame_stamp (task->trace, GPP_HOP_WORKER_DONE);
+    gpp_trace_record_span (task->trace, "queue-to-worker",
+        GPP_HOP_QUEUE_DISPATCH, GPP_HOP_WORKER_RECEIVE);
+    gpp_trace_record_span (task->trace, "handle-request",
+        GPP_HOP_WORKER_RECEIVE, GPP_HOP_WORKER_DONE);
+  }
+  gpp_msg_send_with_payload (&task->msg, priv->frontend, reply);
+  if (reply)
+    g_bytes_unref (reply);
+  task_free (task);
+}
+
+/* Starts the next items of @batch, as many as the concurrency of the
+ * worker leaves room for, one at least if none of them runs. The
+ * caller holds one of the @batch->n_items_left counts, which keep the
+ * batch alive, the batch is answered once it releases the last one.
+ */
+static void
+continue_batch (GPPWorker *self, Task *batch)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+
+  /* Items done right away start the next ones from the loop below */
+  if (!batch->starting_items) {
+    batch->starting_items = TRUE;
+    while (batch->next_item < batch->items->len &&
+        (batch->n_items_left == 1 ||
+         g_hash_table_size (priv->tasks) < priv->concurrency)) {
+      Task *item = g_slice_new0 (Task);
+      guint item_id;
+
+      item->received_at = batch->received_at;
+      item->deadline = batch->deadline;
+      item->batch = batch;
+      item->index = batch->next_item++;
+      batch->n_items_left++;
+      item_id = add_task (self, item);
+
+      if (!handle_item (self, item_id,
+          g_ptr_array_index (batch->items, item->index)))
+        gpp_worker_set_task_done (self, item_id, NULL, FALSE);
+    }
+    batch->starting_items = FALSE;
+  }
+
+  if (--batch->n_items_left == 0) {
+    GBytes *replies = gpp_batch_encode (batch->replies);
+
+    finish_task (self, batch, replies, TRUE);
+    g_bytes_unref (replies);
+  }
+}
+
+static void
+set_item_done (GPPWorker *self, Task *item, GBytes *reply, gboolean success)
+{
+  Task *batch = item->batch;
+
+  if (success)
+    g_ptr_array_index (batch->replies, item->index) =
+        reply ? g_bytes_ref (reply) : g_bytes_new (NULL, 0);
+
+  /* Keeps the batch around for continue_batch() */
+  batch->n_items_left++;
+  task_free (item);
+  continue_batch (self, batch);
+}
+
+/* Workers that don't implement handle_batch get the items of batches
+ * as separate tasks, started as #GPPWorker:concurrency allows. The
+ * batch is answered once they are all done.
+ */
+static void
+handle_items (GPPWorker *self, guint task_id, GPtrArray *items)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  Task *batch = g_hash_table_lookup (priv->tasks, GUINT_TO_POINTER (task_id));
+
+  g_hash_table_steal (priv->tasks, GUINT_TO_POINTER (task_id));
+  batch->items = g_ptr_array_ref (items);
+  batch->replies = gpp_batch_new (items->len);
+  batch->n_items_left = 1;
+  continue_batch (self, batch);
+}
+
 /* Messaging */
 
 static void
+send_control (GPPWorker *self, const gchar *command)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  zmsg_t *msg = zmsg_new ();
+  zframe_t *credit_frame = gpp_uint32_to_frame (priv->concurrency);
+
+  zmsg_addmem (msg, command, 1);
+  zmsg_append (msg, &credit_frame);
+  zmsg_send (&msg, priv->frontend);
+}
+
+static gboolean
 handle_frontend (GPPWorker *self)
 {
   GPPWorkerPrivate *priv = GET_PRIV (self);
   GPPWorkerClass *klass = GPP_WORKER_GET_CLASS (self);
   zmsg_t *msg = zmsg_recv (priv->frontend);
   if (!msg)
-    return;
+    return G_SOURCE_CONTINUE;
+
+  if (zmsg_size (msg) > 1) {
+    zframe_t *header_frame = gpp_msg_find_header (msg);
+    GPPHeader header;
+    zframe_t *payload;
+    GBytes *request;
+    gboolean handled;
+    guint task_id;
+    Task *task;
+
+    if (!gpp_header_from_frame (header_frame, &header) ||
+        header_frame == zmsg_last (msg)) {
+      g_warning ("E: invalid message\n");
+      zmsg_dump (msg);
+      zmsg_destroy (&msg);
+      return G_SOURCE_CONTINUE;
+    }
+
+    /* The task only keeps the envelope, the header and the trace
+     * context around */
+    task = g_slice_new0 (Task);
+    task->trace = gpp_msg_find_trace (msg);
+    if (task->trace)
+      gpp_trace_frame_stamp (task->trace, GPP_HOP_WORKER_RECEIVE);
+
+    payload = zmsg_last (msg);
+    zmsg_remove (msg, payload);
+    request = gpp_bytes_new_from_frame (payload);
 
-  if (zmsg_size (msg) == 3) {
-    char *request = zframe_strdup (zmsg_last (msg));
     g_info ("I: normal reply\n");
     priv->liveness = HEARTBEAT_LIVENESS;
-    priv->current_task = msg;
-    if (!klass->handle_request (self, request))
-      gpp_worker_set_task_done (self, NULL, FALSE);
-    free (request);
-  } else {
-    if (zmsg_size (msg) == 1) {
-      zframe_t *frame = zmsg_first (msg);
-      if (memcmp (zframe_data (frame), PPP_HEARTBEAT, 1) == 0) {
-        priv->liveness = HEARTBEAT_LIVENESS;
-        g_debug ("got heartbeat from queue !\n");
+
+    task->msg = msg;
+    task->received_at = g_get_monotonic_time ();
+    task->accepts_compressed =
+        (header.flags & GPP_HEADER_FLAG_ACCEPTS_COMPRESSED) != 0;
+    if (header.timeout)
+      task->deadline = task->received_at
+          + header.timeout * G_TIME_SPAN_MILLISECOND;
+    task_id = add_task (self, task);
+    priv->n_tasks++;
+
+    if (header.flags & GPP_HEADER_FLAG_COMPRESSED) {
+      GBytes *compressed = request;
+      GError *error = NULL;
+
+      request = gpp_bytes_decompress (compressed,
+          priv->max_decompressed_size, &error);
+      g_bytes_unref (compressed);
+      if (!request) {
+        g_warning ("Could not decompress request: %s", error->message);
+        g_error_free (error);
+      }
+    }
+
+    if (!request) {
+      handled = FALSE;
+    } else if (header.flags & GPP_HEADER_FLAG_BATCH) {
+      GPtrArray *items = gpp_batch_decode (request);
+
+      if (!items) {
+        g_warning ("E: invalid batch\n");
+        handled = FALSE;
+      } else if (klass->handle_batch) {
+        handled = klass->handle_batch (self, task_id, items);
       } else {
-        g_warning ("E: invalid message\n");
-        zmsg_dump (msg);
+        handle_items (self, task_id, items);
+        handled = TRUE;
       }
-      zmsg_destroy (&msg);
+
+      if (items)
+        g_ptr_array_unref (items);
+    } else {
+      handled = handle_item (self, task_id, request);
     }
-    else {
+
+    if (!handled)
+      gpp_worker_set_task_done (self, task_id, NULL, FALSE);
+    if (request)
+      g_bytes_unref (request);
+  } else {
+    zframe_t *frame = zmsg_first (msg);
+    if (memcmp (zframe_data (frame), PPP_HEARTBEAT, 1) == 0) {
+      priv->liveness = HEARTBEAT_LIVENESS;
+      g_debug ("got heartbeat from queue !\n");
+    } else {
       g_warning ("E: invalid message\n");
       zmsg_dump (msg);
     }
+    zmsg_destroy (&msg);
   }
   priv->interval = INTERVAL_INIT;
-}
 
-static gboolean
-check_socket_activity(GIOChannel *channel, GIOCondition condition, GPPWorker *self)
-{
-  GPPWorkerPrivate *priv = GET_PRIV (self);
-  uint32_t status;
-  size_t sizeof_status = sizeof(status);
-  gboolean go_on;
-
-  /* FIXME : error handling here, not sure what to do */
-  go_on = FALSE;
-
-  if (zmq_getsockopt(priv->frontend, ZMQ_EVENTS, &status, &sizeof_status)) {
-    perror("retrieving event status");
-    return 0;
-  }
-
-  if ((status & ZMQ_POLLIN) != 0) {
-    go_on = TRUE;
-    handle_frontend (self);
-  }
-
-  return 1;
+  return G_SOURCE_CONTINUE;
 }
 
 /* Heartbeating / Reconnecting */
@@ -127,19 +437,17 @@ do_start (GPPWorker *self)
 {
   GPPWorkerPrivate *priv = GET_PRIV (self);
   priv->frontend = zsocket_new (priv->ctx, ZMQ_DEALER);
-  zsocket_connect (priv->frontend, "tcp://localhost:5556");
-  priv->frontend_channel = g_io_channel_from_zmq_socket (priv->frontend);
+  gpp_context_configure_socket (priv->gpp_context, priv->frontend);
+  zsocket_connect (priv->frontend, "%s", priv->queue_endpoint);
   priv->liveness = HEARTBEAT_LIVENESS;
-  priv->frontend_source = g_io_add_watch (priv->frontend_channel,
-      G_IO_IN, (GIOFunc) check_socket_activity, self);
-
-  g_timeout_add (HEARTBEAT_INTERVAL / 1000, (GSourceFunc) do_heartbeat, self);
+  priv->frontend_source = gpp_zmq_source_attach (priv->frontend,
+      priv->dispatch_budget, (GPPZmqSourceFunc) handle_frontend, self, NULL);
 
-  zframe_t *frame = zframe_new (PPP_READY, 1);
-  zframe_send (&frame, priv->frontend, 0);
+  priv->reconnect_source = 0;
+  priv->heartbeat_source = g_timeout_add (HEARTBEAT_INTERVAL / 1000,
+      (GSourceFunc) do_heartbeat, self);
 
-  /* We need to do that for some reason ... */
-  check_socket_activity (priv->frontend_channel, G_IO_IN, self);
+  send_control (self, PPP_READY);
 
   return FALSE;
 }
@@ -153,32 +461,158 @@ do_heartbeat (GPPWorker *self)
     g_warning ("W: reconnecting in %zd msec...\n", priv->interval);
     g_source_remove (priv->frontend_source);
     priv->frontend_source = 0;
-    g_io_channel_unref (priv->frontend_channel);
 
     if (priv->interval < INTERVAL_MAX)
       priv->interval *= 2;
 
+    /* The queue has KO'd these already */
+    priv->n_failed += g_hash_table_size (priv->tasks);
+    g_hash_table_remove_all (priv->tasks);
+    priv->n_reconnections++;
+
     zsocket_destroy (priv->ctx, priv->frontend);
-    g_timeout_add (priv->interval, (GSourceFunc) do_start, self);
+    priv->heartbeat_source = 0;
+    priv->reconnect_source = g_timeout_add (priv->interval,
+        (GSourceFunc) do_start, self);
     return FALSE;
   }
 
-  zframe_t *frame = zframe_new (PPP_HEARTBEAT, 1);
-  zframe_send (&frame, priv->frontend, 0);
-  /* We need to do that for some reason ... */
-  check_socket_activity (priv->frontend_channel, G_IO_IN, self);
+  send_control (self, PPP_HEARTBEAT);
   return TRUE;
 }
 
 /* GObject */
 
+static void
+gpp_worker_set_property (GObject *object, guint prop_id,
+    const GValue *value, GParamSpec *pspec)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (object);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      priv->gpp_context = g_value_dup_object (value);
+      if (!priv->gpp_context)
+        priv->gpp_context = g_object_ref (gpp_context_get_default ());
+      break;
+    case PROP_QUEUE_ENDPOINT:
+      g_free (priv->queue_endpoint);
+      priv->queue_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_CONCURRENCY:
+      priv->concurrency = g_value_get_uint (value);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      priv->dispatch_budget = g_value_get_uint (value);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_free (priv->stats_endpoint);
+      priv->stats_endpoint = g_value_dup_string (value);
+      break;
+    case PROP_COMPRESSION_THRESHOLD:
+      priv->compression_threshold = g_value_get_uint (value);
+      break;
+    case PROP_MAX_DECOMPRESSED_SIZE:
+      priv->max_decompressed_size = g_value_get_uint64 (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gpp_worker_get_property (GObject *object, guint prop_id,
+    GValue *value, GParamSpec *pspec)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (object);
+
+  switch (prop_id) {
+    case PROP_CONTEXT:
+      g_value_set_object (value, priv->gpp_context);
+      break;
+    case PROP_QUEUE_ENDPOINT:
+      g_value_set_string (value, priv->queue_endpoint);
+      break;
+    case PROP_CONCURRENCY:
+      g_value_set_uint (value, priv->concurrency);
+      break;
+    case PROP_DISPATCH_BUDGET:
+      g_value_set_uint (value, priv->dispatch_budget);
+      break;
+    case PROP_STATS_ENDPOINT:
+      g_value_set_string (value, priv->stats_endpoint);
+      break;
+    case PROP_COMPRESSION_THRESHOLD:
+      g_value_set_uint (value, priv->compression_threshold);
+      break;
+    case PROP_MAX_DECOMPRESSED_SIZE:
+      g_value_set_uint64 (value, priv->max_decompressed_size);
+      break;
+    case PROP_RUNNING_TASKS:
+      g_value_set_uint (value, g_hash_table_size (priv->tasks));
+      break;
+    case PROP_HANDLED_TASKS:
+      g_value_set_uint64 (value, priv->n_succeeded);
+      break;
+    case PROP_FAILED_TASKS:
+      g_value_set_uint64 (value, priv->n_failed);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+constructed (GObject *object)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (object);
+
+  priv->ctx = gpp_context_new_zctx (priv->gpp_context);
+
+  G_OBJECT_CLASS (gpp_worker_parent_class)->constructed (object);
+}
+
 static void
 dispose (GObject *object)
 {
   GPPWorker *self = GPP_WORKER (object);
   GPPWorkerPrivate *priv = GET_PRIV (self);
 
+  if (priv->heartbeat_source) {
+    g_source_remove (priv->heartbeat_source);
+    priv->heartbeat_source = 0;
+  }
+
+  if (priv->reconnect_source) {
+    g_source_remove (priv->reconnect_source);
+    priv->reconnect_source = 0;
+  }
+
+  /* It polls the frontend, which goes away with the zctx */
+  if (priv->frontend_source) {
+    g_source_remove (priv->frontend_source);
+    priv->frontend_source = 0;
+  }
+
+  g_clear_pointer (&priv->stats_server, gpp_stats_server_free);
+  g_clear_pointer (&priv->tasks, g_hash_table_unref);
   zctx_destroy (&priv->ctx);
+  g_clear_object (&priv->gpp_context);
+
+  G_OBJECT_CLASS (gpp_worker_parent_class)->dispose (object);
+}
+
+static void
+finalize (GObject *object)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (object);
+
+  g_free (priv->queue_endpoint);
+  g_free (priv->stats_endpoint);
+
+  G_OBJECT_CLASS (gpp_worker_parent_class)->finalize (object);
 }
 
 static void
@@ -187,7 +621,129 @@ gpp_worker_class_init (GPPWorkerClass *klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
   klass->handle_request = NULL;
+  klass->handle_bytes = NULL;
+  gobject_class->constructed = constructed;
   gobject_class->dispose = dispose;
+  gobject_class->finalize = finalize;
+  gobject_class->set_property = gpp_worker_set_property;
+  gobject_class->get_property = gpp_worker_get_property;
+
+  /**
+   * GPPWorker:context:
+   *
+   * The #GPPContext the worker creates its socket in, %NULL
+   * meaning the default one.
+   */
+  properties[PROP_CONTEXT] =
+      g_param_spec_object ("context", "Context",
+      "The context sockets are created in", GPP_TYPE_CONTEXT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:queue-endpoint:
+   *
+   * The endpoint the #GPPQueue:backend-endpoint of the queue can be
+   * reached at, for example inproc://workers if the queue bound
+   * that in the same process.
+   */
+  properties[PROP_QUEUE_ENDPOINT] =
+      g_param_spec_string ("queue-endpoint", "Queue endpoint",
+      "Endpoint of the queue", DEFAULT_QUEUE_ENDPOINT,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:concurrency:
+   *
+   * The number of tasks the worker accepts to handle at the same
+   * time, it is advertised to the #GPPQueue along with heartbeats.
+   */
+  properties[PROP_CONCURRENCY] =
+      g_param_spec_uint ("concurrency", "Concurrency",
+      "Number of tasks handled concurrently", 1, G_MAXUINT32, 1,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:dispatch-budget:
+   *
+   * How many requests are read in a row before other sources of
+   * the main loop get to run, 0 meaning as many as are waiting.
+   * Taken into account the next time the worker connects.
+   */
+  properties[PROP_DISPATCH_BUDGET] =
+      g_param_spec_uint ("dispatch-budget", "Dispatch budget",
+      "Maximum number of messages read in a row", 0, G_MAXUINT,
+      DEFAULT_DISPATCH_BUDGET,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:stats-endpoint:
+   *
+   * If set, the worker binds a REP socket to this endpoint when first
+   * started, and answers any message sent to it with the snapshot
+   * returned by gpp_worker_get_stats(), in the #GVariant text format.
+   */
+  properties[PROP_STATS_ENDPOINT] =
+      g_param_spec_string ("stats-endpoint", "Stats endpoint",
+      "Endpoint serving statistics snapshots", NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:compression-threshold:
+   *
+   * The size in bytes from which replies are compressed with zlib, 0
+   * to never compress them. Replies are only compressed for clients
+   * that advertise they can decompress them, and when that makes them
+   * smaller.
+   */
+  properties[PROP_COMPRESSION_THRESHOLD] =
+      g_param_spec_uint ("compression-threshold", "Compression threshold",
+      "Size from which replies are compressed", 0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:max-decompressed-size:
+   *
+   * The size in bytes past which a compressed request isn't
+   * decompressed, the task fails instead, 0 for no limit.
+   */
+  properties[PROP_MAX_DECOMPRESSED_SIZE] =
+      g_param_spec_uint64 ("max-decompressed-size", "Max decompressed size",
+      "Size past which compressed requests are rejected", 0, G_MAXUINT64,
+      DEFAULT_MAX_DECOMPRESSED_SIZE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:running-tasks:
+   *
+   * The number of tasks currently being handled.
+   */
+  properties[PROP_RUNNING_TASKS] =
+      g_param_spec_uint ("running-tasks", "Running tasks",
+      "Number of tasks being handled", 0, G_MAXUINT, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:handled-tasks:
+   *
+   * The number of tasks successfully handled so far.
+   */
+  properties[PROP_HANDLED_TASKS] =
+      g_param_spec_uint64 ("handled-tasks", "Handled tasks",
+      "Number of tasks successfully handled", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * GPPWorker:failed-tasks:
+   *
+   * The number of tasks that failed, or were dropped when the
+   * connection to the queue was lost.
+   */
+  properties[PROP_FAILED_TASKS] =
+      g_param_spec_uint64 ("failed-tasks", "Failed tasks",
+      "Number of tasks that failed", 0, G_MAXUINT64, 0,
+      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPERTIES, properties);
 }
 
 static void
@@ -195,7 +751,10 @@ gpp_worker_init (GPPWorker *self)
 {
   GPPWorkerPrivate *priv = GET_PRIV (self);
   priv->interval = INTERVAL_INIT;
-  priv->ctx = zctx_new ();
+  priv->tasks = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) task_free);
+  priv->next_task_id = 1;
+  gpp_histogram_reset (&priv->task_time);
 }
 
 /* API */
@@ -203,6 +762,7 @@ gpp_worker_init (GPPWorker *self)
 /**
  * gpp_worker_set_task_done:
  * @self: A #GPPWorker.
+ * @task_id: The identifier of the task, as passed to #GPPWorkerClass.handle_request.
  * @reply: (allow-none): A string that will be passed to the client.
  * @success: Whether the task was successfully handled.
  *
@@ -211,26 +771,222 @@ gpp_worker_init (GPPWorker *self)
  * Returns: %TRUE if the task was marked as done, %FALSE otherwise.
  */
 gboolean
-gpp_worker_set_task_done (GPPWorker *self, const gchar *reply, gboolean success)
+gpp_worker_set_task_done (GPPWorker *self, guint task_id, const gchar *reply,
+    gboolean success)
+{
+  GBytes *reply_bytes = NULL;
+  gboolean ret;
+
+  if (reply)
+    reply_bytes = g_bytes_new (reply, strlen (reply) + 1);
+
+  ret = gpp_worker_set_task_done_bytes (self, task_id, reply_bytes, success);
+
+  if (reply_bytes)
+    g_bytes_unref (reply_bytes);
+
+  return ret;
+}
+
+/**
+ * gpp_worker_set_task_done_bytes:
+ * @self: A #GPPWorker.
+ * @task_id: The identifier of the task, as passed to #GPPWorkerClass.handle_bytes.
+ * @reply: (allow-none): The data that will be passed to the client.
+ * @success: Whether the task was successfully handled.
+ *
+ * Like gpp_worker_set_task_done(), @reply is sent without being copied,
+ * unless it is compressed, see #GPPWorker:compression-threshold, and
+ * must not be modified afterwards.
+ *
+ * Returns: %TRUE if the task was marked as done, %FALSE otherwise.
+ */
+gboolean
+gpp_worker_set_task_done_bytes (GPPWorker *self, guint task_id, GBytes *reply,
+    gboolean success)
 {
   GPPWorkerPrivate *priv = GET_PRIV (self);
-  zframe_t *request_frame = zmsg_last (priv->current_task);
+  Task *task;
 
-  if (!priv->current_task)
+  /* Tasks done after dispose have nowhere to go */
+  if (!priv->tasks)
     return FALSE;
 
-  if (!success) {
-    zframe_reset (request_frame, PPP_KO, 1);
-  } else {
-    zframe_reset (request_frame, reply, strlen (reply) + 1);
+  task = g_hash_table_lookup (priv->tasks, GUINT_TO_POINTER (task_id));
+  if (!task)
+    return FALSE;
+
+  g_hash_table_steal (priv->tasks, GUINT_TO_POINTER (task_id));
+
+  if (task->batch)
+    set_item_done (self, task, reply, success);
+  else
+    finish_task (self, task, reply, success);
+
+  return TRUE;
+}
+
+/**
+ * gpp_worker_send_partial:
+ * @self: A #GPPWorker.
+ * @task_id: The identifier of a task being handled.
+ * @chunk: The next chunk of the reply.
+ *
+ * Sends a chunk of the reply to the client right away, which gets it
+ * through #GPPClient::request-progress. The task is still to be
+ * marked as done with gpp_worker_set_task_done() or
+ * gpp_worker_set_task_done_bytes(), possibly without a reply. The
+ * client gets the chunks again if the task fails and it retries it.
+ *
+ * Like with gpp_worker_set_task_done_bytes(), @chunk is sent without
+ * being copied unless it is compressed, and must not be modified
+ * afterwards. The requests of
+ * batches handled one by one can't be streamed.
+ *
+ * Returns: %TRUE if the chunk was sent, %FALSE otherwise.
+ */
+gboolean
+gpp_worker_send_partial (GPPWorker *self, guint task_id, GBytes *chunk)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  zframe_t *header_frame, *frame;
+  gboolean compressed;
+  zmsg_t *msg;
+  Task *task;
+
+  g_return_val_if_fail (chunk != NULL, FALSE);
+
+  if (!priv->tasks)
+    return FALSE;
+
+  task = g_hash_table_lookup (priv->tasks, GUINT_TO_POINTER (task_id));
+  if (!task || task->batch)
+    return FALSE;
+
+  /* The envelope and the header, without the trace context */
+  msg = zmsg_new ();
+  header_frame = gpp_msg_find_header (task->msg);
+  for (frame = zmsg_first (task->msg); frame; frame = zmsg_next (task->msg)) {
+    zframe_t *dup = zframe_dup (frame);
+
+    zmsg_append (msg, &dup);
+    if (frame == header_frame)
+      break;
   }
 
-  zmsg_send (&priv->current_task, priv->frontend);
-  priv->current_task = NULL;
-  check_socket_activity (priv->frontend_channel, G_IO_IN, self);
+  chunk = gpp_bytes_compress (chunk, task->accepts_compressed ?
+      priv->compression_threshold : 0, &compressed);
+  header_frame = zmsg_last (msg);
+  gpp_header_frame_set_status (header_frame, GPP_STATUS_PARTIAL);
+  gpp_header_frame_set_timeout (header_frame, 0);
+  gpp_header_frame_set_flags (header_frame,
+      compressed ? GPP_HEADER_FLAG_COMPRESSED : 0);
+  gpp_msg_send_with_payload (&msg, priv->frontend, chunk);
+  g_bytes_unref (chunk);
+
+  return TRUE;
+}
+
+/**
+ * gpp_worker_set_batch_done:
+ * @self: A #GPPWorker.
+ * @task_id: The identifier of the batch, as passed to #GPPWorkerClass.handle_batch.
+ * @replies: (element-type GBytes) (allow-none): The replies to the
+ * requests of the batch, in the same order, %NULL for the requests
+ * that failed.
+ * @success: Whether the batch was handled, if %FALSE the client
+ * retries all of its requests.
+ *
+ * Call this function when your worker has finished handling a batch,
+ * the replies are sent back as a single message.
+ *
+ * Returns: %TRUE if the batch was marked as done, %FALSE otherwise.
+ */
+gboolean
+gpp_worker_set_batch_done (GPPWorker *self, guint task_id, GPtrArray *replies,
+    gboolean success)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  GBytes *reply = NULL;
+  Task *task;
+
+  if (!priv->tasks)
+    return FALSE;
+
+  task = g_hash_table_lookup (priv->tasks, GUINT_TO_POINTER (task_id));
+  if (!task || task->batch)
+    return FALSE;
+
+  g_return_val_if_fail (replies != NULL || !success, FALSE);
+
+  g_hash_table_steal (priv->tasks, GUINT_TO_POINTER (task_id));
+
+  if (success)
+    reply = gpp_batch_encode (replies);
+  finish_task (self, task, reply, success);
+  if (reply)
+    g_bytes_unref (reply);
+
   return TRUE;
 }
 
+/**
+ * gpp_worker_get_task_remaining_time:
+ * @self: A #GPPWorker.
+ * @task_id: The identifier of a task being handled.
+ *
+ * Clients can give their requests a time budget, after which they
+ * consider them failed, use this to know how much of it is left.
+ *
+ * Returns: The remaining time in microseconds, 0 if the budget of the
+ * task is exhausted, or -1 if it has none or @task_id is unknown.
+ */
+gint64
+gpp_worker_get_task_remaining_time (GPPWorker *self, guint task_id)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  Task *task = g_hash_table_lookup (priv->tasks, GUINT_TO_POINTER (task_id));
+
+  if (!task || !task->deadline)
+    return -1;
+
+  return MAX (0, task->deadline - g_get_monotonic_time ());
+}
+
+/**
+ * gpp_worker_get_stats:
+ * @self: A #GPPWorker.
+ *
+ * Takes a snapshot of the statistics of @self, as a dictionary
+ * mapping names to values: the task counters, the number of times
+ * the worker lost the queue, and the histogram of the time it took
+ * to handle tasks ("task-time"), in microseconds.
+ *
+ * Returns: (transfer full): A #GVariant of type a{sv}
+ */
+GVariant *
+gpp_worker_get_stats (GPPWorker *self)
+{
+  GPPWorkerPrivate *priv = GET_PRIV (self);
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "tasks",
+      g_variant_new_uint64 (priv->n_tasks));
+  g_variant_builder_add (&builder, "{sv}", "running-tasks",
+      g_variant_new_uint32 (g_hash_table_size (priv->tasks)));
+  g_variant_builder_add (&builder, "{sv}", "handled-tasks",
+      g_variant_new_uint64 (priv->n_succeeded));
+  g_variant_builder_add (&builder, "{sv}", "failed-tasks",
+      g_variant_new_uint64 (priv->n_failed));
+  g_variant_builder_add (&builder, "{sv}", "reconnections",
+      g_variant_new_uint64 (priv->n_reconnections));
+  g_variant_builder_add (&builder, "{sv}", "task-time",
+      gpp_histogram_to_variant (&priv->task_time));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 /**
  * gpp_worker_start:
  * @self: A #GPPWorker that will start handling requests.
@@ -247,9 +1003,14 @@ gpp_worker_start (GPPWorker *self)
   if (priv->frontend_source)
     return FALSE;
 
-  if (!klass->handle_request)
+  if (!klass->handle_request && !klass->handle_bytes)
     return FALSE;
 
+  if (priv->stats_endpoint && !priv->stats_server)
+    priv->stats_server = gpp_stats_server_new (priv->ctx,
+        priv->stats_endpoint, (GPPStatsFunc) gpp_worker_get_stats, self,
+        NULL);
+
   do_start (self);
 
   return TRUE;
@@ -16,19 +16,57 @@ struct _GPPWorkerClass
   /**
    * GPPWorkerClass::handle_request:
    * @self: the #GPPWorker
+   * @task_id: The identifier of the task
    * @request: The request to handle
    *
    * Implement this method to handle requests, requests *MUST* be
    * handled asynchronously as this method should not block, call
-   * gpp_worker_set_task_done() when the request has been handled.
+   * gpp_worker_set_task_done() with @task_id when the request has
+   * been handled.
    *
    * Returns: %TRUE if the worker can handle that request, %FALSE otherwise.
    */
-  gboolean (*handle_request) (GPPWorker *self, const gchar *request);
+  gboolean (*handle_request) (GPPWorker *self, guint task_id, const gchar *request);
+
+  /**
+   * GPPWorkerClass::handle_bytes:
+   * @self: the #GPPWorker
+   * @task_id: The identifier of the task
+   * @request: The request to handle, take a reference to keep it around
+   *
+   * Like #GPPWorkerClass.handle_request, but @request is passed as is,
+   * without being copied. It is used instead of handle_request when
+   * implemented, call gpp_worker_set_task_done_bytes() when the request
+   * has been handled.
+   *
+   * Returns: %TRUE if the worker can handle that request, %FALSE otherwise.
+   */
+  gboolean (*handle_bytes) (GPPWorker *self, guint task_id, GBytes *request);
+
+  /**
+   * GPPWorkerClass::handle_batch:
+   * @self: the #GPPWorker
+   * @task_id: The identifier of the batch
+   * @requests: (element-type GBytes): The requests of the batch, take
+   * a reference to keep them around
+   *
+   * Implement this method to handle the batches sent with
+   * gpp_client_send_batch() at once, call gpp_worker_set_batch_done()
+   * with @task_id when they have been handled. When it isn't
+   * implemented, each request of a batch is handled as a separate task.
+   *
+   * Returns: %TRUE if the worker can handle that batch, %FALSE otherwise.
+   */
+  gboolean (*handle_batch) (GPPWorker *self, guint task_id, GPtrArray *requests);
 };
 
 GPPWorker * gpp_worker_new (void);
 gboolean gpp_worker_start (GPPWorker *self);
-gboolean gpp_worker_set_task_done (GPPWorker *self, const gchar *reply, gboolean success);
+gboolean gpp_worker_set_task_done (GPPWorker *self, guint task_id, const gchar *reply, gboolean success);
+gboolean gpp_worker_set_task_done_bytes (GPPWorker *self, guint task_id, GBytes *reply, gboolean success);
+gboolean gpp_worker_send_partial (GPPWorker *self, guint task_id, GBytes *chunk);
+gboolean gpp_worker_set_batch_done (GPPWorker *self, guint task_id, GPtrArray *replies, gboolean success);
+gint64 gpp_worker_get_task_remaining_time (GPPWorker *self, guint task_id);
+GVariant * gpp_worker_get_stats (GPPWorker *self);
 
 #endif
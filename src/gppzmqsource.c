@@ -0,0 +1,120 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <zmq.h>
+
+#include "gppzmqsource.h"
+
+typedef struct {
+  GSource source;
+  void *socket;
+  guint budget;
+} GPPZmqSource;
+
+static gboolean
+socket_is_readable (void *socket)
+{
+  uint32_t events;
+  size_t sizeof_events = sizeof (events);
+
+  /* Fails once the context is terminated, nothing left to read then */
+  if (zmq_getsockopt (socket, ZMQ_EVENTS, &events, &sizeof_events))
+    return FALSE;
+
+  return (events & ZMQ_POLLIN) != 0;
+}
+
+static gboolean
+gpp_zmq_source_prepare (GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return socket_is_readable (((GPPZmqSource *) source)->socket);
+}
+
+static gboolean
+gpp_zmq_source_check (GSource *source)
+{
+  return socket_is_readable (((GPPZmqSource *) source)->socket);
+}
+
+/* Stops after budget messages even if more are waiting, prepare
+ * will tell the main loop to come back to us right away, once the
+ * other sources had their turn.
+ */
+static gboolean
+gpp_zmq_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  GPPZmqSource *self = (GPPZmqSource *) source;
+  GPPZmqSourceFunc func = (GPPZmqSourceFunc) callback;
+  guint n_dispatched = 0;
+
+  if (!func)
+    return G_SOURCE_REMOVE;
+
+  do {
+    if (!func (user_data))
+      return G_SOURCE_REMOVE;
+  } while (++n_dispatched != self->budget && socket_is_readable (self->socket));
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs gpp_zmq_source_funcs = {
+  gpp_zmq_source_prepare,
+  gpp_zmq_source_check,
+  gpp_zmq_source_dispatch,
+  NULL
+};
+
+GSource *
+gpp_zmq_source_new (void *socket, guint budget)
+{
+  GSource *source = g_source_new (&gpp_zmq_source_funcs, sizeof (GPPZmqSource));
+  GPPZmqSource *self = (GPPZmqSource *) source;
+  int fd;
+  size_t sizeof_fd = sizeof (fd);
+
+  self->socket = socket;
+  self->budget = budget;
+
+  if (zmq_getsockopt (socket, ZMQ_FD, &fd, &sizeof_fd))
+    perror ("retrieving zmq fd");
+  else
+    g_source_add_unix_fd (source, fd, G_IO_IN);
+
+  g_source_set_name (source, "GPPZmqSource");
+
+  return source;
+}
+
+/* Like g_io_add_watch(), for @context, %NULL meaning the default one */
+guint
+gpp_zmq_source_attach (void *socket, guint budget, GPPZmqSourceFunc func,
+    gpointer user_data, GMainContext *context)
+{
+  GSource *source = gpp_zmq_source_new (socket, budget);
+  guint id;
+
+  g_source_set_callback (source, (GSourceFunc) func, user_data, NULL);
+  id = g_source_attach (source, context);
+  g_source_unref (source);
+
+  return id;
+}
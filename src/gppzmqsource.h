@@ -0,0 +1,23 @@
+#ifndef _GPP_ZMQ_SOURCE
+#define _GPP_ZMQ_SOURCE
+
+#include <glib.h>
+
+/* A source dispatched while a zeromq socket has messages to read.
+ *
+ * The file descriptor zeromq exposes is edge-triggered, and only
+ * tells that the state of the socket may have changed, so the source
+ * asks the socket itself whether it is readable every time the main
+ * loop polls, which also covers messages that arrived while we were
+ * sending.
+ */
+
+/* Called once per message to read, return %FALSE to remove the source */
+typedef gboolean (*GPPZmqSourceFunc) (gpointer user_data);
+
+/* A budget of 0 means the socket is drained at each dispatch */
+GSource * gpp_zmq_source_new (void *socket, guint budget);
+guint gpp_zmq_source_attach (void *socket, guint budget,
+    GPPZmqSourceFunc func, gpointer user_data, GMainContext *context);
+
+#endif
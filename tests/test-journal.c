@@ -0,0 +1,271 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+
+#include "gpputils.h"
+#include "gppjournal.h"
+
+/* The size of the header of a record, and of the time a request was
+ * accepted at, see gppjournal.c
+ */
+#define JOURNAL_HEADER_SIZE 16
+#define RECORD_OVERHEAD     (17 + 8)
+
+typedef struct {
+  gchar *dir;
+  gchar *path;
+} Fixture;
+
+static void
+fixture_set_up (Fixture *fixture, gconstpointer data)
+{
+  fixture->dir = g_dir_make_tmp ("gpp-journal-XXXXXX", NULL);
+  g_assert_nonnull (fixture->dir);
+  fixture->path = g_build_filename (fixture->dir, "journal", NULL);
+}
+
+static void
+fixture_tear_down (Fixture *fixture, gconstpointer data)
+{
+  gchar *tmp_path = g_strconcat (fixture->path, ".tmp", NULL);
+
+  g_remove (fixture->path);
+  g_remove (tmp_path);
+  g_rmdir (fixture->dir);
+  g_free (tmp_path);
+  g_free (fixture->path);
+  g_free (fixture->dir);
+}
+
+static zmsg_t *
+make_message (const gchar *client, guint32 request_id, GPPStatus status,
+    const gchar *payload)
+{
+  zmsg_t *msg = zmsg_new ();
+  GPPHeader header = { 0, };
+  zframe_t *frame;
+
+  header.request_id = request_id;
+  header.status = status;
+  frame = gpp_header_to_frame (&header);
+
+  zmsg_addstr (msg, client);
+  zmsg_addmem (msg, NULL, 0);
+  zmsg_append (msg, &frame);
+  zmsg_addstr (msg, payload);
+
+  return msg;
+}
+
+static void
+accept_request (GPPJournal *journal, const gchar *client, guint32 request_id)
+{
+  zmsg_t *msg = make_message (client, request_id, GPP_STATUS_REQUEST,
+      "request");
+
+  gpp_journal_accept (journal, msg);
+  zmsg_destroy (&msg);
+}
+
+static void
+complete_request (GPPJournal *journal, const gchar *client,
+    guint32 request_id)
+{
+  zmsg_t *msg = make_message (client, request_id, GPP_STATUS_OK, "reply");
+
+  gpp_journal_complete (journal, msg);
+  zmsg_destroy (&msg);
+}
+
+static gsize
+record_size (const gchar *client)
+{
+  zmsg_t *msg = make_message (client, 0, GPP_STATUS_REQUEST, "request");
+  gsize size = RECORD_OVERHEAD;
+  zframe_t *frame;
+
+  for (frame = zmsg_first (msg); frame; frame = zmsg_next (msg))
+    size += 4 + zframe_size (frame);
+  zmsg_destroy (&msg);
+
+  return size;
+}
+
+static void
+collect_request_id (zmsg_t *msg, gint64 accepted_at, GArray *ids)
+{
+  GPPHeader header;
+
+  g_assert_true (gpp_header_from_frame (gpp_msg_find_header (msg), &header));
+  g_assert_cmpint (header.status, ==, GPP_STATUS_REQUEST);
+  g_assert_cmpint (accepted_at, >, 0);
+  g_array_append_val (ids, header.request_id);
+  zmsg_destroy (&msg);
+}
+
+/* Opens the journal at @path, and returns the ids of the requests it
+ * replays, which stay in it.
+ */
+static GPPJournal *
+open_and_replay (const gchar *path, GArray **ids)
+{
+  GError *error = NULL;
+  GPPJournal *journal = gpp_journal_open (path, &error);
+
+  g_assert_no_error (error);
+  g_assert_nonnull (journal);
+
+  *ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+  gpp_journal_replay (journal, (GPPJournalFunc) collect_request_id, *ids);
+
+  return journal;
+}
+
+/* A child process exits without closing the journal, as if it had
+ * crashed. What it wrote to the mapping outlives it in the page cache,
+ * this covers crashes of the process, not losing power.
+ */
+static void
+test_replay_after_crash (Fixture *fixture, gconstpointer data)
+{
+  GPPJournal *journal;
+  GArray *ids;
+  gint status;
+  pid_t pid;
+
+  pid = fork ();
+  g_assert_cmpint (pid, >=, 0);
+  if (pid == 0) {
+    journal = open_and_replay (fixture->path, &ids);
+    g_assert_cmpuint (ids->len, ==, 0);
+
+    accept_request (journal, "client-a", 1);
+    accept_request (journal, "client-a", 2);
+    accept_request (journal, "client-b", 1);
+    complete_request (journal, "client-a", 2);
+    _exit (0);
+  }
+
+  g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+  g_assert_true (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 2);
+  g_assert_cmpuint (g_array_index (ids, guint32, 0), ==, 1);
+  g_assert_cmpuint (g_array_index (ids, guint32, 1), ==, 1);
+  g_array_unref (ids);
+
+  gpp_journal_free (journal);
+}
+
+/* A record the process didn't finish writing is ignored, along with
+ * what follows it, and the next records overwrite it.
+ */
+static void
+test_torn_record (Fixture *fixture, gconstpointer data)
+{
+  GPPJournal *journal;
+  GArray *ids;
+  guint8 byte;
+  gsize last;
+  gint fd;
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_array_unref (ids);
+  accept_request (journal, "client-a", 1);
+  accept_request (journal, "client-a", 2);
+  gpp_journal_free (journal);
+
+  /* Damages the last byte of the second record */
+  last = JOURNAL_HEADER_SIZE + 2 * record_size ("client-a") - 1;
+  fd = open (fixture->path, O_RDWR);
+  g_assert_cmpint (fd, >=, 0);
+  g_assert_cmpint (pread (fd, &byte, 1, last), ==, 1);
+  byte ^= 0xff;
+  g_assert_cmpint (pwrite (fd, &byte, 1, last), ==, 1);
+  close (fd);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 1);
+  g_assert_cmpuint (g_array_index (ids, guint32, 0), ==, 1);
+  g_array_unref (ids);
+  accept_request (journal, "client-a", 3);
+  gpp_journal_free (journal);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 2);
+  g_assert_cmpuint (g_array_index (ids, guint32, 0), ==, 1);
+  g_assert_cmpuint (g_array_index (ids, guint32, 1), ==, 3);
+  g_array_unref (ids);
+  gpp_journal_free (journal);
+}
+
+/* Requests are told apart by their envelope and their request id */
+static void
+test_accept_complete_dedup (Fixture *fixture, gconstpointer data)
+{
+  GPPJournal *journal;
+  GArray *ids;
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_array_unref (ids);
+  accept_request (journal, "client-a", 1);
+  accept_request (journal, "client-a", 1);
+  accept_request (journal, "client-b", 1);
+  complete_request (journal, "client-c", 1);
+  gpp_journal_free (journal);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 2);
+  g_array_unref (ids);
+  complete_request (journal, "client-a", 1);
+  complete_request (journal, "client-a", 1);
+  gpp_journal_free (journal);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 1);
+  g_array_unref (ids);
+  complete_request (journal, "client-b", 1);
+  g_assert_true (gpp_journal_commit (journal));
+  gpp_journal_free (journal);
+
+  journal = open_and_replay (fixture->path, &ids);
+  g_assert_cmpuint (ids->len, ==, 0);
+  g_array_unref (ids);
+  gpp_journal_free (journal);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/journal/replay-after-crash", Fixture, NULL,
+      fixture_set_up, test_replay_after_crash, fixture_tear_down);
+  g_test_add ("/journal/torn-record", Fixture, NULL,
+      fixture_set_up, test_torn_record, fixture_tear_down);
+  g_test_add ("/journal/accept-complete-dedup", Fixture, NULL,
+      fixture_set_up, test_accept_complete_dedup, fixture_tear_down);
+
+  return g_test_run ();
+}
@@ -0,0 +1,112 @@
+/* GObject Paranoid Pirate
+ * Copyright (C) 2015 Mathieu Duponchelle <mathieu.duponchelle@opencreed.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "gpptimerwheel.h"
+
+#define RESOLUTION (100 * G_TIME_SPAN_MILLISECOND)
+
+static void
+count_fired (GPPTimer *timer, guint *n_fired)
+{
+  (*n_fired)++;
+}
+
+/* A timer due in the middle of a tick fires once that tick elapsed,
+ * not a revolution later.
+ */
+static void
+test_deadline_mid_tick (void)
+{
+  guint n_fired = 0;
+  GPPTimerWheel *wheel = gpp_timer_wheel_new (RESOLUTION,
+      (GPPTimerFunc) count_fired, &n_fired);
+  GPPTimer timer = { { NULL, }, };
+  gint64 now = g_get_monotonic_time ();
+  gint64 deadline = (now / RESOLUTION + 3) * RESOLUTION + RESOLUTION / 2;
+
+  gpp_timer_wheel_schedule (wheel, &timer, deadline);
+
+  gpp_timer_wheel_advance (wheel, deadline - RESOLUTION);
+  g_assert_cmpuint (n_fired, ==, 0);
+  gpp_timer_wheel_advance (wheel, deadline - 1);
+  g_assert_cmpuint (n_fired, ==, 0);
+
+  gpp_timer_wheel_advance (wheel, deadline + RESOLUTION);
+  g_assert_cmpuint (n_fired, ==, 1);
+  g_assert_false (timer.scheduled);
+
+  gpp_timer_wheel_advance (wheel, deadline + 100 * RESOLUTION);
+  g_assert_cmpuint (n_fired, ==, 1);
+
+  gpp_timer_wheel_free (wheel);
+}
+
+/* Timers due further than one revolution away wait for their turn */
+static void
+test_deadline_next_revolution (void)
+{
+  guint n_fired = 0;
+  GPPTimerWheel *wheel = gpp_timer_wheel_new (RESOLUTION,
+      (GPPTimerFunc) count_fired, &n_fired);
+  GPPTimer timer = { { NULL, }, };
+  gint64 now = g_get_monotonic_time ();
+  gint64 deadline = now + 100 * RESOLUTION + RESOLUTION / 3;
+  gint64 t;
+
+  gpp_timer_wheel_schedule (wheel, &timer, deadline);
+
+  for (t = now; t < deadline; t += RESOLUTION / 2)
+    gpp_timer_wheel_advance (wheel, t);
+  g_assert_cmpuint (n_fired, ==, 0);
+
+  gpp_timer_wheel_advance (wheel, deadline + RESOLUTION);
+  g_assert_cmpuint (n_fired, ==, 1);
+
+  gpp_timer_wheel_free (wheel);
+}
+
+static void
+test_cancel (void)
+{
+  guint n_fired = 0;
+  GPPTimerWheel *wheel = gpp_timer_wheel_new (RESOLUTION,
+      (GPPTimerFunc) count_fired, &n_fired);
+  GPPTimer timer = { { NULL, }, };
+  gint64 deadline = g_get_monotonic_time () + 2 * RESOLUTION;
+
+  gpp_timer_wheel_schedule (wheel, &timer, deadline);
+  gpp_timer_wheel_cancel (wheel, &timer);
+  gpp_timer_wheel_advance (wheel, deadline + RESOLUTION);
+  g_assert_cmpuint (n_fired, ==, 0);
+
+  gpp_timer_wheel_free (wheel);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/timer-wheel/deadline-mid-tick", test_deadline_mid_tick);
+  g_test_add_func ("/timer-wheel/deadline-next-revolution",
+      test_deadline_next_revolution);
+  g_test_add_func ("/timer-wheel/cancel", test_cancel);
+
+  return g_test_run ();
+}